@@ -122,7 +122,7 @@ public:
 template< typename Allocator, size_t Index = 0 >
 struct StaticAllocator
 {
-    using Allocator = Allocator;
+    using allocator_type = Allocator;
     static constexpr size_t INDEX = Index;
 
     static Allocator sInstance;
@@ -153,7 +153,7 @@ constexpr bool operator ==( StaticAllocator< Allo, I >, StaticAllocator< Allo, I
 template< typename Allocator, size_t Index = 0 >
 struct ThreadStaticAllocator
 {
-    using Allocator = Allocator;
+    using allocator_type = Allocator;
     static constexpr size_t INDEX = Index;
 
     thread_local static Allocator sInstance;
@@ -263,7 +263,7 @@ public:
     Blk allocate( size_t size )
     {
         size_t rounded_size = _round_to_aligned( size );
-        if ( rounded_size > memory + SIZE - ptr )
+        if ( rounded_size > size_t( memory + SIZE - ptr ) )
             return { nullptr, 0 };
 
         Blk result = { ptr, size };
@@ -274,8 +274,8 @@ public:
     void deallocate( Blk blk )
     {
         assert( owns( blk.ptr ) );
-        if ( blk.ptr + _round_to_aligned( blk.size ) == ptr )
-            ptr = blk.ptr;
+        if ( (byte*) blk.ptr + _round_to_aligned( blk.size ) == ptr )
+            ptr = (byte*) blk.ptr;
     }
 
     constexpr bool owns( void* ptr )
@@ -300,7 +300,7 @@ class BitsetAllocator
 {
 public:
 
-    using Word = unsigned __int64;
+    using Word = std::uint64_t;
 
     static constexpr size_t SIZE = Bytes;
     static constexpr size_t ALIGNMENT = Align;
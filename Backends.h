@@ -0,0 +1,165 @@
+// Andrew Meckling
+// Nav Bhatti
+#pragma once
+
+#include "Grayscale.h"
+#ifndef GRAY_NO_OPENCL
+#include "OpenCLKernel.h"
+#endif
+
+#include <memory>
+#include <string>
+#include <thread>
+
+// A way of converting RGBA8 images to grayscale. Everything that only has
+// to happen once (finding the platform, creating the context, building the
+// kernel) happens in the constructor, so calls can be timed on their own.
+class GrayscaleBackend
+{
+public:
+
+    virtual ~GrayscaleBackend() = default;
+
+    // False if the backend couldn't be set up, e.g. missing OpenCL device.
+    virtual bool available() const
+    {
+        return true;
+    }
+
+    virtual void operator ()( Array< byte > image ) = 0;
+};
+
+// Converts on the calling thread.
+class SerialBackend : public GrayscaleBackend
+{
+public:
+
+    void operator ()( Array< byte > image ) override
+    {
+        serialGrayscale( image );
+    }
+};
+
+// Stands in for a backend that can't run in this build.
+class UnavailableBackend : public GrayscaleBackend
+{
+public:
+
+    bool available() const override
+    {
+        return false;
+    }
+
+    void operator ()( Array< byte > ) override
+    {
+    }
+};
+
+#ifndef GRAY_NO_OPENCL
+
+// Returns the first platform that has a device of the given type, or
+// nullptr if there is none (or no OpenCL runtime at all).
+inline cl_platform_id findPlatform( cl_device_type deviceType )
+{
+    cl_platform_id platforms[ 8 ];
+    cl_uint numPlatforms = 0;
+    if ( clGetPlatformIDs( 8, platforms, &numPlatforms ) != CL_SUCCESS )
+        return nullptr;
+
+    for ( cl_uint i = 0; i < numPlatforms && i < 8; ++i )
+    {
+        cl_uint numDevices = 0;
+        if ( clGetDeviceIDs( platforms[ i ], deviceType, 0, nullptr, &numDevices ) == CL_SUCCESS
+             && numDevices > 0 )
+            return platforms[ i ];
+    }
+    return nullptr;
+}
+
+// Runs grayscale.cl on the first OpenCL platform with a device of the
+// given type.
+class OpenCLBackend : public GrayscaleBackend
+{
+private:
+
+    std::unique_ptr< OpenCLKernel< byte* > > _kernel;
+
+public:
+
+    explicit OpenCLBackend( cl_device_type deviceType, const char* fileName = "grayscale.cl" )
+    {
+        if ( cl_platform_id platform = findPlatform( deviceType ) )
+            _kernel.reset( new OpenCLKernel< byte* >( platform, fileName, deviceType ) );
+    }
+
+    bool available() const override
+    {
+        return _kernel != nullptr;
+    }
+
+    void operator ()( Array< byte > image ) override
+    {
+        _kernel->globalWorkSize[ 0 ] = image.count / 4;
+        (*_kernel)( { image.array, image.count } );
+    }
+};
+
+// Converts the first half of the image on the gpu and the other half on
+// the cpu at the same time.
+class SplitBackend : public GrayscaleBackend
+{
+private:
+
+    OpenCLBackend _gpu;
+    OpenCLBackend _cpu;
+
+public:
+
+    SplitBackend()
+        : _gpu( CL_DEVICE_TYPE_GPU )
+        , _cpu( CL_DEVICE_TYPE_CPU )
+    {
+    }
+
+    bool available() const override
+    {
+        return _gpu.available() && _cpu.available();
+    }
+
+    void operator ()( Array< byte > image ) override
+    {
+        size_t half_len = image.count / 8 * 4; // Split on a pixel boundary.
+
+        std::thread gpu( [&]() {
+            _gpu( { image.array, half_len } );
+        } );
+        std::thread cpu( [&]() {
+            _cpu( { image.array + half_len, image.count - half_len } );
+        } );
+        gpu.join();
+        cpu.join();
+    }
+};
+
+#endif // GRAY_NO_OPENCL
+
+// Creates a backend by name: serial, gpu, cpu or gcpu. Returns nullptr
+// for unknown names. Without OpenCL the last three are never available.
+inline std::unique_ptr< GrayscaleBackend > makeBackend( const std::string& name )
+{
+    std::unique_ptr< GrayscaleBackend > backend;
+    if ( name == "serial" )
+        backend.reset( new SerialBackend() );
+#ifndef GRAY_NO_OPENCL
+    else if ( name == "gpu" )
+        backend.reset( new OpenCLBackend( CL_DEVICE_TYPE_GPU ) );
+    else if ( name == "cpu" )
+        backend.reset( new OpenCLBackend( CL_DEVICE_TYPE_CPU ) );
+    else if ( name == "gcpu" )
+        backend.reset( new SplitBackend() );
+#else
+    else if ( name == "gpu" || name == "cpu" || name == "gcpu" )
+        backend.reset( new UnavailableBackend() );
+#endif
+    return backend;
+}
@@ -0,0 +1,250 @@
+// Andrew Meckling
+// Nav Bhatti
+#pragma once
+
+#include "lodepng.h"
+#include "Grayscale.h"
+#include "BoundedQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// One image on its way through the batch pipeline.
+struct BatchJob
+{
+    std::string         inFile;
+    std::string         outFile;
+    std::vector< byte > png;    // Encoded file, read or to be written.
+    std::vector< byte > image;  // Decoded RGBA8 pixels.
+    unsigned            width = 0;
+    unsigned            height = 0;
+    unsigned            error = 0; // lodepng error code of the failed stage.
+};
+
+// Number of threads per stage. Decode and encode get most of the cores,
+// since inflate and especially deflate are the slow parts.
+struct BatchOptions
+{
+    unsigned readThreads = 1;
+    unsigned decodeThreads;
+    unsigned transformThreads = 1;
+    unsigned encodeThreads;
+    unsigned writeThreads = 1;
+    size_t   queueDepth = 4; // Images that may wait between two stages.
+
+    BatchOptions()
+    {
+        unsigned cores = std::max( std::thread::hardware_concurrency(), 2u );
+        decodeThreads = std::max( cores / 3, 1u );
+        encodeThreads = std::max( cores - decodeThreads, 1u );
+    }
+};
+
+// Adds path to files, or all .png files in it if path is a directory.
+inline void collectImages( const std::string& path, std::vector< std::string >& files )
+{
+    auto isPng = []( const std::string& name ) {
+        if ( name.size() < 4 )
+            return false;
+        std::string ext = name.substr( name.size() - 4 );
+        std::transform( ext.begin(), ext.end(), ext.begin(), ::tolower );
+        return ext == ".png";
+    };
+
+    std::vector< std::string > found;
+#ifdef _WIN32
+    DWORD attribs = GetFileAttributesA( path.c_str() );
+    if ( attribs == INVALID_FILE_ATTRIBUTES || !(attribs & FILE_ATTRIBUTE_DIRECTORY) )
+    {
+        files.push_back( path );
+        return;
+    }
+
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA( (path + "\\*").c_str(), &data );
+    if ( find != INVALID_HANDLE_VALUE )
+    {
+        do
+            if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isPng( data.cFileName ) )
+                found.push_back( path + "\\" + data.cFileName );
+        while ( FindNextFileA( find, &data ) );
+        FindClose( find );
+    }
+#else
+    DIR* dir = opendir( path.c_str() );
+    if ( dir == nullptr )
+    {
+        files.push_back( path );
+        return;
+    }
+
+    while ( dirent* entry = readdir( dir ) )
+        if ( isPng( entry->d_name ) )
+            found.push_back( path + "/" + entry->d_name );
+    closedir( dir );
+#endif
+
+    std::sort( found.begin(), found.end() );
+    files.insert( files.end(), found.begin(), found.end() );
+}
+
+// Creates the directory if it doesn't exist yet.
+inline void makeDirectory( const std::string& path )
+{
+#ifdef _WIN32
+    _mkdir( path.c_str() );
+#else
+    mkdir( path.c_str(), 0755 );
+#endif
+}
+
+namespace detail
+{
+    // Starts numThreads threads that apply fn to every job from in and pass
+    // it on to out. Failed jobs are passed on untouched. out is closed when
+    // the last of the threads runs out of work.
+    template< typename Fn >
+    void startStage( std::vector< std::thread >& threads,
+                     unsigned                    numThreads,
+                     BoundedQueue< BatchJob >&   in,
+                     BoundedQueue< BatchJob >&   out,
+                     Fn                          fn )
+    {
+        numThreads = std::max( numThreads, 1u );
+        auto running = std::make_shared< std::atomic< unsigned > >( numThreads );
+
+        for ( unsigned i = 0; i < numThreads; ++i )
+            threads.emplace_back( [&in, &out, fn, running]() {
+                BatchJob job;
+                while ( in.pop( job ) )
+                {
+                    if ( !job.error )
+                        fn( job );
+                    out.push( std::move( job ) );
+                }
+                if ( --*running == 0 )
+                    out.close();
+            } );
+    }
+}
+
+// Converts every file in files to grayscale, writing the results with the
+// same name to outDir. Files with the same name from different directories
+// would overwrite each other's output, so none of them are converted and
+// they all count as failed. Reading, decoding, transform, encoding and
+// writing each run on their own threads connected by bounded queues, so a
+// batch keeps all stages busy at once. transform converts the images, on
+// options.transformThreads threads; the backends of Backends.h must only be
+// called by one thread at a time, which is the default. Returns the number
+// of failed images.
+inline size_t runBatch( const std::vector< std::string >&    files,
+                        const std::string&                   outDir,
+                        const BatchOptions&                  options = BatchOptions(),
+                        std::function< void( Array< byte > ) > transform = serialGrayscale )
+{
+    makeDirectory( outDir );
+
+    auto outName = []( const std::string& file ) {
+        std::string name = file.substr( file.find_last_of( "/\\" ) + 1 );
+#ifdef _WIN32
+        // Names that only differ in case are the same file to Windows.
+        std::transform( name.begin(), name.end(), name.begin(), ::tolower );
+#endif
+        return name;
+    };
+
+    std::map< std::string, size_t > outputs;
+    for ( const std::string& file : files )
+        ++outputs[ outName( file ) ];
+
+    size_t failed = 0;
+    std::vector< const std::string* > unique;
+    for ( const std::string& file : files )
+    {
+        if ( outputs[ outName( file ) ] > 1 )
+        {
+            std::cerr << file << ": another input has the same name, skipped" << std::endl;
+            ++failed;
+        }
+        else
+            unique.push_back( &file );
+    }
+
+    BoundedQueue< BatchJob > toRead( options.queueDepth ),
+                             toDecode( options.queueDepth ),
+                             toTransform( options.queueDepth ),
+                             toEncode( options.queueDepth ),
+                             toWrite( options.queueDepth ),
+                             done( options.queueDepth );
+
+    std::vector< std::thread > threads;
+
+    threads.emplace_back( [&]() {
+        for ( const std::string* file : unique )
+        {
+            BatchJob job;
+            job.inFile = *file;
+            job.outFile = outDir + "/" + file->substr( file->find_last_of( "/\\" ) + 1 );
+            toRead.push( std::move( job ) );
+        }
+        toRead.close();
+    } );
+
+    detail::startStage( threads, options.readThreads, toRead, toDecode, []( BatchJob& job ) {
+        job.error = lodepng::load_file( job.png, job.inFile );
+    } );
+
+    detail::startStage( threads, options.decodeThreads, toDecode, toTransform, []( BatchJob& job ) {
+        job.error = decodeImage( job.image, job.width, job.height, job.png );
+        std::vector< byte >().swap( job.png );
+    } );
+
+    detail::startStage( threads, options.transformThreads, toTransform, toEncode, [transform]( BatchJob& job ) {
+        transform( job.image );
+    } );
+
+    detail::startStage( threads, options.encodeThreads, toEncode, toWrite, []( BatchJob& job ) {
+        // One per encode thread, so the hash tables and buffers are set up
+        // once for the whole batch.
+        thread_local lodepng::EncoderContext context;
+        job.error = encodeGrayscale( job.png, job.image, job.width, job.height, ThreadPool::shared(), context.get() );
+        std::vector< byte >().swap( job.image );
+    } );
+
+    detail::startStage( threads, options.writeThreads, toWrite, done, []( BatchJob& job ) {
+        job.error = lodepng::save_file( job.png, job.outFile );
+    } );
+
+    BatchJob job;
+    while ( done.pop( job ) )
+    {
+        if ( job.error )
+        {
+            std::cerr << job.inFile << ": error " << job.error << ": "
+                      << lodepng_error_text( job.error ) << std::endl;
+            ++failed;
+        }
+    }
+
+    for ( std::thread& thread : threads )
+        thread.join();
+
+    return failed;
+}
@@ -0,0 +1,68 @@
+// Andrew Meckling
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking FIFO queue with a fixed capacity, for handing work between
+// threads. push blocks while the queue is full, pop blocks while it is
+// empty. After close, pushes are dropped and pop drains what is left.
+template< typename T >
+class BoundedQueue
+{
+private:
+
+    std::deque< T > _items;
+    size_t          _capacity;
+    bool            _closed = false;
+
+    std::mutex              _mutex;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+
+public:
+
+    explicit BoundedQueue( size_t capacity )
+        : _capacity( capacity > 0 ? capacity : 1 )
+    {
+    }
+
+    // Returns false if the queue was closed and the item was dropped.
+    bool push( T item )
+    {
+        std::unique_lock< std::mutex > lck( _mutex );
+        _notFull.wait( lck, [&]() { return _closed || _items.size() < _capacity; } );
+
+        if ( _closed )
+            return false;
+
+        _items.push_back( std::move( item ) );
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and empty.
+    bool pop( T& item )
+    {
+        std::unique_lock< std::mutex > lck( _mutex );
+        _notEmpty.wait( lck, [&]() { return _closed || !_items.empty(); } );
+
+        if ( _items.empty() )
+            return false;
+
+        item = std::move( _items.front() );
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    // Wakes all waiting threads; no more items will be accepted.
+    void close()
+    {
+        std::lock_guard< std::mutex > lck( _mutex );
+        _closed = true;
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+};
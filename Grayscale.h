@@ -0,0 +1,101 @@
+// Andrew Meckling
+// Nav Bhatti
+#pragma once
+
+#include "lodepng.h"
+#include "Memory.h"
+#include "ThreadPool.h"
+
+#include <vector>
+
+// Converts RGBA8 pixels to grayscale in place. Alpha stays the same.
+inline void serialGrayscale( Array< byte > image )
+{
+    for ( size_t i = 0; i < image.count; i += 4 )
+    {
+        byte gray = byte( image[ i + 0 ] * 0.21
+                        + image[ i + 1 ] * 0.72
+                        + image[ i + 2 ] * 0.07 );
+        image[ i + 0 ] = gray;
+        image[ i + 1 ] = gray;
+        image[ i + 2 ] = gray;
+    }
+}
+
+// True if every pixel of the RGBA8 image has alpha 255.
+inline bool isOpaque( const byte* rgba, size_t numPixels )
+{
+    for ( size_t i = 0; i < numPixels; ++i )
+        if ( rgba[ i * 4 + 3 ] != 255 )
+            return false;
+    return true;
+}
+
+// Copies the gray channel (and alpha, if withAlpha) of converted RGBA8
+// pixels to out: 1 or 2 bytes per pixel.
+inline void packGray( byte* out, const byte* rgba, size_t numPixels, bool withAlpha )
+{
+    if ( withAlpha )
+        for ( size_t i = 0; i < numPixels; ++i )
+        {
+            out[ i * 2 + 0 ] = rgba[ i * 4 + 0 ];
+            out[ i * 2 + 1 ] = rgba[ i * 4 + 3 ];
+        }
+    else
+        for ( size_t i = 0; i < numPixels; ++i )
+            out[ i ] = rgba[ i * 4 ];
+}
+
+// Sets up state to encode 8-bit grey (or grey+alpha) rows as the same
+// color type. The encoder doesn't have to scan the image for its colors.
+inline void setGrayState( LodePNGState& state, bool withAlpha )
+{
+    LodePNGColorType colortype = withAlpha ? LCT_GREY_ALPHA : LCT_GREY;
+    state.info_raw.colortype = colortype;
+    state.info_raw.bitdepth = 8;
+    state.info_png.color.colortype = colortype;
+    state.info_png.color.bitdepth = 8;
+    state.encoder.auto_convert = 0;
+}
+
+// The parallel_for of the decoder and zlib encoder settings, on the ThreadPool given as context.
+inline void poolParallelFor( void (*task)( void* data, size_t index ), void* data, size_t count, void* context )
+{
+    static_cast< ThreadPool* >( context )->parallelFor( count, [=]( size_t i ) { task( data, i ); } );
+}
+
+// Encodes an RGBA8 image that was converted to grayscale as an 8-bit grey
+// PNG, or grey+alpha if any pixel isn't opaque, so the encoder only has a
+// quarter (or half) of the data to filter and compress. Big images are
+// deflated a piece per task on pool. If context isn't null the encoder
+// reuses its memory instead of allocating its own.
+inline unsigned encodeGrayscale( std::vector< byte >& png, const std::vector< byte >& image,
+                                 unsigned width, unsigned height, ThreadPool& pool = ThreadPool::shared(),
+                                 LodePNGEncoderContext* context = nullptr )
+{
+    size_t numPixels = size_t( width ) * height;
+    if ( image.size() < numPixels * 4 )
+        return 84;
+
+    bool withAlpha = !isOpaque( image.data(), numPixels );
+    std::vector< byte > gray( numPixels * (withAlpha ? 2 : 1) );
+    packGray( gray.data(), image.data(), numPixels, withAlpha );
+
+    lodepng::State state;
+    setGrayState( state, withAlpha );
+    state.encoder.zlibsettings.parallel_for = poolParallelFor;
+    state.encoder.zlibsettings.parallel_context = &pool;
+    state.encoder.zlibsettings.context = context;
+    return lodepng::encode( png, gray, width, height, state );
+}
+
+// Decodes a PNG to RGBA8 pixels. PNGs written with restart_rows are
+// inflated and unfiltered a segment per task on pool.
+inline unsigned decodeImage( std::vector< byte >& image, unsigned& width, unsigned& height,
+                             const std::vector< byte >& png, ThreadPool& pool = ThreadPool::shared() )
+{
+    lodepng::State state;
+    state.decoder.parallel_for = poolParallelFor;
+    state.decoder.parallel_context = &pool;
+    return lodepng::decode( image, width, height, state, png );
+}
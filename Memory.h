@@ -2,11 +2,12 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <malloc.h>
 #include <vector>
 
-using byte = unsigned __int8; // 8-bit bitfield.
+using byte = std::uint8_t; // 8-bit bitfield.
 
 // Represents a unit of allocated memory.
 struct Blk
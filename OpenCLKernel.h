@@ -68,6 +68,8 @@ namespace detail
         const cl_device_id* devices,
         cl_uint             numDevices,
         std::string*        pFirstKernel = nullptr );
+
+    cl_kernel clone_kernel( cl_kernel kernel );
 }
 
 template< typename... Args >
@@ -84,7 +86,7 @@ private:
     cl_program       _program;
     cl_kernel        _kernel;
 
-    cl_mem _memBuffers[ NUM_ARGS ];
+    cl_mem _memBuffers[ NUM_ARGS ] = {};
 
     std::mutex _mutex;
 
@@ -136,13 +138,16 @@ public:
 
     OpenCLKernel( const OpenCLKernel& copy )
         : _numDevices( copy._numDevices )
-        , _context( clRetainContext( copy._context ) )
-        , _program( clRetainProgram( copy._program ) )
-        , _kernel( clCloneKernel( copy._kernel ) )
+        , _context( (clRetainContext( copy._context ), copy._context) )
+        , _program( (clRetainProgram( copy._program ), copy._program) )
+        , _kernel( detail::clone_kernel( copy._kernel ) )
         , workDim( copy.workDim )
     {
         for ( size_t i = 0; i < _numDevices; ++i )
-            _queues[ i ] = clRetainCommandQueue( copy._queues[ i ] );
+        {
+            clRetainCommandQueue( copy._queues[ i ] );
+            _queues[ i ] = copy._queues[ i ];
+        }
 
         for ( int i = 0; i < 3; ++i )
         {
@@ -358,3 +363,17 @@ inline cl_program detail::create_program(
 
     return program;
 }
+
+// Creates a new kernel for the same function of the same program. The
+// arguments aren't copied, they're set on every call anyway. (Unlike
+// clCloneKernel, this doesn't need OpenCL 2.1.)
+inline cl_kernel detail::clone_kernel( cl_kernel kernel )
+{
+    cl_program program;
+    char       name[ 256 ];
+
+    clGetKernelInfo( kernel, CL_KERNEL_PROGRAM, sizeof( program ), &program, NULL );
+    clGetKernelInfo( kernel, CL_KERNEL_FUNCTION_NAME, sizeof( name ), name, NULL );
+
+    return clCreateKernel( program, name, NULL );
+}
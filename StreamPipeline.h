@@ -0,0 +1,180 @@
+// Andrew Meckling
+// Nav Bhatti
+#pragma once
+
+#include "lodepng.h"
+#include "Grayscale.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Collects decoded RGBA8 rows into a band, converts the band to grayscale
+// and hands it to the row encoder. Only one band of the image is ever held.
+// The encoder is started at the first row: by then the decoder has read all
+// chunks before the image data, so it's known if the input has transparency.
+struct StreamGrayscale
+{
+    const LodePNGState&  decodeState;
+    LodePNGWriteCallback write;
+    void*                context;
+    LodePNGState         encodeState;
+    LodePNGRowEncoder*   encoder = nullptr;
+    std::vector< byte >  band;
+    std::vector< byte >  packed;
+    size_t               width;
+    unsigned             height;
+    unsigned             bandRows;
+    bool                 withAlpha = false;
+    unsigned             numRows = 0;
+
+    StreamGrayscale( const LodePNGState& decodeState, unsigned width, unsigned height, unsigned bandRows,
+                     LodePNGWriteCallback write, void* context )
+        : decodeState( decodeState )
+        , write( write )
+        , context( context )
+        , band( size_t( width ) * 4 * bandRows )
+        , width( width )
+        , height( height )
+        , bandRows( bandRows )
+    {
+        lodepng_state_init( &encodeState );
+    }
+
+    ~StreamGrayscale()
+    {
+        lodepng_state_cleanup( &encodeState );
+    }
+
+    // The output is grey+alpha if the input can have transparent pixels: it
+    // has an alpha channel, a color key or a palette with alpha.
+    unsigned begin()
+    {
+        withAlpha = lodepng_can_have_alpha( &decodeState.info_png.color ) != 0;
+        setGrayState( encodeState, withAlpha );
+        packed.resize( width * (withAlpha ? 2 : 1) * bandRows );
+        return lodepng_row_encoder_begin( &encoder, unsigned( width ), height, &encodeState, write, context );
+    }
+
+    unsigned flush()
+    {
+        Array< byte > rows = { band.data(), width * 4 * numRows };
+        serialGrayscale( rows );
+        packGray( packed.data(), rows, width * numRows, withAlpha );
+
+        unsigned error = lodepng_row_encoder_write( encoder, packed.data(), numRows );
+        numRows = 0;
+        return error;
+    }
+
+    // Encodes the last band and finishes the encoder. error is the result
+    // of decoding, which is returned if it failed.
+    unsigned finish( unsigned error )
+    {
+        if ( !error && numRows )
+            error = flush();
+
+        if ( encoder )
+        {
+            unsigned finishError = lodepng_row_encoder_finish( encoder );
+            encoder = nullptr;
+            if ( !error )
+                error = finishError;
+        }
+        return error;
+    }
+
+    // LodePNGRowCallback, context is the StreamGrayscale.
+    static unsigned onRow( void* context, const unsigned char* row, unsigned )
+    {
+        auto& self = *(StreamGrayscale*) context;
+
+        if ( !self.encoder )
+            if ( unsigned error = self.begin() )
+                return error;
+
+        size_t rowBytes = self.width * 4;
+        std::memcpy( self.band.data() + rowBytes * self.numRows, row, rowBytes );
+        if ( ++self.numRows == self.bandRows )
+            return self.flush();
+        return 0;
+    }
+};
+
+// Decodes the PNG in memory, converts it to grayscale and gives the encoded
+// result to write, one band of bandRows rows at a time. The decoded image is
+// never held in full, so memory use stays at a few bands plus the zlib
+// windows for any size. The output is 8-bit grey, or grey+alpha if the
+// input can have transparent pixels. Returns a lodepng error code.
+inline unsigned streamGrayscale( const unsigned char* png, size_t pngSize,
+                                 LodePNGWriteCallback write, void* context,
+                                 unsigned bandRows = 64 )
+{
+    // The rows are decoded to RGBA8, the default of a new state.
+    unsigned width, height;
+    LodePNGState decodeState;
+    lodepng_state_init( &decodeState );
+    unsigned error = lodepng_inspect( &width, &height, &decodeState, png, pngSize );
+
+    if ( !error )
+    {
+        StreamGrayscale stream( decodeState, width, height, bandRows, write, context );
+        error = lodepng_decode_rows( &width, &height, &decodeState, png, pngSize,
+                                     StreamGrayscale::onRow, &stream );
+        error = stream.finish( error );
+    }
+
+    lodepng_state_cleanup( &decodeState );
+    return error;
+}
+
+// Same as above, from inFile to outFile. The input is read in pieces of
+// readSize bytes, and each piece is decoded before the next one is read,
+// so neither file is ever held in memory either.
+inline unsigned streamGrayscale( const char* inFile, const char* outFile, unsigned bandRows = 64,
+                                 size_t readSize = 65536 )
+{
+    std::vector< byte > piece( readSize );
+    FILE* in = std::fopen( inFile, "rb" );
+    if ( !in )
+        return 78;
+
+    // The header is enough to size the bands.
+    size_t size = std::fread( piece.data(), 1, piece.size(), in );
+    unsigned width, height;
+    LodePNGState decodeState;
+    lodepng_state_init( &decodeState );
+    unsigned error = lodepng_inspect( &width, &height, &decodeState, piece.data(), size );
+
+    FILE* out = nullptr;
+    if ( !error && !(out = std::fopen( outFile, "wb" )) )
+        error = 79;
+
+    if ( !error )
+    {
+        StreamGrayscale stream( decodeState, width, height, bandRows, lodepng_write_file, out );
+        LodePNGRowDecoder* decoder;
+        error = lodepng_row_decoder_begin( &decoder, &decodeState, StreamGrayscale::onRow, &stream );
+        if ( decoder )
+        {
+            while ( !error && size > 0 )
+            {
+                error = lodepng_row_decoder_write( decoder, piece.data(), size );
+                size = std::fread( piece.data(), 1, piece.size(), in );
+            }
+            if ( !error && std::ferror( in ) )
+                error = 78;
+            unsigned decodeError = lodepng_row_decoder_finish( decoder, &width, &height );
+            if ( !error )
+                error = decodeError;
+        }
+        error = stream.finish( error );
+    }
+
+    if ( out && std::fclose( out ) && !error )
+        error = 79;
+
+    std::fclose( in );
+    lodepng_state_cleanup( &decodeState );
+    return error;
+}
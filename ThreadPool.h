@@ -0,0 +1,137 @@
+// Andrew Meckling
+// Nav Bhatti
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting one piece of work, like the
+// segments of a PNG, over the cores. Several threads may call parallelFor
+// at the same time; their loops are shared out in the order they came in.
+class ThreadPool
+{
+private:
+
+    struct Loop
+    {
+        std::function< void( size_t ) > fn;
+        size_t                          count;
+        std::atomic< size_t >           next{ 0 };
+        unsigned                        helpers = 0; // Workers inside _run, guarded by _mutex.
+    };
+
+    std::vector< std::thread > _threads;
+    std::deque< Loop* >        _loops;
+    bool                       _stopping = false;
+
+    std::mutex              _mutex;
+    std::condition_variable _hasLoop;
+    std::condition_variable _helperDone;
+
+public:
+
+    explicit ThreadPool( unsigned numThreads )
+    {
+        for ( unsigned i = 0; i < numThreads; ++i )
+            _threads.emplace_back( [this]() { _work(); } );
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard< std::mutex > lck( _mutex );
+            _stopping = true;
+        }
+        _hasLoop.notify_all();
+        for ( std::thread& thread : _threads )
+            thread.join();
+    }
+
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator =( const ThreadPool& ) = delete;
+
+    // One pool for the whole program, with a worker for every core but
+    // the one that calls parallelFor.
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool( std::max( std::thread::hardware_concurrency(), 1u ) - 1 );
+        return pool;
+    }
+
+    size_t size() const
+    {
+        return _threads.size();
+    }
+
+    // Calls fn( i ) for every i in [0, count) and returns when all calls
+    // are done. The calling thread takes part, so a pool without workers
+    // (or a loop nobody picks up) still gets through. fn must not throw.
+    void parallelFor( size_t count, std::function< void( size_t ) > fn )
+    {
+        if ( _threads.empty() || count < 2 )
+        {
+            for ( size_t i = 0; i < count; ++i )
+                fn( i );
+            return;
+        }
+
+        Loop loop;
+        loop.fn = std::move( fn );
+        loop.count = count;
+        {
+            std::lock_guard< std::mutex > lck( _mutex );
+            _loops.push_back( &loop );
+        }
+        _hasLoop.notify_all();
+
+        _run( loop );
+
+        // Every index is claimed now, wait for the workers still running one.
+        std::unique_lock< std::mutex > lck( _mutex );
+        _helperDone.wait( lck, [&]() { return loop.helpers == 0; } );
+        auto it = std::find( _loops.begin(), _loops.end(), &loop );
+        if ( it != _loops.end() )
+            _loops.erase( it );
+    }
+
+private:
+
+    static void _run( Loop& loop )
+    {
+        for ( size_t i; (i = loop.next++) < loop.count; )
+            loop.fn( i );
+    }
+
+    void _work()
+    {
+        std::unique_lock< std::mutex > lck( _mutex );
+        for ( ;; )
+        {
+            // Loops that are handed out completely only wait for their caller.
+            while ( !_loops.empty() && _loops.front()->next >= _loops.front()->count )
+                _loops.pop_front();
+
+            if ( _loops.empty() )
+            {
+                if ( _stopping )
+                    return;
+                _hasLoop.wait( lck );
+                continue;
+            }
+
+            Loop& loop = *_loops.front();
+            ++loop.helpers;
+            lck.unlock();
+            _run( loop );
+            lck.lock();
+            if ( --loop.helpers == 0 )
+                _helperDone.notify_all();
+        }
+    }
+};
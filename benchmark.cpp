@@ -0,0 +1,1141 @@
+// Andrew Meckling
+// Nav Bhatti
+#include "lodepng.h"
+#include "Backends.h"
+#include "StreamPipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// usage: benchmark [--warmup N] [--iterations N] [--sizes name|WxH,...]
+//                  [--cases name,...] [--format text|json|csv] [--out file]
+//                  [--level 0-9] [--strategy default|rle|huffman]
+//                  [--filter zero|minsum|entropy|brute|adaptive]
+//        benchmark --verify name,...
+//
+// Every case runs warmup times untimed, then iterations times timed.
+// Setup (creating images, OpenCL contexts, kernels) is never timed.
+// --level sets the compression level of encode, encode_parallel and
+// encode_context, see lodepng_compress_settings_set_level; without it they
+// use the defaults. --strategy sets the deflate strategy they use, see
+// LodePNGDeflateStrategy, and --filter their filter strategy.
+//
+// --verify runs the named correctness checks instead of timing anything
+// and exits with 1 if any of them fails. The checks are: filters, restarts,
+// deflate, context, convert, crc, adler, budget.
+
+struct BenchSize
+{
+    std::string name;
+    unsigned    width;
+    unsigned    height;
+};
+
+// Named sizes, from tiny to gigapixel. The default run uses the first four.
+// gigapixel is over what lodepng decodes, it only runs the other cases.
+static const BenchSize PRESETS[] = {
+    { "tiny",      64,    64    },
+    { "small",     640,   480   },
+    { "hd",        1920,  1080  },
+    { "4k",        3840,  2160  },
+    { "64mp",      8192,  8192  },
+    { "gigapixel", 32768, 32768 },
+};
+
+// Grayscale backends are run on the raw image, the codec cases on the
+// image encoded as PNG with the default settings. decode_parallel decodes
+// it encoded with restart points on the shared thread pool, and
+// encode_parallel encodes it deflating on the shared pool (encode_gray
+// does too), encode_context encodes it reusing one encoder context, crc
+// checksums the raw image like a chunk.
+static const char* const ALL_CASES[] = {
+    "serial", "gpu", "cpu", "gcpu", "decode", "decode_parallel", "encode", "encode_parallel", "encode_context",
+    "encode_gray", "stream", "crc"
+};
+
+// Scanlines per segment of the PNG for decode_parallel.
+static const unsigned RESTART_ROWS = 64;
+
+// The most pixels lodepng decodes, bigger images are error 92.
+static const unsigned long long MAX_DECODE_PIXELS = 268435455;
+
+struct BenchResult
+{
+    std::string name;
+    std::string size;
+    unsigned    width;
+    unsigned    height;
+    unsigned    iterations;
+    double      min;    // ms
+    double      median; // ms
+    double      p99;    // ms
+    double      mean;   // ms
+    double      bytesPerSecond; // Raw RGBA bytes per second at the median.
+};
+
+struct BenchOptions
+{
+    unsigned                   warmup = 2;
+    unsigned                   iterations = 10;
+    std::vector< BenchSize >   sizes;
+    std::vector< std::string > cases;
+    std::string                format = "text";
+    std::string                out;
+    std::vector< std::string > verify;
+    int                        level = -1; // -1 for the default settings.
+    LodePNGDeflateStrategy     strategy = LDS_DEFAULT;
+    LodePNGFilterStrategy      filter = LFS_MINSUM;
+};
+
+static std::vector< std::string > split( const std::string& list )
+{
+    std::vector< std::string > items;
+    std::istringstream iss( list );
+    std::string item;
+    while ( std::getline( iss, item, ',' ) )
+        if ( !item.empty() )
+            items.push_back( item );
+    return items;
+}
+
+static bool parseStrategy( const std::string& str, LodePNGDeflateStrategy& strategy )
+{
+    if ( str == "default" )
+        strategy = LDS_DEFAULT;
+    else if ( str == "rle" )
+        strategy = LDS_RLE;
+    else if ( str == "huffman" )
+        strategy = LDS_HUFFMAN_ONLY;
+    else
+        return false;
+    return true;
+}
+
+static bool parseFilter( const std::string& str, LodePNGFilterStrategy& filter )
+{
+    if ( str == "zero" )
+        filter = LFS_ZERO;
+    else if ( str == "minsum" )
+        filter = LFS_MINSUM;
+    else if ( str == "entropy" )
+        filter = LFS_ENTROPY;
+    else if ( str == "brute" )
+        filter = LFS_BRUTE_FORCE;
+    else if ( str == "adaptive" )
+        filter = LFS_ADAPTIVE;
+    else
+        return false;
+    return true;
+}
+
+// The compression settings of the encode cases: --level, --strategy and
+// --filter.
+static void setCompression( LodePNGEncoderSettings& settings, const BenchOptions& options )
+{
+    if ( options.level >= 0 )
+        lodepng_compress_settings_set_level( &settings.zlibsettings, unsigned( options.level ) );
+    settings.zlibsettings.strategy = options.strategy;
+    settings.filter_strategy = options.filter;
+}
+
+static bool parseSize( const std::string& str, BenchSize& size )
+{
+    for ( const BenchSize& preset : PRESETS )
+        if ( preset.name == str )
+            return size = preset, true;
+
+    unsigned w, h;
+    char x;
+    std::istringstream iss( str );
+    if ( !(iss >> w >> x >> h) || x != 'x' || w == 0 || h == 0 )
+        return false;
+
+    size = { str, w, h };
+    return true;
+}
+
+// A small LCG, so that images and verify cases are the same on every run
+// and a failure shows up again.
+struct Random
+{
+    unsigned seed = 12345;
+
+    unsigned operator()()
+    {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    }
+};
+
+// Fills an RGBA8 image with gradients and some noise, so it compresses
+// about as well as a photo rather than perfectly.
+static std::vector< byte > makeImage( unsigned width, unsigned height )
+{
+    std::vector< byte > image( size_t( width ) * height * 4 );
+    Random next;
+
+    size_t i = 0;
+    for ( unsigned y = 0; y < height; ++y )
+        for ( unsigned x = 0; x < width; ++x, i += 4 )
+        {
+            byte noise = byte( next() & 7 );
+            image[ i + 0 ] = byte( x * 255 / width + noise );
+            image[ i + 1 ] = byte( y * 255 / height + noise );
+            image[ i + 2 ] = byte( (x ^ y) + noise );
+            image[ i + 3 ] = 255;
+        }
+    return image;
+}
+
+static unsigned discardOutput( void*, const unsigned char*, size_t )
+{
+    return 0;
+}
+
+// Runs fn warmup + iterations times and summarizes the timed runs in
+// result. fn returns a lodepng error code: if any run fails, the case is
+// reported as failed and false returned, without a result.
+static bool measure( const std::string& name, const BenchSize& size, const BenchOptions& options,
+                     const std::function< unsigned() >& fn, BenchResult& result )
+{
+    using namespace std::chrono;
+
+    auto failed = [&]( unsigned error ) {
+        std::cerr << name << " " << size.name << " failed, error " << error << ": " << lodepng_error_text( error )
+                  << std::endl;
+        return false;
+    };
+
+    for ( unsigned i = 0; i < options.warmup; ++i )
+        if ( unsigned error = fn() )
+            return failed( error );
+
+    std::vector< double > samples;
+    for ( unsigned i = 0; i < options.iterations; ++i )
+    {
+        auto start = steady_clock::now();
+        unsigned error = fn();
+        auto end = steady_clock::now();
+        if ( error )
+            return failed( error );
+        samples.push_back( duration_cast< nanoseconds >( end - start ).count() / 1'000'000.0 );
+    }
+    if ( samples.empty() )
+        return false;
+    std::sort( samples.begin(), samples.end() );
+
+    result = { name, size.name, size.width, size.height, options.iterations };
+    size_t n = samples.size();
+    result.min = samples[ 0 ];
+    result.median = n % 2 ? samples[ n / 2 ] : (samples[ n / 2 - 1 ] + samples[ n / 2 ]) / 2;
+    result.p99 = samples[ std::min( n - 1, (n * 99 + 99) / 100 - 1 ) ];
+
+    double sum = 0;
+    for ( double sample : samples )
+        sum += sample;
+    result.mean = sum / n;
+
+    double bytes = double( size.width ) * size.height * 4;
+    result.bytesPerSecond = result.median > 0 ? bytes / (result.median / 1000.0) : 0;
+    return true;
+}
+
+static void runSize( const BenchSize& size, const BenchOptions& options, std::vector< BenchResult >& results )
+{
+    std::vector< byte > image = makeImage( size.width, size.height );
+    std::vector< byte > png;
+
+    auto uses = [&]( const char* name ) {
+        return std::find( options.cases.begin(), options.cases.end(), name ) != options.cases.end();
+    };
+    bool decodable = (unsigned long long)size.width * size.height <= MAX_DECODE_PIXELS;
+
+    if ( decodable && (uses( "decode" ) || uses( "stream" )) )
+    {
+        if ( unsigned error = lodepng::encode( png, image, size.width, size.height ) )
+        {
+            std::cerr << size.name << ": encoder error " << error << ": " << lodepng_error_text( error ) << std::endl;
+            return;
+        }
+    }
+
+    std::vector< byte > restartPng;
+    if ( decodable && uses( "decode_parallel" ) )
+    {
+        lodepng::State state;
+        state.encoder.restart_rows = RESTART_ROWS;
+        if ( unsigned error = lodepng::encode( restartPng, image, size.width, size.height, state ) )
+        {
+            std::cerr << size.name << ": encoder error " << error << ": " << lodepng_error_text( error ) << std::endl;
+            return;
+        }
+    }
+
+    for ( const std::string& name : options.cases )
+    {
+        auto run = [&]( const std::function< unsigned() >& fn ) {
+            BenchResult result;
+            if ( measure( name, size, options, fn, result ) )
+                results.push_back( result );
+        };
+
+        if ( !decodable && (name == "decode" || name == "decode_parallel" || name == "stream") )
+        {
+            std::cerr << name << " " << size.name << " skipped: " << size.width << "x" << size.height
+                      << " is over the " << MAX_DECODE_PIXELS << " pixels lodepng decodes" << std::endl;
+            continue;
+        }
+        std::cerr << "running " << name << " " << size.name << std::endl;
+
+        if ( name == "decode" )
+        {
+            run( [&]() {
+                std::vector< byte > decoded;
+                unsigned w, h;
+                return lodepng::decode( decoded, w, h, png );
+            } );
+        }
+        else if ( name == "decode_parallel" )
+        {
+            run( [&]() {
+                std::vector< byte > decoded;
+                unsigned w, h;
+                return decodeImage( decoded, w, h, restartPng );
+            } );
+        }
+        else if ( name == "encode" )
+        {
+            lodepng::State state;
+            setCompression( state.encoder, options );
+            run( [&]() {
+                std::vector< byte > encoded;
+                return lodepng::encode( encoded, image, size.width, size.height, state );
+            } );
+        }
+        else if ( name == "encode_parallel" )
+        {
+            lodepng::State state;
+            setCompression( state.encoder, options );
+            state.encoder.zlibsettings.parallel_for = poolParallelFor;
+            state.encoder.zlibsettings.parallel_context = &ThreadPool::shared();
+            run( [&]() {
+                std::vector< byte > encoded;
+                return lodepng::encode( encoded, image, size.width, size.height, state );
+            } );
+        }
+        else if ( name == "encode_context" )
+        {
+            lodepng::State state;
+            setCompression( state.encoder, options );
+            lodepng::EncoderContext context;
+            state.encoder.zlibsettings.context = context.get();
+            run( [&]() {
+                std::vector< byte > encoded;
+                return lodepng::encode( encoded, image, size.width, size.height, state );
+            } );
+        }
+        else if ( name == "encode_gray" )
+        {
+            std::vector< byte > gray = image;
+            serialGrayscale( gray );
+            run( [&]() {
+                std::vector< byte > encoded;
+                return encodeGrayscale( encoded, gray, size.width, size.height );
+            } );
+        }
+        else if ( name == "crc" )
+        {
+            volatile unsigned crc;
+            run( [&]() {
+                crc = lodepng_crc32( image.data(), image.size() );
+                return 0u;
+            } );
+        }
+        else if ( name == "stream" )
+        {
+            run( [&]() {
+                return streamGrayscale( png.data(), png.size(), discardOutput, nullptr );
+            } );
+        }
+        else if ( auto backend = makeBackend( name ) )
+        {
+            if ( !backend->available() )
+            {
+                std::cerr << name << " has no OpenCL device, skipped" << std::endl;
+                continue;
+            }
+
+            // The conversion does the same work whether or not the image
+            // is already gray, so it isn't restored between runs.
+            run( [&]() {
+                (*backend)( image );
+                return 0u;
+            } );
+        }
+        else
+            std::cerr << "unknown case " << name << ", skipped" << std::endl;
+    }
+}
+
+// A custom zlib that leaves the data as it is, for the filtered scanlines
+// of an encode.
+static unsigned keepFiltered( unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* )
+{
+    *out = static_cast< unsigned char* >( malloc( insize ) );
+    if ( !*out )
+        return 83;
+    memcpy( *out, in, insize );
+    *outsize = insize;
+    return 0;
+}
+
+// A color type and bit depth of the verify checks.
+struct Format
+{
+    LodePNGColorType type;
+    unsigned         bitdepth;
+};
+
+// Every color type and bit depth PNG allows.
+static const Format FORMATS[] = {
+    { LCT_GREY, 1 },        { LCT_GREY, 2 },         { LCT_GREY, 4 },    { LCT_GREY, 8 },    { LCT_GREY, 16 },
+    { LCT_PALETTE, 1 },     { LCT_PALETTE, 2 },      { LCT_PALETTE, 4 }, { LCT_PALETTE, 8 }, { LCT_GREY_ALPHA, 8 },
+    { LCT_GREY_ALPHA, 16 }, { LCT_RGB, 8 },          { LCT_RGB, 16 },    { LCT_RGBA, 8 },    { LCT_RGBA, 16 },
+};
+
+static std::ostream& operator<<( std::ostream& out, const Format& format )
+{
+    return out << "type " << format.type << " bitdepth " << format.bitdepth;
+}
+
+// Sets the raw and PNG color modes of state to format, with a random
+// palette of every index the bit depth has for LCT_PALETTE, and turns off
+// auto_convert so the PNG is encoded in exactly that format.
+static void setFormat( lodepng::State& state, const Format& format, Random& next )
+{
+    lodepng_color_mode_init( &state.info_raw );
+    state.info_raw.colortype = format.type;
+    state.info_raw.bitdepth = format.bitdepth;
+    if ( format.type == LCT_PALETTE )
+        for ( unsigned i = 0; i < (1u << format.bitdepth); ++i )
+            lodepng_palette_add( &state.info_raw, byte( next() ), byte( next() ), byte( next() ), 255 );
+
+    lodepng_color_mode_copy( &state.info_png.color, &state.info_raw );
+    state.encoder.auto_convert = 0;
+}
+
+// Prints a failed case of check, described by what, with the lodepng error
+// if there was one. Returns 1, to add to the failures of the check.
+static unsigned reportFailure( const char* check, const std::string& what, unsigned error )
+{
+    std::cerr << check << ": " << what << " failed";
+    if ( error )
+        std::cerr << ", error " << error << ": " << lodepng_error_text( error );
+    std::cerr << std::endl;
+    return 1;
+}
+
+// Round trips random images through the encoder and decoder, with each
+// filter type forced on every scanline, with a random one per scanline and
+// with LFS_ADAPTIVE, for every format of whole bytes per pixel, which are
+// all the ones the unfilter code has a special case for. Below 8 bits
+// pixels filter as bytes too, and the random padding bits at the row ends
+// wouldn't survive the round trip. Random pixels make all the branches of
+// Paeth and Average show up. Every other round is interlaced, where the
+// first row of each pass is unfiltered in place, just behind its filtered
+// bytes. The tall image filtered with LFS_ADAPTIVE on the pool must have
+// the same scanlines as filtered one after the other.
+static unsigned verifyFilters()
+{
+    Random next;
+
+    unsigned failed = 0;
+    for ( const Format& format : FORMATS )
+        for ( unsigned filter = 0; filter <= 6 && format.bitdepth >= 8; ++filter )
+            for ( unsigned round = 0; round < 20; ++round )
+            {
+                // Mostly narrow images, so the row ends get checked a lot.
+                // The last round is tall and filtered in bands on the
+                // shared pool.
+                unsigned w = round == 19 ? 300 + next() % 40 : 1 + next() % (round % 5 ? 40 : 300);
+                unsigned h = round == 19 ? 900 + next() % 200 : 1 + next() % 8;
+                unsigned interlace = round % 2;
+
+                lodepng::State state;
+                setFormat( state, format, next );
+
+                std::vector< byte > image( lodepng_get_raw_size( w, h, &state.info_raw ) );
+                for ( byte& value : image )
+                    value = byte( next() );
+
+                // Filter 5 means a random filter for every scanline, 6
+                // LFS_ADAPTIVE.
+                std::vector< byte > filters( h );
+                for ( byte& value : filters )
+                    value = byte( filter < 5 ? filter : next() % 5 );
+
+                state.info_png.interlace_method = interlace;
+                state.encoder.filter_strategy = filter < 6 ? LFS_PREDEFINED : LFS_ADAPTIVE;
+                state.encoder.predefined_filters = filters.data();
+                if ( round == 19 )
+                {
+                    state.encoder.zlibsettings.parallel_for = poolParallelFor;
+                    state.encoder.zlibsettings.parallel_context = &ThreadPool::shared();
+                }
+
+                std::vector< byte > png, decoded;
+                unsigned error = lodepng::encode( png, image, w, h, state );
+
+                unsigned dw, dh;
+                lodepng::State decodeState;
+                lodepng_color_mode_copy( &decodeState.info_raw, &state.info_raw );
+                if ( !error )
+                    error = lodepng::decode( decoded, dw, dh, decodeState, png );
+
+                bool same = true;
+                if ( !error && filter == 6 && round == 19 )
+                {
+                    std::vector< byte > banded, serial;
+                    state.encoder.zlibsettings.custom_zlib = keepFiltered;
+                    error = lodepng::encode( banded, image, w, h, state );
+                    state.encoder.zlibsettings.parallel_for = nullptr;
+                    if ( !error )
+                        error = lodepng::encode( serial, image, w, h, state );
+                    same = banded == serial;
+                }
+
+                if ( error || decoded != image || !same )
+                {
+                    std::ostringstream what;
+                    what << format << " filter " << filter << " " << w << "x" << h << (interlace ? " interlaced" : "");
+                    failed += reportFailure( "filters", what.str(), error );
+                }
+            }
+    return failed;
+}
+
+// Round trips random images encoded with restart points through the
+// parallel decoder, for every format, and again with a broken restart
+// index, which must make the decoder fall back to decoding in one piece.
+static unsigned verifyRestarts()
+{
+    static const unsigned RESTARTS[] = { 1, 2, 5, 16 };
+    Random next;
+
+    unsigned failed = 0;
+    for ( const Format& format : FORMATS )
+        for ( unsigned restartRows : RESTARTS )
+            for ( unsigned round = 0; round < 10; ++round )
+            {
+                // Widths that aren't a whole number of bytes can't be split.
+                unsigned w = 8 * (1 + next() % 20);
+                unsigned h = 1 + next() % 40;
+
+                lodepng::State state;
+                setFormat( state, format, next );
+
+                // Runs of equal bytes too, so the segments have matches.
+                std::vector< byte > image( lodepng_get_raw_size( w, h, &state.info_raw ) );
+                for ( size_t i = 0; i < image.size(); ++i )
+                    image[ i ] = byte( i > 0 && next() % 4 ? image[ i - 1 ] : next() );
+
+                state.encoder.restart_rows = restartRows;
+
+                std::vector< byte > png;
+                unsigned error = lodepng::encode( png, image, w, h, state );
+
+                for ( unsigned broken = 0; broken < 2; ++broken )
+                {
+                    // Moves the start of the second segment by one byte.
+                    if ( broken )
+                    {
+                        const unsigned char* end = png.data() + png.size();
+                        for ( unsigned char* chunk = png.data() + 8; chunk + 12 <= end;
+                              chunk = lodepng_chunk_next( chunk ) )
+                            if ( lodepng_chunk_type_equals( chunk, "prIX" ) && lodepng_chunk_length( chunk ) >= 8 )
+                            {
+                                ++lodepng_chunk_data( chunk )[ 7 ];
+                                lodepng_chunk_generate_crc( chunk );
+                                break;
+                            }
+                    }
+
+                    std::vector< byte > decoded;
+                    unsigned dw, dh;
+                    lodepng::State decodeState;
+                    lodepng_color_mode_copy( &decodeState.info_raw, &state.info_raw );
+                    decodeState.decoder.parallel_for = poolParallelFor;
+                    decodeState.decoder.parallel_context = &ThreadPool::shared();
+                    if ( !error )
+                        error = lodepng::decode( decoded, dw, dh, decodeState, png );
+
+                    if ( error || decoded != image )
+                    {
+                        std::ostringstream what;
+                        what << format << " restart rows " << restartRows << " " << w << "x" << h
+                             << (broken ? " with broken index" : "");
+                        failed += reportFailure( "restarts", what.str(), error );
+                        break;
+                    }
+                }
+            }
+    return failed;
+}
+
+// Round trips data of sizes around the pieces of the parallel deflate
+// through lodepng_zlib_compress with the shared thread pool, with every
+// block type and deflate strategy. The data repeats at distances across the
+// ends of the pieces, and has runs for the RLE strategy. The small sizes
+// give dynamic blocks that are written with the fixed trees instead.
+static unsigned verifyDeflate()
+{
+    static const size_t SIZES[] = { 0, 1, 40, 1000, 524287, 524288, 524289, 1100000, 1572864 + 3 };
+    static const LodePNGDeflateStrategy STRATEGIES[] = { LDS_DEFAULT, LDS_RLE, LDS_HUFFMAN_ONLY };
+    Random next;
+
+    unsigned failed = 0;
+    for ( size_t size : SIZES )
+        for ( unsigned btype = 0; btype <= 2; ++btype )
+            for ( LodePNGDeflateStrategy strategy : STRATEGIES )
+            {
+                std::vector< byte > data( size );
+                for ( size_t i = 0; i < size; ++i )
+                {
+                    size_t distance = next() % 2 ? 1 + next() % 8 : 1 + next() % 100;
+                    data[ i ] = byte( i >= 100 && next() % 8 ? data[ i - distance ] : next() % 16 );
+                }
+
+                LodePNGCompressSettings settings;
+                lodepng_compress_settings_init( &settings );
+                settings.btype = btype;
+                settings.strategy = strategy;
+                settings.parallel_for = poolParallelFor;
+                settings.parallel_context = &ThreadPool::shared();
+
+                std::vector< byte > compressed, decompressed;
+                unsigned error = lodepng::compress( compressed, data, settings );
+                if ( !error )
+                    error = lodepng::decompress( decompressed, compressed );
+
+                if ( error || decompressed != data )
+                {
+                    std::ostringstream what;
+                    what << "size " << size << " btype " << btype << " strategy " << strategy;
+                    failed += reportFailure( "deflate", what.str(), error );
+                }
+            }
+    return failed;
+}
+
+// Encodes images of changing sizes and settings one after the other with
+// the same encoder context, and compares every PNG with the one encoded
+// without it. The hash tables of the context are only emptied by stamp, so
+// leftovers of an earlier image would change the matches found.
+static unsigned verifyContext()
+{
+    struct Setting
+    {
+        unsigned width;
+        unsigned height;
+        int      level;     // -1 for the default settings
+        unsigned btype;
+        unsigned interlace;
+        unsigned restartRows;
+        LodePNGDeflateStrategy strategy;
+    };
+    static const Setting SETTINGS[] = {
+        { 64, 64, -1, 2, 0, 0, LDS_DEFAULT },   { 300, 200, -1, 2, 0, 0, LDS_DEFAULT },
+        { 17, 5, -1, 2, 0, 0, LDS_DEFAULT },    { 300, 200, 0, 2, 0, 0, LDS_DEFAULT },
+        { 300, 200, 9, 2, 0, 0, LDS_DEFAULT },  { 300, 200, 6, 1, 0, 0, LDS_DEFAULT },
+        { 300, 200, -1, 2, 1, 0, LDS_DEFAULT }, { 300, 200, -1, 2, 0, 16, LDS_DEFAULT },
+        { 1024, 600, -1, 2, 0, 0, LDS_DEFAULT }, { 300, 200, -1, 2, 0, 0, LDS_RLE },
+        { 64, 64, -1, 2, 0, 0, LDS_DEFAULT },   { 300, 200, -1, 1, 0, 0, LDS_RLE },
+        { 1, 1, -1, 2, 0, 0, LDS_DEFAULT },     { 300, 200, -1, 2, 0, 0, LDS_HUFFMAN_ONLY },
+        { 300, 200, 4, 2, 0, 0, LDS_DEFAULT },
+    };
+
+    Random next{ 777 };
+
+    lodepng::EncoderContext context;
+    if ( !context.get() )
+        return reportFailure( "context", "making the encoder context", 83 );
+
+    unsigned failed = 0;
+    for ( unsigned round = 0; round < 3; ++round )
+        for ( const Setting& setting : SETTINGS )
+        {
+            // Runs of copied pixels, so that LZ77 finds matches at all distances.
+            std::vector< byte > image( size_t( setting.width ) * setting.height * 4 );
+            for ( size_t i = 0; i < image.size(); ++i )
+                image[ i ] = byte( i >= 64 && next() % 4 ? image[ i - 1 - next() % 64 ] : next() );
+
+            lodepng::State state;
+            if ( setting.level >= 0 )
+                lodepng_compress_settings_set_level( &state.encoder.zlibsettings, unsigned( setting.level ) );
+            state.encoder.zlibsettings.btype = setting.btype;
+            state.encoder.zlibsettings.strategy = setting.strategy;
+            state.info_png.interlace_method = setting.interlace;
+            state.encoder.restart_rows = setting.restartRows;
+
+            std::vector< byte > expected, encoded, decoded;
+            unsigned error = lodepng::encode( expected, image, setting.width, setting.height, state );
+            state.encoder.zlibsettings.context = context.get();
+            if ( !error )
+                error = lodepng::encode( encoded, image, setting.width, setting.height, state );
+            unsigned w, h;
+            if ( !error )
+                error = lodepng::decode( decoded, w, h, encoded );
+
+            if ( error || encoded != expected || decoded != image )
+            {
+                std::ostringstream what;
+                what << setting.width << "x" << setting.height << " level " << setting.level << " btype "
+                     << setting.btype << " interlace " << setting.interlace << " restart rows " << setting.restartRows
+                     << " strategy " << setting.strategy;
+                failed += reportFailure( "context", what.str(), error );
+            }
+        }
+    return failed;
+}
+
+// Decodes random 8-bit images of every color type to RGBA8 and RGB8, which
+// converts every scanline straight into the output, and compares that with
+// lodepng_convert on the image decoded as it is. Palettes are short, so some
+// indices are beyond their end, and GREY and RGB ones have a color key.
+static unsigned verifyConvert()
+{
+    static const LodePNGColorType TYPES[] = { LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA, LCT_PALETTE };
+    static const LodePNGColorType OUTPUTS[] = { LCT_RGBA, LCT_RGB };
+    Random next;
+
+    unsigned failed = 0;
+    for ( LodePNGColorType type : TYPES )
+        for ( unsigned round = 0; round < 20; ++round )
+        {
+            // Narrow ones too, for the ends of the SIMD loops.
+            unsigned w = 1 + next() % (round % 2 ? 12 : 300);
+            unsigned h = 1 + next() % 8;
+            bool key = round % 4 == 3 && (type == LCT_GREY || type == LCT_RGB);
+
+            lodepng::State state;
+            lodepng_color_mode_init( &state.info_raw );
+            state.info_raw.colortype = type;
+            state.info_raw.bitdepth = 8;
+            if ( type == LCT_PALETTE )
+                for ( unsigned i = 0; i < 200; ++i )
+                    lodepng_palette_add( &state.info_raw, byte( next() ), byte( next() ), byte( next() ), byte( next() ) );
+
+            // Few different values with a key, so it's actually hit.
+            std::vector< byte > image( lodepng_get_raw_size( w, h, &state.info_raw ) );
+            for ( byte& value : image )
+                value = byte( key ? next() % 3 : next() );
+
+            lodepng_color_mode_copy( &state.info_png.color, &state.info_raw );
+            state.info_png.color.key_defined = key;
+            state.info_png.color.key_r = state.info_png.color.key_g = state.info_png.color.key_b = 1;
+            state.encoder.auto_convert = 0;
+
+            std::vector< byte > png, raw;
+            unsigned error = lodepng::encode( png, image, w, h, state );
+
+            unsigned dw, dh;
+            lodepng::State rawState;
+            rawState.decoder.color_convert = 0;
+            if ( !error )
+                error = lodepng::decode( raw, dw, dh, rawState, png );
+
+            for ( LodePNGColorType output : OUTPUTS )
+            {
+                LodePNGColorMode mode;
+                lodepng_color_mode_init( &mode );
+                mode.colortype = output;
+
+                std::vector< byte > expected( lodepng_get_raw_size( w, h, &mode ) ), decoded;
+                if ( !error )
+                    error = lodepng_convert( expected.data(), raw.data(), &mode, &rawState.info_png.color, w, h );
+                if ( !error )
+                    error = lodepng::decode( decoded, dw, dh, png, output, 8 );
+
+                if ( error || decoded != expected )
+                {
+                    std::ostringstream what;
+                    what << "type " << type << " to " << output << " " << w << "x" << h << (key ? " with key" : "");
+                    failed += reportFailure( "convert", what.str(), error );
+                    break;
+                }
+            }
+        }
+    return failed;
+}
+
+// Encodes with a time_budget so big that the smallest settings fit and so
+// small that only the fastest one does, and checks the settings left in
+// the encoder settings and the decoded image. A budget_clock must be used
+// instead of the system clock, and without an encoder context a
+// time_budget is error 103.
+static unsigned verifyBudget()
+{
+    const unsigned width = 256, height = 256;
+    std::vector< byte > image = makeImage( width, height );
+    lodepng::EncoderContext context;
+
+    struct Budget
+    {
+        unsigned               micros;
+        LodePNGDeflateStrategy strategy;
+        LodePNGFilterStrategy  filter;
+    };
+    static const Budget BUDGETS[] = {
+        { 4000000000u, LDS_DEFAULT, LFS_ADAPTIVE },
+        { 1, LDS_HUFFMAN_ONLY, LFS_MINSUM },
+    };
+
+    unsigned failed = 0;
+    for ( const Budget& budget : BUDGETS )
+    {
+        lodepng::State state;
+        state.encoder.zlibsettings.context = context.get();
+        state.encoder.time_budget = budget.micros;
+
+        std::vector< byte > png, decoded;
+        unsigned w = 0, h = 0;
+        unsigned error = lodepng::encode( png, image, width, height, state );
+        if ( !error )
+            error = lodepng::decode( decoded, w, h, png );
+
+        if ( error || decoded != image || state.encoder.zlibsettings.strategy != budget.strategy
+             || state.encoder.filter_strategy != budget.filter )
+        {
+            std::ostringstream what;
+            what << budget.micros << "us";
+            failed += reportFailure( "budget", what.str(), error );
+        }
+    }
+
+    // A budget_clock replaces the one of the system, and is read before and
+    // after the encode.
+    lodepng::State state;
+    state.encoder.zlibsettings.context = context.get();
+    state.encoder.time_budget = 1000;
+    unsigned ticks = 0;
+    state.encoder.budget_clock = []( void* context ) {
+        return double( ++*static_cast< unsigned* >( context ) );
+    };
+    state.encoder.budget_clock_context = &ticks;
+    std::vector< byte > png;
+    unsigned error = lodepng::encode( png, image, width, height, state );
+    if ( error || ticks != 2 )
+        failed += reportFailure( "budget", "budget_clock", error );
+
+    state.encoder.zlibsettings.context = nullptr;
+    if ( lodepng::encode( png, image, width, height, state ) != 103 )
+        failed += reportFailure( "budget", "error 103 without a context", 0 );
+    return failed;
+}
+
+// Compares lodepng_crc32 with a bit at a time CRC for every length up to
+// a few hundred bytes at every alignment, which covers all the tails of
+// the table and PCLMULQDQ code, and lodepng_crc32_combine on every split.
+static unsigned verifyCrc()
+{
+    auto reference = []( const byte* data, size_t size ) {
+        unsigned crc = 0xffffffffu;
+        for ( size_t i = 0; i < size; ++i )
+        {
+            crc ^= data[ i ];
+            for ( int bit = 0; bit < 8; ++bit )
+                crc = crc & 1 ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+        }
+        return crc ^ 0xffffffffu;
+    };
+
+    Random next;
+    std::vector< byte > data( 1024 );
+    for ( byte& value : data )
+        value = byte( next() );
+
+    unsigned failed = 0;
+    for ( size_t offset = 0; offset < 16; ++offset )
+        for ( size_t size = 0; size + offset <= 600; ++size )
+        {
+            unsigned crc = reference( &data[ offset ], size );
+            if ( lodepng_crc32( &data[ offset ], size ) != crc )
+            {
+                std::ostringstream what;
+                what << "offset " << offset << " size " << size;
+                failed += reportFailure( "crc", what.str(), 0 );
+            }
+            if ( offset == 0 )
+                for ( size_t split = 0; split <= size; ++split )
+                {
+                    unsigned first = lodepng_crc32( &data[ 0 ], split );
+                    unsigned second = lodepng_crc32( &data[ split ], size - split );
+                    if ( lodepng_crc32_combine( first, second, size - split ) != crc )
+                    {
+                        std::ostringstream what;
+                        what << "combine size " << size << " split " << split;
+                        failed += reportFailure( "crc", what.str(), 0 );
+                    }
+                }
+        }
+    return failed;
+}
+
+// Compares every Adler-32 code path of lodepng (the plain loop, SSSE3 and
+// AVX2) with a byte at a time Adler-32, at every alignment of the 32 byte
+// steps of the SIMD code, and for lengths around the 5536 byte blocks
+// after which the sums are reduced modulo 65521. The data is random and
+// then all 255, the most the sums can grow by, and the sums start at 1
+// and just below 65521. Paths the CPU doesn't have are skipped.
+static unsigned verifyAdler()
+{
+    static const char* const PATHS[] = { "plain", "SSSE3", "AVX2" };
+    static const unsigned STARTS[] = { 1, 0xfff0fff0u };
+    const size_t BLOCK = 5536;
+
+    std::vector< size_t > lengths;
+    for ( size_t length = 0; length <= 320; ++length )
+        lengths.push_back( length );
+    for ( size_t block = 1; block <= 3; ++block )
+        for ( size_t length = block * BLOCK - 40; length <= block * BLOCK + 40; ++length )
+            lengths.push_back( length );
+    lengths.push_back( 200000 + 13 );
+    const size_t maxLength = lengths.back();
+
+    std::vector< unsigned > paths;
+    for ( unsigned path = 0; path < 3; ++path )
+    {
+        unsigned adler;
+        if ( lodepng_adler32_path( &adler, 1, nullptr, 0, path ) )
+            std::cerr << "adler: no " << PATHS[ path ] << " on this CPU or build, skipped" << std::endl;
+        else
+            paths.push_back( path );
+    }
+
+    Random next;
+    std::vector< byte > data( maxLength + 32 );
+    std::vector< unsigned > expected( maxLength + 1 );
+    unsigned failed = 0;
+    for ( unsigned pattern = 0; pattern < 2; ++pattern )
+    {
+        for ( byte& value : data )
+            value = byte( pattern ? 255 : next() );
+
+        for ( size_t offset = 0; offset < 32; ++offset )
+            for ( unsigned start : STARTS )
+            {
+                // The reference for every length at once.
+                unsigned s1 = start & 0xffff, s2 = start >> 16;
+                expected[ 0 ] = start;
+                for ( size_t i = 0; i < maxLength; ++i )
+                {
+                    s1 = (s1 + data[ offset + i ]) % 65521;
+                    s2 = (s2 + s1) % 65521;
+                    expected[ i + 1 ] = s2 << 16 | s1;
+                }
+
+                for ( unsigned path : paths )
+                    for ( size_t length : lengths )
+                    {
+                        unsigned adler = 0;
+                        unsigned error = lodepng_adler32_path( &adler, start, &data[ offset ], length, path );
+                        if ( error || adler != expected[ length ] )
+                        {
+                            std::ostringstream what;
+                            what << PATHS[ path ] << " offset " << offset << " length " << length << " start "
+                                 << start << (pattern ? " all 255" : "");
+                            failed += reportFailure( "adler", what.str(), error );
+                        }
+                    }
+            }
+    }
+    return failed;
+}
+
+// The case and size columns are as wide as their longest name, so that
+// the numbers line up.
+static void writeText( std::ostream& os, const std::vector< BenchResult >& results )
+{
+    size_t nameWidth = 12, sizeWidth = 10;
+    for ( const BenchResult& r : results )
+    {
+        nameWidth = std::max( nameWidth, r.name.size() );
+        sizeWidth = std::max( sizeWidth, r.size.size() );
+    }
+
+    char line[ 512 ];
+    snprintf( line, sizeof( line ), "%-*s %-*s %12s %10s %10s %10s %10s %12s\n", int( nameWidth ), "case",
+              int( sizeWidth ), "size", "pixels", "min ms", "median ms", "p99 ms", "mean ms", "MB/s" );
+    os << line;
+
+    for ( const BenchResult& r : results )
+    {
+        snprintf( line, sizeof( line ), "%-*s %-*s %12.0f %10.3f %10.3f %10.3f %10.3f %12.1f\n",
+                  int( nameWidth ), r.name.c_str(), int( sizeWidth ), r.size.c_str(), double( r.width ) * r.height,
+                  r.min, r.median, r.p99, r.mean, r.bytesPerSecond / 1e6 );
+        os << line;
+    }
+}
+
+static void writeCsv( std::ostream& os, const std::vector< BenchResult >& results )
+{
+    os << "case,size,width,height,iterations,min_ms,median_ms,p99_ms,mean_ms,bytes_per_second\n";
+    for ( const BenchResult& r : results )
+        os << r.name << ',' << r.size << ',' << r.width << ',' << r.height << ',' << r.iterations << ','
+           << r.min << ',' << r.median << ',' << r.p99 << ',' << r.mean << ',' << r.bytesPerSecond << '\n';
+}
+
+static void writeJson( std::ostream& os, const std::vector< BenchResult >& results )
+{
+    os << "[\n";
+    for ( size_t i = 0; i < results.size(); ++i )
+    {
+        const BenchResult& r = results[ i ];
+        os << "  { \"case\": \"" << r.name << "\", \"size\": \"" << r.size << "\""
+           << ", \"width\": " << r.width << ", \"height\": " << r.height
+           << ", \"iterations\": " << r.iterations
+           << ", \"min_ms\": " << r.min << ", \"median_ms\": " << r.median
+           << ", \"p99_ms\": " << r.p99 << ", \"mean_ms\": " << r.mean
+           << ", \"bytes_per_second\": " << r.bytesPerSecond << " }"
+           << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    os << "]\n";
+}
+
+int main( int argc, char** argv )
+{
+    BenchOptions options;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        std::string arg = argv[ i ];
+        const char* value = i + 1 < argc ? argv[ i + 1 ] : nullptr;
+        if ( value == nullptr )
+        {
+            std::cerr << "missing value for " << arg << std::endl;
+            return 1;
+        }
+        ++i;
+
+        if ( arg == "--warmup" )
+            options.warmup = unsigned( atoi( value ) );
+        else if ( arg == "--iterations" )
+            options.iterations = std::max( atoi( value ), 1 );
+        else if ( arg == "--cases" )
+            options.cases = split( value );
+        else if ( arg == "--format" )
+            options.format = value;
+        else if ( arg == "--out" )
+            options.out = value;
+        else if ( arg == "--verify" )
+            options.verify = split( value );
+        else if ( arg == "--level" )
+        {
+            options.level = atoi( value );
+            if ( options.level < 0 || options.level > 9 )
+            {
+                std::cerr << "invalid level " << value << std::endl;
+                return 1;
+            }
+        }
+        else if ( arg == "--strategy" )
+        {
+            if ( !parseStrategy( value, options.strategy ) )
+            {
+                std::cerr << "invalid strategy " << value << std::endl;
+                return 1;
+            }
+        }
+        else if ( arg == "--filter" )
+        {
+            if ( !parseFilter( value, options.filter ) )
+            {
+                std::cerr << "invalid filter " << value << std::endl;
+                return 1;
+            }
+        }
+        else if ( arg == "--sizes" )
+        {
+            for ( const std::string& str : split( value ) )
+            {
+                BenchSize size;
+                if ( !parseSize( str, size ) )
+                {
+                    std::cerr << "invalid size " << str << std::endl;
+                    return 1;
+                }
+                options.sizes.push_back( size );
+            }
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if ( !options.verify.empty() )
+    {
+        unsigned failed = 0;
+        for ( const std::string& name : options.verify )
+        {
+            if ( name == "filters" || name == "restarts" || name == "deflate" || name == "context" || name == "convert"
+                 || name == "crc" || name == "budget" || name == "adler" )
+            {
+                unsigned count = name == "filters" ? verifyFilters()
+                               : name == "restarts" ? verifyRestarts()
+                               : name == "deflate" ? verifyDeflate()
+                               : name == "context" ? verifyContext()
+                               : name == "convert" ? verifyConvert()
+                               : name == "budget" ? verifyBudget()
+                               : name == "adler" ? verifyAdler()
+                               : verifyCrc();
+                std::cout << name << ": " << (count ? "FAILED" : "ok") << std::endl;
+                failed += count;
+            }
+            else
+            {
+                std::cerr << "unknown check " << name << std::endl;
+                return 1;
+            }
+        }
+        return failed ? 1 : 0;
+    }
+
+    if ( options.sizes.empty() )
+        options.sizes.assign( PRESETS, PRESETS + 4 );
+    if ( options.cases.empty() )
+        options.cases.assign( std::begin( ALL_CASES ), std::end( ALL_CASES ) );
+
+    std::vector< BenchResult > results;
+    for ( const BenchSize& size : options.sizes )
+        runSize( size, options, results );
+
+    std::ofstream file;
+    if ( !options.out.empty() )
+    {
+        file.open( options.out );
+        if ( !file.is_open() )
+        {
+            std::cerr << "failed to open " << options.out << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& os = file.is_open() ? file : std::cout;
+
+    if ( options.format == "json" )
+        writeJson( os, results );
+    else if ( options.format == "csv" )
+        writeCsv( os, results );
+    else
+        writeText( os, results );
+}
@@ -1,9 +1,12 @@
 // Andrew Meckling
 // Nav Bhatti
 #include "lodepng.h"
-#include "OpenCLKernel.h"
+#include "Backends.h"
+#include "StreamPipeline.h"
+#include "BatchPipeline.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <thread>
 
@@ -12,135 +15,130 @@
 using std::cout;
 using std::endl;
 
-void serialGrayscale( std::vector< byte >& image )
-{
-    for ( int i = 0; i < image.size(); i += 4 )
-    {
-        byte gray = byte( image[ i + 0 ] * 0.21
-                        + image[ i + 1 ] * 0.72
-                        + image[ i + 2 ] * 0.07 );
-        image[ i + 0 ] = gray;
-        image[ i + 1 ] = gray;
-        image[ i + 2 ] = gray;
-    }
-}
-
-// Converts to grayscale on serially. Returns timing.
-auto _serial( std::vector< byte >& image, size_t size )
+// Converts to grayscale with the named backend. Returns timing, which
+// doesn't include setting up the backend.
+auto _timed( const char* name, std::vector< byte >& image )
 {
     using namespace std::chrono;
-    auto start = steady_clock::now();
 
-    serialGrayscale( image );
-
-    auto end = steady_clock::now();
-    return end - start;
-}
-
-// Converts to grayscale on gpu. Returns timing.
-auto _gpu( std::vector< byte >& image, size_t size )
-{
-    using namespace std::chrono;
-    
-    cl_platform_id platforms[ 3 ];
-    clGetPlatformIDs( 3, platforms, 0 );
-
-    OpenCLKernel< byte* > grayscale( platforms[ 0 ], "grayscale.cl" );
-    grayscale.globalWorkSize[ 0 ] = size;
+    auto backend = makeBackend( name );
+    if ( !backend->available() )
+    {
+        cout << name << " has no OpenCL device, skipped\n";
+        return steady_clock::duration::zero();
+    }
 
     auto start = steady_clock::now();
-    
-    grayscale( image );
-
-    auto end = steady_clock::now();
-    return end - start;
-}
-
-// Converts to grayscale on cpu. Returns timing.
-auto _cpu( std::vector< byte >& image, size_t size )
-{
-    using namespace std::chrono;
 
-    cl_platform_id platforms[ 3 ];
-    clGetPlatformIDs( 3, platforms, 0 );
-
-    OpenCLKernel< byte* > grayscale( platforms[ 2 ], "grayscale.cl" );
-    grayscale.globalWorkSize[ 0 ] = size;
-
-    auto start = steady_clock::now();
-    
-    grayscale( image );
+    (*backend)( image );
 
     auto end = steady_clock::now();
     return end - start;
 }
 
 
-// Converts to grayscale on gpu and cpu. Returns timing.
-auto _gcpu( std::vector< byte >& image, size_t size )
+int main( int argc, char** argv )
 {
-    using namespace std::chrono;
-
-    size_t half_len = image.size() / 2;
-
-    cl_platform_id platforms[ 3 ];
-    clGetPlatformIDs( 3, platforms, 0 );
+    // usage: OpenCL_Gray --stream [input.png] [output.png]
+    if ( argc > 1 && strcmp( argv[ 1 ], "--stream" ) == 0 )
+    {
+        const char* inFile = argc > 2 ? argv[ 2 ] : "input.png";
+        const char* outFile = argc > 3 ? argv[ 3 ] : "output.png";
 
-    OpenCLKernel< byte* > grayscaleGPU( platforms[ 0 ], "grayscale.cl" );
-    grayscaleGPU.globalWorkSize[ 0 ] = size / 2;
+        using namespace std::chrono;
+        auto start = steady_clock::now();
 
-    OpenCLKernel< byte* > grayscaleCPU( platforms[ 2 ], "grayscale.cl" );
-    grayscaleCPU.globalWorkSize[ 0 ] = size / 2;
+        if ( unsigned error = streamGrayscale( inFile, outFile ) ) {
+            cout << "stream error " << error << ": " << lodepng_error_text( error ) << endl;
+            return error;
+        }
 
-    auto start = steady_clock::now();
+        auto stream_diff = steady_clock::now() - start;
+        cout << "stream took " << (duration_cast< nanoseconds >( stream_diff ).count() / 1'000'000.0) << " ms\n";
+        return 0;
+    }
 
-    std::thread gpu( [&]() {
-        grayscaleGPU( { image.data(), half_len } );
-    } );
-    std::thread cpu( [&]() {
-        grayscaleCPU( { image.data() + half_len, half_len } );
-    } );
-    gpu.join();
-    cpu.join();
+    // usage: OpenCL_Gray --batch [--backend serial|gpu|cpu|gcpu] <output dir> <image or dir>...
+    if ( argc > 2 && strcmp( argv[ 1 ], "--batch" ) == 0 )
+    {
+        int arg = 2;
+        const char* name = "serial";
+        if ( argc > 4 && strcmp( argv[ arg ], "--backend" ) == 0 )
+        {
+            name = argv[ arg + 1 ];
+            arg += 2;
+        }
 
-    auto end = steady_clock::now();
-    return end - start;
-}
+        auto backend = makeBackend( name );
+        if ( !backend ) {
+            cout << "unknown backend " << name << endl;
+            return 1;
+        }
+        if ( !backend->available() ) {
+            cout << name << " has no OpenCL device" << endl;
+            return 1;
+        }
 
+        const char* outDir = argv[ arg ];
+        std::vector< std::string > files;
+        for ( int i = arg + 1; i < argc; ++i )
+            collectImages( argv[ i ], files );
+
+        using namespace std::chrono;
+        auto start = steady_clock::now();
+
+        // The backend is set up once, and only the one transform thread of
+        // the batch calls it.
+        size_t failed = runBatch( files, outDir, BatchOptions(), [&backend]( Array< byte > image ) {
+            (*backend)( image );
+        } );
+
+        auto batch_diff = steady_clock::now() - start;
+        double seconds = duration_cast< nanoseconds >( batch_diff ).count() / 1'000'000'000.0;
+        cout << "batch of " << files.size() << " images took " << (seconds * 1000) << " ms ("
+             << ((files.size() - failed) / seconds) << " images/s)\n";
+        return failed ? 1 : 0;
+    }
 
-int main( int argc, char** argv )
-{
     std::vector< byte > image;
     unsigned width, height;
 
-    if ( unsigned error = lodepng::decode( image, width, height, "input.png" ) ) {
+    std::vector< byte > png;
+    unsigned error = lodepng::load_file( png, "input.png" );
+    if ( !error )
+        error = decodeImage( image, width, height, png );
+    if ( error ) {
         cout << "decoder error " << error << ": " << lodepng_error_text( error ) << endl;
         return error;
     }
 
-    size_t size = width * height;
-
     printf( "starting programs\n" );
     using namespace std::chrono;
 
-    auto serial_diff = _serial( image, size );
+    auto serial_diff = _timed( "serial", image );
     cout << "serial took " << (duration_cast< nanoseconds >( serial_diff ).count() / 1'000'000.0) << " ms\n";
 
-    auto gpu_diff = _gpu( image, size );
+    auto gpu_diff = _timed( "gpu", image );
     cout << "gpu took " << (duration_cast< nanoseconds >( gpu_diff ).count() / 1'000'000.0) << " ms\n";
 
-    auto cpu_diff = _cpu( image, size );
+    auto cpu_diff = _timed( "cpu", image );
     cout << "cpu took " << (duration_cast< nanoseconds >( cpu_diff ).count() / 1'000'000.0) << " ms\n";
 
-    auto gcpu_diff = _gcpu( image, size );
+    auto gcpu_diff = _timed( "gcpu", image );
     cout << "gpu and cpu took " << (duration_cast< nanoseconds >( gcpu_diff ).count() / 1'000'000.0) << " ms\n";
 
-    if ( unsigned error = lodepng::encode( "output.png", image, width, height ) ) {
+    std::vector< byte > output;
+    error = encodeGrayscale( output, image, width, height );
+    if ( !error )
+        error = lodepng::save_file( output, "output.png" );
+    if ( error ) {
         cout << "encoder error " << error << ": " << lodepng_error_text( error ) << endl;
         return error;
     }
 
+#ifdef _WIN32
     std::system( "pause" );
+#endif
 }
 
 
@@ -206,7 +204,7 @@ kernel_type produce2dGaussianKernel( int kernelRadius )//, double sigma )
             double x = G( col - kernelRadius,
                           row - kernelRadius,
                           sigma );
-            //* gaussian(col, kernelRadius, sigma);
+            // * gaussian(col, kernelRadius, sigma);
             kernel2d[row][col] = x;
             sum += x;
             if ( x > max )
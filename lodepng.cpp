@@ -28,11 +28,67 @@ The manual and changelog are in the header file "lodepng.h"
 Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for C.
 */
 
+/*clock_gettime and CLOCK_MONOTONIC for time_budget, which glibc hides in the strict C modes*/
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "lodepng.h"
 
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+/*QueryPerformanceCounter for time_budget*/
+#if defined(_WIN32) && defined(LODEPNG_COMPILE_ENCODER)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif /*_WIN32 && LODEPNG_COMPILE_ENCODER*/
+
+/*SSE2 is always there on x86-64, so it needs no runtime check. Define LODEPNG_NO_COMPILE_SSE2 to use plain C.*/
+#if !defined(LODEPNG_NO_COMPILE_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LODEPNG_COMPILE_SSE2
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif /*__SSSE3__*/
+#endif /*LODEPNG_COMPILE_SSE2*/
+
+/*Instruction sets that not every x86 CPU with SSE2 has (PCLMULQDQ for the CRC, SSSE3 and AVX2 for Adler-32) are
+compiled for with a target attribute, but only used after asking the CPU, see lodepng_cpu_features.*/
+#if defined(LODEPNG_COMPILE_SSE2) && (defined(__GNUC__) || defined(_MSC_VER)) \
+    && (defined(LODEPNG_COMPILE_ZLIB) || (defined(LODEPNG_COMPILE_PNG) && !defined(LODEPNG_NO_COMPILE_CRC)))
+#define LODEPNG_COMPILE_CPU_DISPATCH
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LODEPNG_TARGET(name)
+#else /*_MSC_VER*/
+#include <cpuid.h>
+#define LODEPNG_TARGET(name) __attribute__((target(name)))
+#endif /*_MSC_VER*/
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+
+/*LZ77 compares matches a size_t at a time where the first differing byte is found with a count trailing zeros*/
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LODEPNG_MATCH_WORDS
+#define LODEPNG_CTZ(x) ((unsigned)__builtin_ctzll(x))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+#define LODEPNG_MATCH_WORDS
+static unsigned LODEPNG_CTZ(size_t x)
+{
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return (unsigned)index;
+}
+#endif /*LODEPNG_MATCH_WORDS*/
 
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
@@ -80,6 +136,59 @@ void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+#define LODEPNG_CPU_PCLMUL 1u
+#define LODEPNG_CPU_SSSE3 2u
+#define LODEPNG_CPU_AVX2 4u
+#define LODEPNG_CPU_KNOWN 0x80000000u /*set once the CPU was asked*/
+
+/*the LODEPNG_CPU_ flags of the instruction sets the CPU has. cpuid is slow in virtual machines, so it's only
+asked once (threads that ask at the same time all store the same answer).*/
+static unsigned lodepng_cpu_features(void)
+{
+  static unsigned features = 0;
+  if(!features)
+  {
+    unsigned result = LODEPNG_CPU_KNOWN, xcr0 = 0;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] >= 1)
+    {
+      unsigned max = (unsigned)info[0];
+      __cpuid(info, 1);
+      if(info[2] & (1 << 1)) result |= LODEPNG_CPU_PCLMUL;
+      if(info[2] & (1 << 9)) result |= LODEPNG_CPU_SSSE3;
+      /*AVX2 also needs the OS to save the YMM registers (OSXSAVE, then XCR0 bits 1 and 2)*/
+      if(info[2] & (1 << 27)) xcr0 = (unsigned)_xgetbv(0);
+      if(max >= 7 && (xcr0 & 6) == 6)
+      {
+        __cpuidex(info, 7, 0);
+        if(info[1] & (1 << 5)) result |= LODEPNG_CPU_AVX2;
+      }
+    }
+#else /*_MSC_VER*/
+    unsigned a, b, c, d, max = __get_cpuid_max(0, 0);
+    if(max >= 1)
+    {
+      __cpuid(1, a, b, c, d);
+      if(c & (1u << 1)) result |= LODEPNG_CPU_PCLMUL;
+      if(c & (1u << 9)) result |= LODEPNG_CPU_SSSE3;
+      /*AVX2 also needs the OS to save the YMM registers (OSXSAVE, then XCR0 bits 1 and 2)*/
+      if(c & (1u << 27)) __asm__("xgetbv" : "=a"(xcr0), "=d"(d) : "c"(0));
+      if(max >= 7 && (xcr0 & 6) == 6)
+      {
+        __cpuid_count(7, 0, a, b, c, d);
+        if(b & (1u << 5)) result |= LODEPNG_CPU_AVX2;
+      }
+    }
+#endif /*_MSC_VER*/
+    features = result;
+  }
+  return features;
+}
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // Tools for C, and common code for PNG and Zlib.                       // */
@@ -234,7 +343,7 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
   return 1; /*success*/
 }
 
-#ifdef LODEPNG_COMPILE_PNG
+#if defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ZLIB)
 
 static void ucvector_cleanup(void* p)
 {
@@ -248,7 +357,7 @@ static void ucvector_init(ucvector* p)
   p->data = NULL;
   p->size = p->allocsize = 0;
 }
-#endif /*LODEPNG_COMPILE_PNG*/
+#endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ZLIB)*/
 
 #ifdef LODEPNG_COMPILE_ZLIB
 /*you can both convert from vector to buffer&size and vica versa. If you use
@@ -270,6 +379,33 @@ static unsigned ucvector_push_back(ucvector* p, unsigned char c)
 }
 #endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ENCODER)*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*number of settings a time_budget chooses from, see ENCODER_EFFORTS*/
+#define NUM_ENCODER_EFFORTS 8
+/*number of encodes after which the PNG size ratio of an effort is too old to compare with that of another one*/
+#define ENCODER_RATIO_AGE 8
+
+struct LodePNGEncoderContext
+{
+  struct Hash* hash; /*hash chains and LZ77 output for windows up to 32768, NULL without the built in zlib*/
+  unsigned char* attempt[5]; /*scratch lines of filterRow*/
+  size_t attemptsize; /*size of each of the attempt lines, 0 if there are none*/
+  ucvector filtered; /*the filtered scanlines of the image*/
+  ucvector compressed; /*the zlib data of the image*/
+  /*the cost model of time_budget: measured seconds per raw image byte and PNG bytes per raw image byte of every
+  effort, and the measured seconds over the estimated ones, to scale the estimates of the efforts that weren't used
+  yet. A fast encode can measure 0 seconds, so the number of measured encodes of every effort and of all of them
+  tells which ones are measured. effort_last is the value of encodes after the last encode of every effort, to only
+  compare the ratios of efforts that were used on recent images*/
+  double effort_rate[NUM_ENCODER_EFFORTS];
+  double effort_ratio[NUM_ENCODER_EFFORTS];
+  double effort_scale;
+  unsigned effort_encodes[NUM_ENCODER_EFFORTS];
+  unsigned effort_last[NUM_ENCODER_EFFORTS];
+  unsigned encodes;
+};
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 
 /* ////////////////////////////////////////////////////////////////////////// */
 
@@ -417,50 +553,178 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_ENCODER
-/*TODO: this ignores potential out of memory errors*/
-#define addBitToStream(/*size_t**/ bitpointer, /*ucvector**/ bitstream, /*unsigned char*/ bit)\
-{\
-  /*add a new byte at the end*/\
-  if(((*bitpointer) & 7) == 0) ucvector_push_back(bitstream, (unsigned char)0);\
-  /*earlier bit of huffman code is in a lesser significant bit of an earlier byte*/\
-  (bitstream->data[bitstream->size - 1]) |= (bit << ((*bitpointer) & 0x7));\
-  ++(*bitpointer);\
+/*
+Bit writer for the deflate output, the counterpart of the BitReader. The bits go into a size_t buffer, and every 32
+of them are stored in the ucvector as 4 bytes at once, so writing a Huffman code with its extra bits costs a few
+operations instead of some for every bit. A 32-bit size_t can't hold the bits of value past the 32, writeBits puts
+those back after the store. Bytes are stored past the size of the ucvector, in the room it has reserved; its
+size only covers them after BitWriter_end.
+*/
+typedef struct BitWriter
+{
+  ucvector* data;
+  size_t size; /*number of bytes stored in data so far*/
+  size_t buffer; /*the bits not stored yet, the first one in the least significant bit*/
+  unsigned bits; /*number of bits in buffer, less than 32 between calls*/
+  unsigned error; /*83 if the ucvector couldn't grow, the bits after that are lost*/
+} BitWriter;
+
+/*continues writing data at bit bp, data must have exactly the bytes up to bp, the last one possibly partial*/
+static void BitWriter_begin(BitWriter* writer, ucvector* data, size_t bp)
+{
+  writer->data = data;
+  writer->size = bp / 8u;
+  writer->bits = (unsigned)(bp & 7u);
+  writer->buffer = writer->bits ? data->data[writer->size] & ((1u << writer->bits) - 1u) : 0;
+  writer->error = 0;
 }
 
-static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+/*makes room for nbits more bits at once, so that writing them doesn't reallocate*/
+static void BitWriter_reserve(BitWriter* writer, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  /*4 more for the 32 bits that are stored at once*/
+  if(!ucvector_reserve(writer->data, writer->size + nbits / 8u + 4u + 4u)) writer->error = 83; /*alloc fail*/
 }
 
-static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+/*stores the first 32 bits of the buffer*/
+static void BitWriter_store(BitWriter* writer)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  ucvector* data = writer->data;
+  if(writer->size + 4u > data->allocsize && !ucvector_reserve(data, writer->size + 4u)) writer->error = 83;
+  if(!writer->error)
+  {
+    data->data[writer->size + 0] = (unsigned char)(writer->buffer);
+    data->data[writer->size + 1] = (unsigned char)(writer->buffer >> 8u);
+    data->data[writer->size + 2] = (unsigned char)(writer->buffer >> 16u);
+    data->data[writer->size + 3] = (unsigned char)(writer->buffer >> 24u);
+    writer->size += 4u;
+  }
+  /*the bits past the 32, a 32-bit size_t has none and can't be shifted by 32*/
+  writer->buffer = sizeof(size_t) > 4u ? (writer->buffer >> 16u) >> 16u : 0;
+  writer->bits -= 32u;
+}
+
+/*writes the first nbits bits of value, which has no bits set above those. nbits may be up to 32*/
+static void writeBits(BitWriter* writer, unsigned value, unsigned nbits)
+{
+  writer->buffer |= (size_t)value << writer->bits;
+  writer->bits += nbits;
+  if(writer->bits >= 32u)
+  {
+    BitWriter_store(writer);
+    if(sizeof(size_t) <= 4u && writer->bits > 0) writer->buffer = value >> (nbits - writer->bits);
+  }
+}
+
+/*stores the rest of the bits, the last byte padded with zeros, and returns the bit pointer after the bits*/
+static size_t BitWriter_end(BitWriter* writer)
+{
+  size_t bp = writer->size * 8u + writer->bits;
+  while(writer->bits > 0 && !writer->error)
+  {
+    if(writer->size + 1u > writer->data->allocsize && !ucvector_reserve(writer->data, writer->size + 1u))
+    {
+      writer->error = 83; /*alloc fail*/
+      break;
+    }
+    writer->data->data[writer->size++] = (unsigned char)writer->buffer;
+    writer->buffer >>= 8u;
+    writer->bits = writer->bits > 8u ? writer->bits - 8u : 0;
+  }
+  writer->data->size = writer->size;
+  return bp;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Reads the bits of a deflate stream, least significant bit of each byte first. The next bits are kept
+in a size_t buffer that is refilled with all its bytes at once. With a 64-bit size_t a refill has at
+least 57 bits, so that a whole literal/length plus distance (at most 48 bits) can be decoded with a
+single refill; with a 32-bit one it has at least 25, and the distance needs a refill of its own. Bits
+past the end of the data read as 0: the caller detects the end by comparing bp to bitsize.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits, bp past this means reading beyond the end*/
+  size_t bp; /*bit pointer: position in data of the first bit of buffer*/
+  size_t buffer; /*the next bits starting at bp, the first one in the least significant bit*/
+  unsigned bufferbits; /*amount of valid bits in buffer*/
+} BitReader;
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->bp = 0;
+  reader->buffer = 0;
+  reader->bufferbits = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*the bits the buffer has at least after a refill: 57 with a 64-bit size_t, 25 with a 32-bit one*/
+#define BITREADER_REFILL_BITS (sizeof(size_t) * 8u - 7u)
+
+/*makes sure the buffer has at least nbits bits, nbits must be at most BITREADER_REFILL_BITS*/
+static void ensureBits(BitReader* reader, unsigned nbits)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  size_t start = reader->bp >> 3u;
+  const unsigned char* p = reader->data + start;
+  size_t result = 0, i;
+  if(reader->bufferbits >= nbits) return;
+  if(start + sizeof(size_t) <= reader->size)
+  {
+    /*compilers turn this into a single unaligned load on little endian machines. The high half is shifted in
+    two steps, a single shift by 32 would be undefined for a 32-bit size_t even where it's never run*/
+    result = (size_t)p[0] | ((size_t)p[1] << 8u) | ((size_t)p[2] << 16u) | ((size_t)p[3] << 24u);
+    if(sizeof(size_t) > 4u)
+    {
+      size_t high = (size_t)p[4] | ((size_t)p[5] << 8u) | ((size_t)p[6] << 16u) | ((size_t)p[7] << 24u);
+      result |= (high << 16u) << 16u;
+    }
+  }
+  else
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    /*the last bytes: only read what's there, the rest is 0*/
+    for(i = 0; start + i < reader->size; ++i) result |= (size_t)p[i] << (8u * i);
   }
+  reader->buffer = result >> (reader->bp & 7u);
+  reader->bufferbits = (unsigned)(sizeof(size_t) * 8u) - (unsigned)(reader->bp & 7u);
+}
+
+/*returns the next nbits bits without consuming them, they must have been ensured. nbits must be below 32*/
+static unsigned peekBits(const BitReader* reader, unsigned nbits)
+{
+  return (unsigned)reader->buffer & ((1u << nbits) - 1u);
+}
+
+/*consumes nbits bits, they must have been ensured*/
+static void advanceBits(BitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bufferbits -= nbits;
+  reader->bp += nbits;
+}
+
+/*reads nbits bits, at most 24*/
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  ensureBits(reader, nbits);
+  result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
+
+/*moves the reader to bit position bp, e.g. to continue after a stored block that was copied bytewise*/
+static void BitReader_seek(BitReader* reader, size_t bp)
+{
+  reader->bp = bp;
+  reader->bufferbits = 0;
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -508,13 +772,24 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
+  /*the codes, see HuffmanTree_reverseCodes for the ones of the encoder*/
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*lookup table for the decoder, see HuffmanTree_makeTable. Only made for trees that are decoded.*/
+  unsigned char* table_len; /*length of the code of the entry, in bits*/
+  unsigned short* table_value; /*the symbol, or for long codes the start of the secondary table*/
 } HuffmanTree;
 
+/*returns the first num bits of bits in reversed order*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; ++i) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
+
 /*function used for debug purposes to draw the tree in ascii art with C++*/
 /*
 static void HuffmanTree_draw(HuffmanTree* tree)
@@ -530,78 +805,154 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+#ifdef LODEPNG_COMPILE_DECODER
+
+/*amount of bits the decoder looks up at once: codes up to this length are decoded with a single lookup*/
+#define FIRSTBITS 9u
+/*symbol value of table entries that don't belong to any code*/
+#define INVALIDSYMBOL 65535u
+
+/*
+The lookup table used by the decoder. return value is error.
+The first table has 2^FIRSTBITS entries, indexed by the next FIRSTBITS bits of the input (in the order
+they're read, so with the codes reversed). An entry of a code of at most FIRSTBITS bits holds its symbol
+and length, repeated for every value of the bits after it. Codes that are longer share their first
+FIRSTBITS bits with other long codes: the first table entry then holds the maximum length of the codes
+with that prefix and the start of a secondary table, which is indexed by the bits after the prefix.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, numpresent, pointer, size; /*size is the total size of all the tables*/
+  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  /*compute maxlens: the maximum length of the codes sharing each entry of the first table*/
+  memset(maxlens, 0, headsize * sizeof(unsigned));
+  for(i = 0; i < tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue; /*codes that fit in the first table don't need a secondary table*/
+    /*the FIRSTBITS most significant bits of the code are read first*/
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(maxlens[index] < l) maxlens[index] = l;
+  }
+  /*total size: the first table plus the secondary tables*/
+  size = headsize;
+  for(i = 0; i < headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += ((size_t)1) << (maxlens[i] - FIRSTBITS);
+  }
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail, the tables are freed by HuffmanTree_cleanup*/
+  }
+  /*16 is longer than any code, it marks entries that aren't filled in yet*/
+  for(i = 0; i < size; ++i) tree->table_len[i] = 16;
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*first table entries of long codes: the maximum length and the start of their secondary table*/
+  pointer = headsize;
+  for(i = 0; i < headsize; ++i)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += ((size_t)1) << (l - FIRSTBITS);
   }
+  lodepng_free(maxlens);
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  /*fill in the codes: short ones in the first table, long ones in their secondary table*/
+  numpresent = 0;
+  for(i = 0; i < tree->numcodes; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j;
+    if(l == 0) continue;
+    /*the code is given most significant bit first, but read from the stream least significant bit first*/
+    reverse = reverseBits(tree->tree1d[i], l);
+    ++numpresent;
+
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*the FIRSTBITS - l bits that are read after the code can have any value*/
+      unsigned num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index]; /*start of the secondary table*/
+      unsigned num; /*amount of entries of this code in the secondary table*/
+      if(maxlen < l) return 55; /*long code shares its prefix with a short code: oversubscribed*/
+      num = 1u << ((maxlen - FIRSTBITS) - (l - FIRSTBITS));
+      for(j = 0; j < num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  if(numpresent < 2)
+  {
+    /*
+    With one code, deflate still uses 1 bit for it, and with zero codes (e.g. no distances used) the tree
+    must exist but never be used. Either way, part of the table stays empty: fill it with an invalid
+    symbol, which gives an error when decoded. The length of such entries must stay at most FIRSTBITS
+    in the first table and above FIRSTBITS in a secondary table.
+    */
+    for(i = 0; i < size; ++i)
+    {
+      if(tree->table_len[i] == 16)
+      {
+        tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+        tree->table_value[i] = INVALIDSYMBOL;
+      }
+    }
+  }
+  else
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    /*
+    A good huffman tree uses every combination of bits. If some entry stays empty, the code lengths
+    don't form a complete tree, this is the same error as an oversubscribed tree.
+    */
+    for(i = 0; i < size; ++i)
+    {
+      if(tree->table_len[i] == 16) return 55;
+    }
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -644,17 +995,15 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
-given the code lengths (as stored in the PNG file), generate the tree as defined
-by Deflate. maxbitlen is the maximum bits that a code in the tree can have.
-return value is error.
+given the code lengths (as stored in the PNG file), generate the codes of the tree as defined
+by Deflate. maxbitlen is the maximum bits that a code in the tree can have. This doesn't make
+the lookup table, which only the decoder needs. return value is error.
 */
-static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
-                                            size_t numcodes, unsigned maxbitlen)
+static unsigned HuffmanTree_makeCodes(HuffmanTree* tree, const unsigned* bitlen, size_t numcodes, unsigned maxbitlen)
 {
   unsigned i;
   tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
@@ -665,6 +1014,17 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
   return HuffmanTree_makeFromLengths2(tree);
 }
 
+#ifdef LODEPNG_COMPILE_DECODER
+/*makes the codes and the lookup table of a tree that is decoded*/
+static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
+                                            size_t numcodes, unsigned maxbitlen)
+{
+  unsigned error = HuffmanTree_makeCodes(tree, bitlen, numcodes, maxbitlen);
+  if(!error) error = HuffmanTree_makeTable(tree);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
 #ifdef LODEPNG_COMPILE_ENCODER
 
 /*BPM: Boundary Package Merge, see "A Fast and Space-Economical Algorithm for Length-Limited Coding",
@@ -875,6 +1235,17 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   return error;
 }
 
+/*
+Reverses the bits of every code of a tree made for the encoder. Deflate stores the first bit of a code in the
+least significant bit, so the reversed code is written with a single writeBits. Trees that are decoded keep their
+codes as they are, HuffmanTree_makeTable needs those.
+*/
+static void HuffmanTree_reverseCodes(HuffmanTree* tree)
+{
+  unsigned i;
+  for(i = 0; i != tree->numcodes; ++i) tree->tree1d[i] = reverseBits(tree->tree1d[i], tree->lengths[i]);
+}
+
 /*Create the Huffman tree given the symbol frequencies*/
 static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigned* frequencies,
                                                 size_t mincodes, size_t numcodes, unsigned maxbitlen)
@@ -890,21 +1261,20 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
 
   error = lodepng_huffman_code_lengths(tree->lengths, frequencies, numcodes, maxbitlen);
   if(!error) error = HuffmanTree_makeFromLengths2(tree);
+  if(!error) HuffmanTree_reverseCodes(tree);
   return error;
 }
 
-static unsigned HuffmanTree_getCode(const HuffmanTree* tree, unsigned index)
-{
-  return tree->tree1d[index];
-}
-
 static unsigned HuffmanTree_getLength(const HuffmanTree* tree, unsigned index)
 {
   return tree->lengths[index];
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*get the literal and length code tree of a deflated block with fixed tree, as per the deflate specification*/
+/*
+get the literal and length code tree of a deflated block with fixed tree, as per the deflate specification.
+Only the codes are made, the decoder makes the lookup table itself.
+*/
 static unsigned generateFixedLitLenTree(HuffmanTree* tree)
 {
   unsigned i, error = 0;
@@ -917,13 +1287,14 @@ static unsigned generateFixedLitLenTree(HuffmanTree* tree)
   for(i = 256; i <= 279; ++i) bitlen[i] = 7;
   for(i = 280; i <= 287; ++i) bitlen[i] = 8;
 
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
+  error = HuffmanTree_makeCodes(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
 
   lodepng_free(bitlen);
   return error;
 }
 
-/*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification*/
+/*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification, without
+lookup table*/
 static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 {
   unsigned i, error = 0;
@@ -932,7 +1303,7 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
   /*there are 32 distance codes, but 30-31 are unused*/
   for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen[i] = 5;
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
+  error = HuffmanTree_makeCodes(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
 
   lodepng_free(bitlen);
   return error;
@@ -942,26 +1313,25 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
 /*
 returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+at least 15 bits (the longest code) must have been ensured in the reader
+this is the biggest bottleneck while decoding: most codes are found with a single lookup in the table
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned code = peekBits(reader, 15);
+  unsigned index = code & ((1u << FIRSTBITS) - 1u);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l > FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    /*long code: look up the remaining bits in the secondary table*/
+    index = value + ((code >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+    l = codetree->table_len[index];
+    value = codetree->table_value[index];
   }
+  advanceBits(reader, l);
+  if(reader->bp > reader->bitsize) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
+  return value;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -971,22 +1341,58 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* / Inflator (Decompressor)                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*the maximum backwards distance of deflate, the inflater never needs more history than this*/
+#define INFLATE_WINDOW_SIZE 32768
+/*amount of new bytes after which the out buffer is handed to the sink*/
+#define INFLATE_FLUSH_SIZE 65536
+/*the longest match of deflate*/
+#define INFLATE_MAX_MATCH 258
+/*copyMatch copies in chunks of up to this many bytes, so it can write that much minus 1 past the match*/
+#define INFLATE_COPY_CHUNK 32
+/*room that must be free in the out buffer before decoding a symbol, so the symbol needs no bounds checks*/
+#define INFLATE_MARGIN (INFLATE_MAX_MATCH + INFLATE_COPY_CHUNK)
+
+/*
+Optional receiver of the inflated data. Without sink, the whole result stays in the out buffer. With
+a sink, the out buffer is used as a sliding window instead: every INFLATE_FLUSH_SIZE bytes the new
+data is given to flush, after which only the last INFLATE_WINDOW_SIZE bytes are kept in out.
+*/
+typedef struct InflateSink
+{
+  /*receives the next size bytes of the inflated data, returns error code (0 to continue)*/
+  unsigned (*flush)(void* context, const unsigned char* data, size_t size);
+  void* context;
+  size_t start; /*position in the out buffer of the first byte not given to flush yet*/
+} InflateSink;
+
+/*gives the not yet flushed data to the sink and slides the window*/
+static unsigned inflateSinkFlush(InflateSink* sink, ucvector* out, size_t* pos)
+{
+  size_t keep = *pos < INFLATE_WINDOW_SIZE ? *pos : INFLATE_WINDOW_SIZE;
+  if(*pos > sink->start)
+  {
+    CERROR_TRY_RETURN(sink->flush(sink->context, &out->data[sink->start], *pos - sink->start));
+  }
+  if(keep) memmove(out->data, &out->data[*pos - keep], keep);
+  *pos = sink->start = keep;
+  out->size = keep;
+  return 0;
+}
+
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
   /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  if(!generateFixedLitLenTree(tree_ll)) HuffmanTree_makeTable(tree_ll);
+  if(!generateFixedDistanceTree(tree_d)) HuffmanTree_makeTable(tree_d);
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -995,16 +1401,16 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + 14 > reader->bitsize) return 49; /*error: the bit pointer is or will go past the memory*/
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + HCLEN * 3 > reader->bitsize) return 50; /*error: the bit pointer is or will go past the memory*/
 
   HuffmanTree_init(&tree_cl);
 
@@ -1017,7 +1423,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -1035,7 +1441,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits(reader, 22); /*the longest code length code is 7 bits, plus up to 7 extra bits*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1049,8 +1457,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if(i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        if((reader->bp + 2) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += peekBits(reader, 2);
+        advanceBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1066,8 +1475,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        if((reader->bp + 3) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += peekBits(reader, 3);
+        advanceBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1082,8 +1492,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        if((reader->bp + 7) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += peekBits(reader, 7);
+        advanceBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1101,7 +1512,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
+          error = reader->bp > reader->bitsize ? 10 : 11;
         }
         else error = 16; /*unexisting code, this can never happen*/
         break;
@@ -1127,55 +1538,220 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*
+copies a match of length bytes from distance bytes back to out[pos]. Copies whole chunks of 8, 16 or 32
+bytes, so up to INFLATE_COPY_CHUNK - 1 bytes after the match may be overwritten too: the caller must make
+sure there's room for that. A chunk never reads bytes it writes itself: when distance is smaller than the
+chunk, the source is moved back by a multiple of distance (the data repeats with that period anyway) until
+it's at least 8 bytes back, after seeding the first bytes one at a time.
+*/
+static void copyMatch(unsigned char* out, size_t pos, size_t distance, size_t length)
 {
-  unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
+  unsigned char* dst = &out[pos];
+  const unsigned char* src = &out[pos - distance];
+  size_t i = 0;
+  if(distance >= 32)
+  {
+    for(; i < length; i += 32) memcpy(&dst[i], &src[i], 32);
+  }
+  else if(distance >= 16)
+  {
+    for(; i < length; i += 16) memcpy(&dst[i], &src[i], 16);
+  }
+  else if(distance >= 8)
+  {
+    for(; i < length; i += 8) memcpy(&dst[i], &src[i], 8);
+  }
+  else if(distance == 1)
+  {
+    memset(dst, src[0], length); /*run of one byte value, very common in images*/
+  }
+  else
+  {
+    /*pattern expansion: a period of distance is also a period of any multiple of it*/
+    size_t period = distance;
+    while(period < 8) period += distance;
+    for(; i < length && i < period - distance; ++i) dst[i] = src[i];
+    src = dst - period;
+    for(; i < length; i += 8) memcpy(&dst[i], &src[i], 8);
+  }
+}
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+/*what an Inflater does next*/
+#define INFLATE_BLOCK_HEADER 0 /*read the header of the next block*/
+#define INFLATE_STORED 1 /*copy the rest of a stored block*/
+#define INFLATE_HUFFMAN 2 /*decode the rest of a block with Huffman codes*/
+#define INFLATE_DONE 3 /*the final block has ended*/
+
+/*
+the most input bits a block header can use: BFINAL and BTYPE, the sizes of a dynamic tree, the code length
+code lengths, and per code length at most 7 bits (the repeat codes use more bits, but cover several lengths).
+The header of a stored block, with padding to the byte boundary, is shorter.
+*/
+#define INFLATE_MAX_HEADER_BITS (3 + 14 + 19 * 3 + (288 + 32) * 7)
+/*the most input bits a literal or length/distance pair can use: 15 + 5 for the length, 15 + 13 for the distance*/
+#define INFLATE_MAX_SYMBOL_BITS 48
+
+/*
+Inflate that can be continued when more input arrives, see inflaterRun. It only starts a step (a block header,
+or one literal or length/distance pair) when the input surely contains all of it, so a step never needs to be
+interrupted halfway. Only a stored block is copied as far as the input goes.
+*/
+typedef struct Inflater
+{
+  unsigned mode; /*one of the INFLATE_ values above*/
+  unsigned final; /*BFINAL of the current block*/
+  size_t stored; /*bytes of the current stored block not copied yet*/
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes of the current block*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes of the current block*/
+  ucvector* out;
+  size_t pos; /*byte position in the out buffer*/
+  InflateSink* sink; /*optional, see InflateSink*/
+} Inflater;
+
+static void Inflater_init(Inflater* inflater, ucvector* out, InflateSink* sink)
+{
+  inflater->mode = INFLATE_BLOCK_HEADER;
+  inflater->final = 0;
+  inflater->stored = 0;
+  HuffmanTree_init(&inflater->tree_ll);
+  HuffmanTree_init(&inflater->tree_d);
+  inflater->out = out;
+  inflater->pos = 0;
+  inflater->sink = sink;
+}
+
+static void Inflater_cleanup(Inflater* inflater)
+{
+  HuffmanTree_cleanup(&inflater->tree_ll);
+  HuffmanTree_cleanup(&inflater->tree_d);
+}
+
+/*reads the header of a block, and for Huffman blocks also its trees*/
+static unsigned inflateBlockHeader(Inflater* inflater, BitReader* reader)
+{
+  unsigned BTYPE;
+  if(reader->bp + 2 >= reader->bitsize) return 52; /*error, bit pointer will jump past memory*/
+  inflater->final = readBits(reader, 1);
+  BTYPE = readBits(reader, 2);
+
+  if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+  else if(BTYPE == 0) /*no compression*/
+  {
+    const unsigned char* in = reader->data;
+    size_t p = (reader->bp + 7u) / 8u; /*go to first boundary of byte*/
+    unsigned LEN, NLEN;
+
+    /*read LEN (2 bytes) and NLEN (2 bytes)*/
+    if(p + 4 > reader->size) return 52; /*error, bit pointer will jump past memory*/
+    LEN = in[p] + 256u * in[p + 1]; p += 2;
+    NLEN = in[p] + 256u * in[p + 1]; p += 2;
+
+    /*check if 16-bit NLEN is really the one's complement of LEN*/
+    if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
+
+    BitReader_seek(reader, p * 8);
+    inflater->stored = LEN;
+    inflater->mode = INFLATE_STORED;
+  }
+  else /*compression, BTYPE 01 or 10*/
+  {
+    HuffmanTree_cleanup(&inflater->tree_ll);
+    HuffmanTree_cleanup(&inflater->tree_d);
+    HuffmanTree_init(&inflater->tree_ll);
+    HuffmanTree_init(&inflater->tree_d);
+
+    if(BTYPE == 1) getTreeInflateFixed(&inflater->tree_ll, &inflater->tree_d);
+    else CERROR_TRY_RETURN(getTreeInflateDynamic(&inflater->tree_ll, &inflater->tree_d, reader));
+    inflater->mode = INFLATE_HUFFMAN;
+  }
+  return 0;
+}
+
+/*copies as much of the current stored block as the input has. If last, the input must have all of it.*/
+static unsigned inflateStored(Inflater* inflater, BitReader* reader, unsigned last)
+{
+  ucvector* out = inflater->out;
+  size_t p = reader->bp / 8u; /*the block header left the reader at a byte boundary*/
+  size_t amount = reader->size - p;
+  if(amount > inflater->stored) amount = inflater->stored;
+
+  if(!ucvector_resize(out, inflater->pos + amount)) return 83; /*alloc fail*/
+
+  /*read the literal data: LEN bytes are now stored in the out buffer*/
+  if(last && amount < inflater->stored) return 23; /*error: reading outside of in buffer*/
+  if(amount) memcpy(&out->data[inflater->pos], &reader->data[p], amount);
+  inflater->pos += amount;
+  inflater->stored -= amount;
+
+  BitReader_seek(reader, (p + amount) * 8);
+  if(inflater->stored == 0) inflater->mode = inflater->final ? INFLATE_DONE : INFLATE_BLOCK_HEADER;
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  if(inflater->sink && inflater->pos - inflater->sink->start >= INFLATE_FLUSH_SIZE)
+  {
+    return inflateSinkFlush(inflater->sink, out, &inflater->pos);
+  }
+  return 0;
+}
+
+/*
+decodes the symbols of the current Huffman block until its end code. Unless last, stops before a symbol
+when the rest of the input may be too short for it.
+*/
+static unsigned inflateHuffmanSymbols(Inflater* inflater, BitReader* reader, unsigned last)
+{
+  unsigned error = 0;
+  ucvector* out = inflater->out;
+  InflateSink* sink = inflater->sink;
+  const HuffmanTree* tree_ll = &inflater->tree_ll;
+  const HuffmanTree* tree_d = &inflater->tree_d;
+  size_t pos = inflater->pos; /*local copy, it's used for every symbol*/
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    if(!last && reader->bp + INFLATE_MAX_SYMBOL_BITS > reader->bitsize) break; /*wait for more input*/
+    if(sink && pos - sink->start >= INFLATE_FLUSH_SIZE)
+    {
+      error = inflateSinkFlush(sink, out, &pos);
+      if(error) break;
+    }
+    /*the one bounds check for this symbol. When the size is known in advance, out is already big enough.*/
+    if(!ucvector_reserve(out, pos + INFLATE_MARGIN)) ERROR_BREAK(83 /*alloc fail*/);
+    /*one refill covers a length code with its extra bits (20) plus a distance code with its extra bits (28)
+    when size_t has 64 bits, else the distance gets its own below*/
+    ensureBits(reader, BITREADER_REFILL_BITS >= 48 ? 48 : 20);
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
     if(code_ll <= 255) /*literal symbol*/
     {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
+      out->data[pos++] = (unsigned char)code_ll;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      if((reader->bp + numextrabits_l) > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      length += peekBits(reader, numextrabits_l);
+      advanceBits(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      if(BITREADER_REFILL_BITS < 48) ensureBits(reader, 28);
+      code_d = huffmanDecodeSymbol(reader, tree_d);
       if(code_d > 29)
       {
         if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          error = reader->bp > reader->bitsize ? 10 : 11;
         }
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
@@ -1184,99 +1760,90 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      if((reader->bp + numextrabits_d) > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      distance += peekBits(reader, numextrabits_d);
+      advanceBits(reader, numextrabits_d);
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      if (distance < length) {
-        for(forward = 0; forward < length; ++forward)
-        {
-          out->data[(*pos)++] = out->data[backward++];
-        }
-      } else {
-        memcpy(out->data + *pos, out->data + backward, length);
-        *pos += length;
-      }
+      if(distance > pos) ERROR_BREAK(52); /*too long backward distance*/
+      copyMatch(out->data, pos, distance, length);
+      pos += length;
     }
     else if(code_ll == 256)
     {
+      inflater->mode = inflater->final ? INFLATE_DONE : INFLATE_BLOCK_HEADER;
       break; /*end code, break the loop*/
     }
     else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
     {
       /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      error = (reader->bp > reader->bitsize) ? 10 : 11;
       break;
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+  inflater->pos = pos;
+  out->size = pos; /*the symbols were written in the reserved space past size*/
 
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+/*
+inflates from the reader until the final block ended. If last is 0, more input may come later: then it also
+returns (without error) when the input ran out, and reader->bp tells where to continue. If last is 1, the input
+ends here, and it's an error if the data doesn't, except when it ends right before a block header: then the
+mode stays INFLATE_BLOCK_HEADER, for a restart segment (see decodeRestartSegment) that isn't an error.
+*/
+static unsigned inflaterRun(Inflater* inflater, BitReader* reader, unsigned last)
 {
-  size_t p;
-  unsigned LEN, NLEN, n, error = 0;
-
-  /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
-
-  /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
-  LEN = in[p] + 256u * in[p + 1]; p += 2;
-  NLEN = in[p] + 256u * in[p + 1]; p += 2;
-
-  /*check if 16-bit NLEN is really the one's complement of LEN*/
-  if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
-
-  if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
-
-  /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
-
-  (*bp) = p * 8;
-
+  unsigned error = 0;
+  while(!error && inflater->mode != INFLATE_DONE)
+  {
+    unsigned mode = inflater->mode;
+    if(mode == INFLATE_BLOCK_HEADER)
+    {
+      if(!last && reader->bp + INFLATE_MAX_HEADER_BITS > reader->bitsize) break; /*wait for more input*/
+      if(last && reader->bp == reader->bitsize) break; /*the caller decides if that's the end*/
+      error = inflateBlockHeader(inflater, reader);
+    }
+    else
+    {
+      if(mode == INFLATE_STORED) error = inflateStored(inflater, reader, last);
+      else error = inflateHuffmanSymbols(inflater, reader, last);
+      if(inflater->mode == mode) break; /*the block isn't finished, wait for more input*/
+    }
+  }
   return error;
 }
 
+/*gives the remaining output to the sink, or sets the size of out to the inflated size*/
+static unsigned inflaterFinish(Inflater* inflater)
+{
+  if(inflater->sink) return inflateSinkFlush(inflater->sink, inflater->out, &inflater->pos);
+  inflater->out->size = inflater->pos;
+  return 0;
+}
+
+/*sink is optional: if given, the inflated data is handed to it instead of kept in out, see InflateSink*/
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+                                 const LodePNGDecompressSettings* settings, InflateSink* sink)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
-  unsigned BFINAL = 0;
-  size_t pos = 0; /*byte position in the out buffer*/
-  unsigned error = 0;
+  Inflater inflater;
+  BitReader reader;
+  unsigned error;
 
   (void)settings;
 
-  while(!BFINAL)
-  {
-    unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
-
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+  Inflater_init(&inflater, out, sink);
+  BitReader_init(&reader, in, insize);
 
-    if(error) return error;
-  }
+  error = inflaterRun(&inflater, &reader, 1);
+  if(!error && inflater.mode != INFLATE_DONE) error = 52; /*error, the final block is missing*/
+  if(!error) error = inflaterFinish(&inflater);
 
+  Inflater_cleanup(&inflater);
   return error;
 }
 
@@ -1287,23 +1854,25 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_inflatev(&v, in, insize, settings);
+  error = lodepng_inflatev(&v, in, insize, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
+static unsigned inflatev(ucvector* out,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_inflate)
   {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_inflate(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size;
+    return error;
   }
   else
   {
-    return lodepng_inflate(out, outsize, in, insize, settings);
+    return lodepng_inflatev(out, in, insize, settings, 0);
   }
 }
 
@@ -1317,10 +1886,10 @@ static unsigned inflate(unsigned char** out, size_t* outsize,
 
 static const size_t MAX_SUPPORTED_DEFLATE_LENGTH = 258;
 
-/*bitlen is the size in bits of the code*/
-static void addHuffmanSymbol(size_t* bp, ucvector* compressed, unsigned code, unsigned bitlen)
+/*writes the code of the symbol, the tree must have its codes reversed*/
+static void writeHuffmanSymbol(BitWriter* writer, const HuffmanTree* tree, unsigned symbol)
 {
-  addBitsToStreamReversed(bp, compressed, code, bitlen);
+  writeBits(writer, tree->tree1d[symbol], tree->lengths[symbol]);
 }
 
 /*search the index in the array, that has the largest value smaller than or equal to the given value,
@@ -1360,48 +1929,72 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
 }
 
 /*3 bytes of data get encoded into two bytes. The hash cannot use more than 3
-bytes as input because 3 is the minimum match length for deflate*/
+bytes as input because 3 is the minimum match length for deflate, unless
+minmatch is at least 4*/
 static const unsigned HASH_NUM_VALUES = 65536;
 static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
+static const unsigned HASH_SHIFT = 16; /*32 - log2(HASH_NUM_VALUES), for the 4-byte hash*/
 
 typedef struct Hash
 {
-  int* head; /*hash value to head circular pos - can be outdated if went around window*/
-  /*circular pos to prev circular pos*/
+  /*hash value to head circular pos, in the lower 16 bits, with the stamp in the upper ones - can be outdated if
+  went around window, and is empty if it doesn't have the current stamp*/
+  int* head;
+  /*circular pos to prev circular pos, the pos itself at the end of the chain*/
   unsigned short* chain;
   int* val; /*circular pos to hash value*/
 
   /*TODO: do this not only for zeros but for any repeated byte. However for PNG
   it's always going to be the zeros that dominate, so not important for PNG*/
-  int* headz; /*similar to head, but for chainz*/
+  int* headz; /*similar to head, but for chainz, and without stamp*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+
+  unsigned hashbytes; /*the hash is of 3 bytes, or of 4 if no shorter matches are wanted*/
+  /*
+  changes with every hash_reset, in the upper 16 bits. Only positions put in since then can be reached from head,
+  and their chain, val and zeros are all from since then too, so those don't have to be cleared.
+  */
+  unsigned stamp;
+  uivector lz77; /*the LZ77 output of the block being deflated, kept for its memory*/
+  /*the trees of the fixed Huffman codes, made once for all blocks that use them*/
+  HuffmanTree fixed_ll;
+  HuffmanTree fixed_d;
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+static const unsigned HASH_STAMP_MAX = 0x7fff0000u; /*keeps the stamped head values positive, and so not -1*/
+
+/*empties the hash chains, to start on new data with the same allocated window*/
+static void hash_reset(Hash* hash, unsigned minmatch)
 {
   unsigned i;
-  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-
-  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
+  hash->hashbytes = minmatch >= 4 ? 4 : 3;
+  if(hash->stamp == HASH_STAMP_MAX)
   {
-    return 83; /*alloc fail*/
+    /*all stamps used up, only now the head table has to be cleared*/
+    for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+    hash->stamp = 0;
   }
-
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
+  hash->stamp += 65536u;
   for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  hash->lz77.size = 0;
+}
 
+/*
+sets up only what every deflate strategy uses: the LZ77 output and the fixed trees, and no hash chains.
+hash_cleanup must be called also if this fails
+*/
+static unsigned hash_init_output(Hash* hash)
+{
+  hash->head = hash->val = hash->headz = 0;
+  hash->chain = hash->chainz = hash->zeros = 0;
+  uivector_init(&hash->lz77);
+  HuffmanTree_init(&hash->fixed_ll);
+  HuffmanTree_init(&hash->fixed_d);
+  CERROR_TRY_RETURN(generateFixedLitLenTree(&hash->fixed_ll));
+  CERROR_TRY_RETURN(generateFixedDistanceTree(&hash->fixed_d));
+  HuffmanTree_reverseCodes(&hash->fixed_ll);
+  HuffmanTree_reverseCodes(&hash->fixed_d);
   return 0;
 }
 
@@ -1414,13 +2007,50 @@ static void hash_cleanup(Hash* hash)
   lodepng_free(hash->zeros);
   lodepng_free(hash->headz);
   lodepng_free(hash->chainz);
+
+  uivector_cleanup(&hash->lz77);
+  HuffmanTree_cleanup(&hash->fixed_ll);
+  HuffmanTree_cleanup(&hash->fixed_d);
+}
+
+/*hash_cleanup must be called also if this fails*/
+static unsigned hash_init(Hash* hash, unsigned windowsize, unsigned minmatch)
+{
+  unsigned i;
+  CERROR_TRY_RETURN(hash_init_output(hash));
+  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
+  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
+  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+
+  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
+  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+
+  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
+  {
+    return 83; /*alloc fail*/
+  }
+
+  /*initialize hash table*/
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+  hash->stamp = 0;
+  hash_reset(hash, minmatch);
+
+  return 0;
 }
 
 
 
-static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
+static unsigned getHash(const Hash* hash, const unsigned char* data, size_t size, size_t pos)
 {
   unsigned result = 0;
+  if(hash->hashbytes == 4 && pos + 3 < size)
+  {
+    /*Multiplicative hash: spreads the 4 bytes over all bits of the result. Zeros still give 0.*/
+    unsigned value = (unsigned)data[pos] | ((unsigned)data[pos + 1] << 8u)
+                   | ((unsigned)data[pos + 2] << 16u) | ((unsigned)data[pos + 3] << 24u);
+    return (unsigned)((value * 2654435761u) & 0xffffffffu) >> HASH_SHIFT;
+  }
   if(pos + 2 < size)
   {
     /*A simple shift and xor hash is used. Since the data of PNGs is dominated
@@ -1450,16 +2080,68 @@ static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
   return (unsigned)(data - start);
 }
 
+/*the end of the equal bytes at fore and back, at most end*/
+static const unsigned char* matchEnd(const unsigned char* fore, const unsigned char* back, const unsigned char* end)
+{
+#ifdef LODEPNG_MATCH_WORDS
+  while((size_t)(end - fore) >= sizeof(size_t))
+  {
+    size_t a, b;
+    memcpy(&a, fore, sizeof(size_t));
+    memcpy(&b, back, sizeof(size_t));
+    if(a != b) return fore + LODEPNG_CTZ(a ^ b) / 8;
+    fore += sizeof(size_t);
+    back += sizeof(size_t);
+  }
+#endif /*LODEPNG_MATCH_WORDS*/
+  while(fore != end && *back == *fore)
+  {
+    ++back;
+    ++fore;
+  }
+  return fore;
+}
+
+/*the circular pos head[hashval] points to, or -1 if it's empty*/
+static int getHashHead(const Hash* hash, unsigned hashval)
+{
+  int head = hash->head[hashval];
+  return ((unsigned)head & ~65535u) == hash->stamp ? (head & 65535) : -1;
+}
+
 /*wpos = pos & (windowsize - 1)*/
 static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numzeros)
 {
+  int head = getHashHead(hash, hashval);
   hash->val[wpos] = (int)hashval;
-  if(hash->head[hashval] != -1) hash->chain[wpos] = hash->head[hashval];
-  hash->head[hashval] = wpos;
+  /*a chain always gets written, what was in it may be from before the last hash_reset*/
+  hash->chain[wpos] = (unsigned short)(head != -1 ? head : (int)wpos);
+  hash->head[hashval] = (int)(hash->stamp | wpos);
 
   hash->zeros[wpos] = numzeros;
-  if(hash->headz[numzeros] != -1) hash->chainz[wpos] = hash->headz[numzeros];
-  hash->headz[numzeros] = wpos;
+  hash->chainz[wpos] = (unsigned short)(hash->headz[numzeros] != -1 ? hash->headz[numzeros] : (int)wpos);
+  hash->headz[numzeros] = (int)wpos;
+}
+
+/*
+puts the positions from start to end in the hash chains as encodeLZ77 would have when it went past them, so that
+data deflated from end on can refer back to them
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end, unsigned windowsize)
+{
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = start; pos < end; ++pos)
+  {
+    unsigned hashval = getHash(hash, in, end, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, end, pos);
+      else if(pos + numzeros > end || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else numzeros = 0;
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
 }
 
 /*
@@ -1472,13 +2154,18 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
 {
   size_t pos;
   unsigned i, error = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned lazymatching = settings->lazymatching;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = settings->maxchainlength ? settings->maxchainlength
+                          : windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1504,7 +2191,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
     unsigned chainlength = 0;
 
-    hashval = getHash(in, insize, pos);
+    hashval = getHash(hash, in, insize, pos);
 
     if(usezeros && hashval == 0)
     {
@@ -1550,11 +2237,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-        {
-          ++backptr;
-          ++foreptr;
-        }
+        foreptr = matchEnd(foreptr, backptr, lastptr); /*maximum supported length by deflate is max length*/
         current_length = (unsigned)(foreptr - &in[pos]);
 
         if(current_length > length)
@@ -1604,8 +2287,9 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
         {
           length = lazylength;
           offset = lazyoffset;
-          hash->head[hashval] = -1; /*the same hashchain update will be done, this ensures no wrong alteration*/
-          hash->headz[numzeros] = -1; /*idem*/
+          /*the same hashchain update will be done again, this undoes the first one so it isn't chained to itself*/
+          hash->head[hashval] = hash->chain[wpos] != wpos ? (int)(hash->stamp | hash->chain[wpos]) : -1;
+          hash->headz[numzeros] = hash->chainz[wpos] != wpos ? hash->chainz[wpos] : -1; /*idem*/
           --pos;
         }
       }
@@ -1630,7 +2314,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
       {
         ++pos;
         wpos = pos & (windowsize - 1);
-        hashval = getHash(in, insize, pos);
+        hashval = getHash(hash, in, insize, pos);
         if(usezeros && hashval == 0)
         {
           if(numzeros == 0) numzeros = countZeros(in, insize, pos);
@@ -1648,21 +2332,79 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+LZ77-encode the data for LDS_RLE: only matches at the distances where the bytes of one pixel before are, which
+finds the runs in filtered image data without a hash table. Like encodeLZ77, the bytes before inpos are the window.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize)
+{
+  static const unsigned DISTANCES[6] = {1, 2, 3, 4, 6, 8};
+  size_t pos = inpos;
+  while(pos < insize)
+  {
+    const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH
+                                       ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+    unsigned i, length = 0, offset = 0;
+    for(i = 0; i != 6 && DISTANCES[i] <= pos; ++i)
+    {
+      const unsigned char* backptr = &in[pos - DISTANCES[i]];
+      unsigned current_length;
+      if(*backptr != in[pos]) continue;
+      current_length = (unsigned)(matchEnd(&in[pos], backptr, lastptr) - &in[pos]);
+      if(current_length > length)
+      {
+        length = current_length;
+        offset = DISTANCES[i];
+        if(length == MAX_SUPPORTED_DEFLATE_LENGTH) break;
+      }
+    }
+
+    if(length >= 3)
+    {
+      addLengthDistance(out, length, offset);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+  return 0;
+}
+
+/*LZ77-encode the data with the strategy of the settings, which looks for matches*/
+static unsigned encodeMatches(uivector* out, Hash* hash,
+                              const unsigned char* in, size_t inpos, size_t insize,
+                              const LodePNGCompressSettings* settings)
+{
+  if(settings->strategy == LDS_RLE) return encodeRLE(out, in, inpos, insize);
+  return encodeLZ77(out, hash, in, inpos, insize, settings);
+}
+
+/*whether the settings look for LZ77 matches at all, otherwise the bytes are Huffman coded as they are*/
+static unsigned findsMatches(const LodePNGCompressSettings* settings)
+{
+  return settings->use_lz77 && settings->strategy != LDS_HUFFMAN_ONLY;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+/*final: whether the last block written gets the BFINAL bit*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
   size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
   unsigned datapos = 0;
+  if(numdeflateblocks == 0 && final) numdeflateblocks = 1; /*an empty final block still must be there*/
   for(i = 0; i != numdeflateblocks; ++i)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1687,19 +2429,30 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
   return 0;
 }
 
+/*empty stored block at bit bp, as a zlib sync flush: BFINAL 0 and BTYPE 00, padding, LEN 0 and NLEN 65535*/
+static unsigned deflateSyncFlush(ucvector* out, size_t bp)
+{
+  BitWriter writer;
+  BitWriter_begin(&writer, out, bp);
+  writeBits(&writer, 0, 3);
+  BitWriter_end(&writer);
+  if(writer.error) return writer.error;
+  lodepng_add32bitInt(out, 0x0000ffffu);
+  return 0;
+}
+
 /*
 write the lz77-encoded data, which has lit, len and dist codes, to compressed stream using huffman trees.
 tree_ll: the tree for lit and len codes.
 tree_d: the tree for distance codes.
 */
-static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+static void writeLZ77data(BitWriter* writer, const uivector* lz77_encoded,
                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
 {
   size_t i = 0;
   for(i = 0; i != lz77_encoded->size; ++i)
   {
     unsigned val = lz77_encoded->data[i];
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
     if(val > 256) /*for a length code, 3 more things have to be added*/
     {
       unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
@@ -1712,16 +2465,38 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
       unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
       unsigned distance_extra_bits = lz77_encoded->data[++i];
 
-      addBitsToStream(bp, out, length_extra_bits, n_length_extra_bits);
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_d, distance_code),
-                       HuffmanTree_getLength(tree_d, distance_code));
-      addBitsToStream(bp, out, distance_extra_bits, n_distance_extra_bits);
+      /*each code goes together with its extra bits: at most 15 + 5 and 15 + 13 bits*/
+      unsigned length_bits = tree_ll->lengths[val];
+      unsigned distance_bits = tree_d->lengths[distance_code];
+      writeBits(writer, tree_ll->tree1d[val] | (length_extra_bits << length_bits),
+                length_bits + n_length_extra_bits);
+      writeBits(writer, tree_d->tree1d[distance_code] | (distance_extra_bits << distance_bits),
+                distance_bits + n_distance_extra_bits);
     }
+    else writeHuffmanSymbol(writer, tree_ll, val);
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
+/*
+write the symbols of a block with the given trees and its end code: the lz77-encoded data if there are matches,
+otherwise the bytes of data[datapos..dataend) themselves.
+*/
+static void writeBlockSymbols(BitWriter* writer, const uivector* lz77_encoded, unsigned matches,
+                              const unsigned char* data, size_t datapos, size_t dataend,
+                              const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
+{
+  size_t i;
+  if(matches) writeLZ77data(writer, lz77_encoded, tree_ll, tree_d);
+  else for(i = datapos; i != dataend; ++i) writeHuffmanSymbol(writer, tree_ll, data[i]);
+  writeHuffmanSymbol(writer, tree_ll, 256);
+}
+
+/*
+Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees. A block that
+comes out smaller with the fixed trees, as small ones often do since those cost no bits to describe, is written
+as a fixed block instead.
+*/
+static unsigned deflateDynamic(BitWriter* writer, Hash* hash,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final)
 {
@@ -1739,7 +2514,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   */
 
   /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
+  uivector* lz77_encoded = &hash->lz77;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
@@ -1752,7 +2527,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   (these are written as is in the file, it would be crazy to compress these using yet another huffman
   tree that needs to be represented by yet another set of code lengths)*/
   uivector bitlen_cl;
-  size_t datasize = dataend - datapos;
+  unsigned matches = findsMatches(settings);
 
   /*
   Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
@@ -1763,9 +2538,11 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
 
   unsigned BFINAL = final;
   size_t numcodes_ll, numcodes_d, i;
+  size_t dynamicbits, fixedbits; /*size of the block both ways, without the extra bits that both have*/
+  size_t extrabits; /*the extra bits of lengths and distances*/
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
+  lz77_encoded->size = 0;
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
@@ -1780,29 +2557,28 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->use_lz77)
+    if(matches)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeMatches(lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
 
     if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
     if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i)
+    if(!matches)
     {
-      unsigned symbol = lz77_encoded.data[i];
+      /*no LZ77, but still will be Huffman compressed: the data are the symbols*/
+      for(i = datapos; i != dataend; ++i) ++frequencies_ll.data[data[i]];
+    }
+    else for(i = 0; i != lz77_encoded->size; ++i)
+    {
+      unsigned symbol = lz77_encoded->data[i];
       ++frequencies_ll.data[symbol];
       if(symbol > 256)
       {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = lz77_encoded->data[i + 2];
         ++frequencies_d.data[dist];
         i += 3;
       }
@@ -1897,6 +2673,47 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     }
     if(error) break;
 
+    HLIT = (unsigned)(numcodes_ll - 257);
+    HDIST = (unsigned)(numcodes_d - 1);
+    HCLEN = (unsigned)bitlen_cl.size - 4;
+    /*trim zeroes for HCLEN. HLIT and HDIST were already trimmed at tree creation*/
+    while(!bitlen_cl.data[HCLEN + 4 - 1] && HCLEN > 0) --HCLEN;
+
+    /*compare the exact sizes of the dynamic and the fixed block*/
+    dynamicbits = 5 + 5 + 4 + (HCLEN + 4) * 3;
+    fixedbits = 0;
+    for(i = 0; i != bitlen_lld_e.size; ++i)
+    {
+      unsigned symbol = bitlen_lld_e.data[i];
+      dynamicbits += HuffmanTree_getLength(&tree_cl, symbol);
+      if(symbol >= 16) dynamicbits += symbol == 16 ? 2 : symbol == 17 ? 3 : 7;
+      if(symbol >= 16) ++i;
+    }
+    for(i = 0; i != tree_ll.numcodes; ++i)
+    {
+      dynamicbits += (size_t)frequencies_ll.data[i] * HuffmanTree_getLength(&tree_ll, (unsigned)i);
+      fixedbits += (size_t)frequencies_ll.data[i] * HuffmanTree_getLength(&hash->fixed_ll, (unsigned)i);
+    }
+    for(i = 0; i != tree_d.numcodes; ++i)
+    {
+      dynamicbits += (size_t)frequencies_d.data[i] * HuffmanTree_getLength(&tree_d, (unsigned)i);
+      fixedbits += (size_t)frequencies_d.data[i] * HuffmanTree_getLength(&hash->fixed_d, (unsigned)i);
+    }
+
+    extrabits = 0;
+    for(i = 0; i != 29; ++i) extrabits += (size_t)frequencies_ll.data[FIRST_LENGTH_CODE_INDEX + i] * LENGTHEXTRA[i];
+    for(i = 0; i != 30; ++i) extrabits += (size_t)frequencies_d.data[i] * DISTANCEEXTRA[i];
+    /*with these the size of the block is known exactly, so the output grows only once*/
+    BitWriter_reserve(writer, 3 + extrabits + (fixedbits < dynamicbits ? fixedbits : dynamicbits));
+
+    if(fixedbits < dynamicbits)
+    {
+      /*BFINAL, then BTYPE "fixed", 01 with its first bit the least significant one*/
+      writeBits(writer, BFINAL | (1u << 1u), 3);
+      writeBlockSymbols(writer, lz77_encoded, matches, data, datapos, dataend, &hash->fixed_ll, &hash->fixed_d);
+      break;
+    }
+
     /*
     Write everything into the output
 
@@ -1911,48 +2728,37 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     - 256 (end code)
     */
 
-    /*Write block type*/
-    addBitToStream(bp, out, BFINAL);
-    addBitToStream(bp, out, 0); /*first bit of BTYPE "dynamic"*/
-    addBitToStream(bp, out, 1); /*second bit of BTYPE "dynamic"*/
+    /*Write block type: BFINAL, then BTYPE "dynamic", 10 with its first bit the least significant one*/
+    writeBits(writer, BFINAL | (2u << 1u), 3);
 
     /*write the HLIT, HDIST and HCLEN values*/
-    HLIT = (unsigned)(numcodes_ll - 257);
-    HDIST = (unsigned)(numcodes_d - 1);
-    HCLEN = (unsigned)bitlen_cl.size - 4;
-    /*trim zeroes for HCLEN. HLIT and HDIST were already trimmed at tree creation*/
-    while(!bitlen_cl.data[HCLEN + 4 - 1] && HCLEN > 0) --HCLEN;
-    addBitsToStream(bp, out, HLIT, 5);
-    addBitsToStream(bp, out, HDIST, 5);
-    addBitsToStream(bp, out, HCLEN, 4);
+    writeBits(writer, HLIT, 5);
+    writeBits(writer, HDIST, 5);
+    writeBits(writer, HCLEN, 4);
 
     /*write the code lenghts of the code length alphabet*/
-    for(i = 0; i != HCLEN + 4; ++i) addBitsToStream(bp, out, bitlen_cl.data[i], 3);
+    for(i = 0; i != HCLEN + 4; ++i) writeBits(writer, bitlen_cl.data[i], 3);
 
     /*write the lenghts of the lit/len AND the dist alphabet*/
     for(i = 0; i != bitlen_lld_e.size; ++i)
     {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_cl, bitlen_lld_e.data[i]),
-                       HuffmanTree_getLength(&tree_cl, bitlen_lld_e.data[i]));
+      writeHuffmanSymbol(writer, &tree_cl, bitlen_lld_e.data[i]);
       /*extra bits of repeat codes*/
-      if(bitlen_lld_e.data[i] == 16) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 2);
-      else if(bitlen_lld_e.data[i] == 17) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 3);
-      else if(bitlen_lld_e.data[i] == 18) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 7);
+      if(bitlen_lld_e.data[i] == 16) writeBits(writer, bitlen_lld_e.data[++i], 2);
+      else if(bitlen_lld_e.data[i] == 17) writeBits(writer, bitlen_lld_e.data[++i], 3);
+      else if(bitlen_lld_e.data[i] == 18) writeBits(writer, bitlen_lld_e.data[++i], 7);
     }
 
-    /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
 
-    /*write the end code*/
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+    /*write the compressed data symbols and the end code*/
+    writeBlockSymbols(writer, lz77_encoded, matches, data, datapos, dataend, &tree_ll, &tree_d);
 
     break; /*end of error-while*/
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
@@ -1966,95 +2772,109 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
+static unsigned deflateFixed(BitWriter* writer, Hash* hash,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
                              const LodePNGCompressSettings* settings, unsigned final)
 {
-  HuffmanTree tree_ll; /*tree for literal values and length codes*/
-  HuffmanTree tree_d; /*tree for distance codes*/
-
   unsigned BFINAL = final;
-  unsigned error = 0;
-  size_t i;
-
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-
-  generateFixedLitLenTree(&tree_ll);
-  generateFixedDistanceTree(&tree_d);
+  unsigned matches = findsMatches(settings);
 
-  addBitToStream(bp, out, BFINAL);
-  addBitToStream(bp, out, 1); /*first bit of BTYPE*/
-  addBitToStream(bp, out, 0); /*second bit of BTYPE*/
+  hash->lz77.size = 0;
+  if(matches) CERROR_TRY_RETURN(encodeMatches(&hash->lz77, hash, data, datapos, dataend, settings));
 
-  if(settings->use_lz77) /*LZ77 encoded*/
-  {
-    uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
-    if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
-  }
-  else /*no LZ77, but still will be Huffman compressed*/
-  {
-    for(i = datapos; i < dataend; ++i)
-    {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
-    }
-  }
-  /*add END code*/
-  if(!error) addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+  /*BFINAL, then BTYPE "fixed", 01 with its first bit the least significant one*/
+  writeBits(writer, BFINAL | (1u << 1u), 3);
 
-  /*cleanup*/
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+  /*the fixed trees were made with the hash*/
+  writeBlockSymbols(writer, &hash->lz77, matches, data, datapos, dataend, &hash->fixed_ll, &hash->fixed_d);
+  return 0;
+}
 
-  return error;
+/*the size of the dynamic blocks to split data of the given total size into*/
+static size_t getDynamicBlockSize(size_t insize)
+{
+  /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+  size_t blocksize = insize / 8 + 8;
+  if(blocksize < 65536) blocksize = 65536;
+  if(blocksize > 262144) blocksize = 262144;
+  return blocksize;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+deflates in[inpos..insize) as one or more blocks continuing at bit bp of out. The LZ77 window starts out with the
+bytes before inpos in it, 0 gives an empty one. Only the last block gets the BFINAL bit, and only if final.
+*/
+static unsigned deflateBlocks(ucvector* out, size_t* bp, const unsigned char* in, size_t inpos, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
-  Hash hash;
+  BitWriter writer;
+  Hash ownhash;
+  Hash* hash = settings->context ? settings->context->hash : &ownhash;
+  /*only the hash chain search needs the tables of the hash, the other strategies just use its lz77 and trees*/
+  unsigned usehash = findsMatches(settings) && settings->strategy == LDS_DEFAULT;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/
+  if((unsigned)settings->strategy > LDS_HUFFMAN_ONLY) return 100; /*invalid deflate strategy*/
+  else if(settings->btype == 0)
   {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8 + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
+    error = deflateNoCompression(out, &in[inpos], insize - inpos, final);
+    *bp = out->size * 8; /*non compressed blocks always end at a byte boundary*/
+    return error;
   }
+  else if(settings->btype == 1) blocksize = insize - inpos;
+  else /*if(settings->btype == 2)*/ blocksize = getDynamicBlockSize(insize - inpos);
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
+  /*empty data still gets one (empty) block, a fixed one has no size to divide by then*/
+  numdeflateblocks = blocksize ? (insize - inpos + blocksize - 1) / blocksize : 1;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
+  if(settings->context) hash_reset(hash, settings->minmatch);
+  else
+  {
+    error = usehash ? hash_init(hash, settings->windowsize, settings->minmatch) : hash_init_output(hash);
+    if(error)
+    {
+      hash_cleanup(hash);
+      return error;
+    }
+  }
+  /*encodeLZ77 checks the window size itself*/
+  if(usehash && inpos != 0 && settings->windowsize != 0 && settings->windowsize <= 32768
+     && (settings->windowsize & (settings->windowsize - 1)) == 0)
+  {
+    hash_prime(hash, in, inpos > settings->windowsize ? inpos - settings->windowsize : 0, inpos,
+               settings->windowsize);
+  }
 
+  BitWriter_begin(&writer, out, *bp);
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
+    unsigned BFINAL = final && (i == numdeflateblocks - 1);
+    size_t start = inpos + i * blocksize;
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(&writer, hash, in, start, end, settings, BFINAL);
+    else if(settings->btype == 2) error = deflateDynamic(&writer, hash, in, start, end, settings, BFINAL);
   }
+  *bp = BitWriter_end(&writer);
+  if(!error) error = writer.error;
 
-  hash_cleanup(&hash);
+  if(!settings->context) hash_cleanup(hash); /*the context keeps its hash*/
 
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  size_t bp = 0; /*the bit pointer*/
+  return deflateBlocks(out, &bp, in, 0, insize, settings, 1);
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
@@ -2088,15 +2908,100 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
-{
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+/*bytes that can be summed before the sums may overflow and need the modulo, a multiple of 32*/
+#define ADLER32_BLOCK 5536
 
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+/*
+Adler-32 of 16 bytes at a time: s1 is the sum of the bytes (psadbw), s2 gets every byte times its distance to the
+end of the block (pmaddubsw), and 16 times s1 of the blocks before it, which is summed in ps and added at the end.
+Does whole blocks of 32 bytes, moves data and length past them.
+*/
+static LODEPNG_TARGET("ssse3") void adler32SSSE3(unsigned* s1, unsigned* s2,
+                                                 const unsigned char** data, size_t* length)
+{
+  const __m128i weights_hi = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i weights_lo = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i zero = _mm_setzero_si128();
+  const unsigned char* in = *data;
+  size_t blocks = *length / 32;
+  *length -= blocks * 32;
+
+  while(blocks > 0)
+  {
+    size_t n = blocks < ADLER32_BLOCK / 32 ? blocks : ADLER32_BLOCK / 32;
+    __m128i ps = _mm_cvtsi32_si128((int)(*s1 * n));
+    __m128i v1 = zero;
+    __m128i v2 = _mm_cvtsi32_si128((int)*s2);
+    blocks -= n;
+    for(; n > 0; --n, in += 32)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)in);
+      __m128i b = _mm_loadu_si128((const __m128i*)(in + 16));
+      ps = _mm_add_epi32(ps, v1);
+      v1 = _mm_add_epi32(v1, _mm_add_epi32(_mm_sad_epu8(a, zero), _mm_sad_epu8(b, zero)));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, weights_hi), ones));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, weights_lo), ones));
+    }
+    v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+    /*horizontal sums: v1 has two 64-bit halves, v2 four 32-bit lanes*/
+    v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+    *s1 = (*s1 + (unsigned)_mm_cvtsi128_si32(v1)) % 65521;
+    *s2 = (unsigned)_mm_cvtsi128_si32(v2) % 65521;
+  }
+  *data = in;
+}
+
+/*adler32SSSE3 with 32 bytes per step*/
+static LODEPNG_TARGET("avx2") void adler32AVX2(unsigned* s1, unsigned* s2,
+                                               const unsigned char** data, size_t* length)
+{
+  const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                           16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i zero = _mm256_setzero_si256();
+  const unsigned char* in = *data;
+  size_t blocks = *length / 32;
+  *length -= blocks * 32;
+
+  while(blocks > 0)
+  {
+    size_t n = blocks < ADLER32_BLOCK / 32 ? blocks : ADLER32_BLOCK / 32;
+    __m256i ps = _mm256_setr_epi32((int)(*s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v1 = zero;
+    __m256i v2 = _mm256_setr_epi32((int)*s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i h1, h2;
+    blocks -= n;
+    for(; n > 0; --n, in += 32)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)in);
+      ps = _mm256_add_epi32(ps, v1);
+      v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(a, zero));
+      v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, weights), ones));
+    }
+    v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(ps, 5));
+    h1 = _mm_add_epi32(_mm256_castsi256_si128(v1), _mm256_extracti128_si256(v1, 1));
+    h2 = _mm_add_epi32(_mm256_castsi256_si128(v2), _mm256_extracti128_si256(v2, 1));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+    *s1 = (*s1 + (unsigned)_mm_cvtsi128_si32(h1)) % 65521;
+    *s2 = (unsigned)_mm_cvtsi128_si32(h2) % 65521;
+  }
+  *data = in;
+}
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+
+/*adds the bytes one at a time to the sums s1 and s2, returns the Adler-32 of them*/
+static unsigned adler32Bytes(unsigned s1, unsigned s2, const unsigned char* data, size_t len)
+{
   while(len > 0)
   {
     /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5550 ? 5550 : len;
+    size_t amount = len > ADLER32_BLOCK ? ADLER32_BLOCK : len;
     len -= amount;
     while(amount > 0)
     {
@@ -2111,22 +3016,69 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16) | s1;
 }
 
+static unsigned update_adler32(unsigned adler, const unsigned char* data, size_t len)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+  if(len >= 64)
+  {
+    unsigned features = lodepng_cpu_features();
+    if(features & LODEPNG_CPU_AVX2) adler32AVX2(&s1, &s2, &data, &len);
+    else if(features & LODEPNG_CPU_SSSE3) adler32SSSE3(&s1, &s2, &data, &len);
+  }
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+
+  return adler32Bytes(s1, s2, data, len);
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
-static unsigned adler32(const unsigned char* data, unsigned len)
+static unsigned adler32(const unsigned char* data, size_t len)
 {
   return update_adler32(1L, data, len);
 }
 
+unsigned lodepng_adler32_path(unsigned* result, unsigned adler, const unsigned char* data, size_t len,
+                              unsigned path)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  if(path == 0) {}
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+  else if(path == 1 && (lodepng_cpu_features() & LODEPNG_CPU_SSSE3)) adler32SSSE3(&s1, &s2, &data, &len);
+  else if(path == 2 && (lodepng_cpu_features() & LODEPNG_CPU_AVX2)) adler32AVX2(&s1, &s2, &data, &len);
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+  else return 104;
+  *result = adler32Bytes(s1, s2, data, len);
+  return 0;
+}
+
+#if (defined(LODEPNG_COMPILE_DECODER) && defined(LODEPNG_COMPILE_PNG)) || defined(LODEPNG_COMPILE_ENCODER)
+/*the adler32 of two pieces of data after each other, from the adler32 of both and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  /*the second one started at s1 = 1 instead of at s1 of the first one, s2 got that difference once per byte*/
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  s1 %= 65521;
+  s2 %= 65521;
+  return (s2 << 16) | s1;
+}
+#endif /*(defined(LODEPNG_COMPILE_DECODER) && defined(LODEPNG_COMPILE_PNG)) || defined(LODEPNG_COMPILE_ENCODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*checks the 2-byte zlib header, returns error code*/
+static unsigned zlib_check_header(const unsigned char* in, size_t insize)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2155,21 +3107,46 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  return 0;
+}
+
+static unsigned zlib_decompressv(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
+
+  error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32(out->data, out->size);
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                size_t insize, const LodePNGDecompressSettings* settings)
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = zlib_decompressv(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+/*
+expected_size is the decompressed size if known in advance, or 0 if not. The out buffer then gets allocated
+once with the right size, instead of growing while inflating.
+*/
+static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
+                                const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_zlib)
   {
@@ -2177,80 +3154,547 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
   }
   else
   {
-    return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+    unsigned error = 0;
+    ucvector v;
+    ucvector_init_buffer(&v, *out, *outsize);
+    /*the margin is room for the last symbol, without it the inflater would still grow the buffer at the end*/
+    if(expected_size && !ucvector_reserve(&v, *outsize + expected_size + INFLATE_MARGIN)) error = 83; /*alloc fail*/
+    if(!error) error = zlib_decompressv(&v, in, insize, settings);
+    *out = v.data;
+    *outsize = v.size;
+    return error;
   }
 }
 
-#endif /*LODEPNG_COMPILE_DECODER*/
-
-#ifdef LODEPNG_COMPILE_ENCODER
+#ifdef LODEPNG_COMPILE_PNG
+typedef struct ZlibSink
+{
+  InflateSink sink; /*what the inflater sees*/
+  unsigned (*flush)(void* context, const unsigned char* data, size_t size); /*the real receiver*/
+  void* context;
+  unsigned adler; /*running checksum of everything flushed so far*/
+} ZlibSink;
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings)
+static unsigned zlibSinkFlush(void* context, const unsigned char* data, size_t size)
 {
-  /*initially, *out must be NULL and outsize 0, if you just give some random *out
-  that's pointing to a non allocated buffer, this'll crash*/
-  ucvector outv;
-  size_t i;
-  unsigned error;
-  unsigned char* deflatedata = 0;
-  size_t deflatesize = 0;
+  ZlibSink* zsink = (ZlibSink*)context;
+  zsink->adler = update_adler32(zsink->adler, data, size);
+  return zsink->flush(zsink->context, data, size);
+}
 
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
+/*how much input is collected before inflating it, when the input comes in pieces too short for a step*/
+#define ZLIB_DECODER_COLLECT (2 * ((INFLATE_MAX_HEADER_BITS + 7) / 8))
 
-  /*ucvector-controlled version of the output buffer, for dynamic array*/
-  ucvector_init_buffer(&outv, *out, *outsize);
+/*
+Decompresses zlib data that is given in pieces, see zlibDecoderWrite. The pieces are inflated directly where
+they are, only the few bytes at the end of a piece that are too short for the next step of the inflater are
+kept until the next piece. The result goes to out, or with a flush function, in pieces to flush (then out is
+only the 32K window). With custom zlib or inflate functions this isn't possible, then all input is collected
+and decompressed at the end.
+*/
+typedef struct ZlibDecoder
+{
+  const LodePNGDecompressSettings* settings;
+  ucvector out; /*the result, or only the window if flushing*/
+  ZlibSink zsink; /*used when flushing*/
+  Inflater inflater;
+  ucvector pending; /*unused input of the previous pieces, or all input with a custom zlib or inflate*/
+  size_t pendingbits; /*bits of the first pending byte that were already used*/
+  size_t received; /*amount of input so far*/
+  unsigned char header[2]; /*CMF and FLG*/
+  unsigned char tail[4]; /*the last 4 input bytes, which end up being ADLER32*/
+  /*keep all input in pending and decompress it at the end, for a custom zlib or inflate. Can also be set after
+  zlibDecoderInit, to get all the zlib data in pending (see decodeImageParallel).*/
+  unsigned collect;
+} ZlibDecoder;
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
+/*
+expected_size is the decompressed size if known in advance, or 0 if not. flush can be NULL to keep
+the result in decoder->out. Returns error code, the decoder must be cleaned up also after an error.
+*/
+static unsigned zlibDecoderInit(ZlibDecoder* decoder, const LodePNGDecompressSettings* settings,
+                                size_t expected_size,
+                                unsigned (*flush)(void*, const unsigned char*, size_t), void* context)
+{
+  decoder->settings = settings;
+  ucvector_init(&decoder->out);
+  decoder->zsink.sink.flush = zlibSinkFlush;
+  decoder->zsink.sink.context = &decoder->zsink;
+  decoder->zsink.sink.start = 0;
+  decoder->zsink.flush = flush;
+  decoder->zsink.context = context;
+  decoder->zsink.adler = 1;
+  Inflater_init(&decoder->inflater, &decoder->out, flush ? &decoder->zsink.sink : 0);
+  ucvector_init(&decoder->pending);
+  decoder->pendingbits = 0;
+  decoder->received = 0;
+  memset(decoder->tail, 0, 4);
+  decoder->collect = settings->custom_zlib || settings->custom_inflate;
+
+  /*the margin is room for the last symbol, without it the inflater would still grow the buffer at the end*/
+  if(!flush && expected_size && !decoder->collect
+     && !ucvector_reserve(&decoder->out, expected_size + INFLATE_MARGIN)) return 83; /*alloc fail*/
+  return 0;
+}
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+static void zlibDecoderCleanup(ZlibDecoder* decoder)
+{
+  ucvector_cleanup(&decoder->out);
+  ucvector_cleanup(&decoder->pending);
+  Inflater_cleanup(&decoder->inflater);
+}
 
-  if(!error)
+/*inflates in starting at bit bp, as far as it goes, and keeps what's left of in as pending input*/
+static unsigned zlibDecoderInflate(ZlibDecoder* decoder, const unsigned char* in, size_t insize, size_t bp,
+                                   unsigned last)
+{
+  BitReader reader;
+  size_t rest;
+  BitReader_init(&reader, in, insize);
+  BitReader_seek(&reader, bp);
+  CERROR_TRY_RETURN(inflaterRun(&decoder->inflater, &reader, last));
+
+  if(decoder->inflater.mode == INFLATE_DONE) rest = 0; /*the rest is ADLER32, which is in tail*/
+  else rest = insize - reader.bp / 8u;
+  /*in can be pending itself*/
+  if(rest && in + insize - rest != decoder->pending.data)
   {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
-    lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
+    if(!ucvector_reserve(&decoder->pending, rest)) return 83; /*alloc fail*/
+    memmove(decoder->pending.data, in + insize - rest, rest);
   }
-
-  *out = outv.data;
-  *outsize = outv.size;
-
-  return error;
+  decoder->pending.size = rest;
+  decoder->pendingbits = reader.bp & 7u;
+  return 0;
 }
 
-/* compress using the default or custom zlib function */
-static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+/*gives the next size bytes of the zlib data to the decoder*/
+static unsigned zlibDecoderWrite(ZlibDecoder* decoder, const unsigned char* data, size_t size)
 {
-  if(settings->custom_zlib)
+  size_t i;
+  for(i = size < 4 ? 0 : size - 4; i < size; ++i)
   {
-    return settings->custom_zlib(out, outsize, in, insize, settings);
+    memmove(decoder->tail, decoder->tail + 1, 3);
+    decoder->tail[3] = data[i];
   }
-  else
+  if(decoder->collect)
   {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+    size_t oldsize = decoder->pending.size;
+    if(!ucvector_resize(&decoder->pending, oldsize + size)) return 83; /*alloc fail*/
+    if(size) memcpy(&decoder->pending.data[oldsize], data, size);
+    decoder->received += size;
+    return 0;
   }
-}
 
-#endif /*LODEPNG_COMPILE_ENCODER*/
+  while(size > 0 && decoder->received < 2)
+  {
+    decoder->header[decoder->received++] = *data++;
+    --size;
+    if(decoder->received == 2) CERROR_TRY_RETURN(zlib_check_header(decoder->header, 2));
+  }
+  decoder->received += size;
+  if(size == 0 || decoder->inflater.mode == INFLATE_DONE) return 0;
 
-#else /*no LODEPNG_COMPILE_ZLIB*/
+  if(decoder->pending.size > 0)
+  {
+    /*continue with the pending input, followed by enough of data to finish the step it was too short for*/
+    size_t oldsize = decoder->pending.size;
+    size_t amount = size < ZLIB_DECODER_COLLECT ? size : ZLIB_DECODER_COLLECT;
+    size_t bp;
+    if(!ucvector_resize(&decoder->pending, oldsize + amount)) return 83; /*alloc fail*/
+    memcpy(&decoder->pending.data[oldsize], data, amount);
+    CERROR_TRY_RETURN(zlibDecoderInflate(decoder, decoder->pending.data, decoder->pending.size,
+                                         decoder->pendingbits, 0));
+    if(amount == size || decoder->inflater.mode == INFLATE_DONE) return 0;
 
-#ifdef LODEPNG_COMPILE_DECODER
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                size_t insize, const LodePNGDecompressSettings* settings)
+    /*the inflater stopped inside the part of data that was added (it needs less than half of it for a step),
+    continue there in data itself*/
+    bp = (oldsize + amount - decoder->pending.size) * 8 + decoder->pendingbits - oldsize * 8;
+    decoder->pending.size = 0;
+    return zlibDecoderInflate(decoder, data, size, bp, 0);
+  }
+  return zlibDecoderInflate(decoder, data, size, decoder->pendingbits, 0);
+}
+
+/*
+decompresses the rest of the data and checks ADLER32. The result is then in decoder->out, or was given
+to flush.
+*/
+static unsigned zlibDecoderFinish(ZlibDecoder* decoder)
+{
+  const LodePNGDecompressSettings* settings = decoder->settings;
+  unsigned checksum;
+
+  if(decoder->collect)
+  {
+    unsigned char* buffer = 0;
+    size_t buffersize = 0;
+    unsigned error = zlib_decompress(&buffer, &buffersize, 0, decoder->pending.data, decoder->pending.size,
+                                     settings);
+    if(!error && decoder->zsink.flush) error = decoder->zsink.flush(decoder->zsink.context, buffer, buffersize);
+    if(!error && !decoder->zsink.flush)
+    {
+      ucvector_cleanup(&decoder->out);
+      ucvector_init_buffer(&decoder->out, buffer, buffersize);
+      buffer = 0;
+    }
+    lodepng_free(buffer);
+    return error;
+  }
+
+  if(decoder->received < 2) return 53; /*error, size of zlib data too small*/
+  if(decoder->inflater.mode != INFLATE_DONE)
+  {
+    CERROR_TRY_RETURN(zlibDecoderInflate(decoder, decoder->pending.data, decoder->pending.size,
+                                         decoder->pendingbits, 1));
+    if(decoder->inflater.mode != INFLATE_DONE) return 52; /*error, the final block is missing*/
+  }
+  CERROR_TRY_RETURN(inflaterFinish(&decoder->inflater));
+
+  if(!settings->ignore_adler32)
+  {
+    unsigned ADLER32 = lodepng_read32bitInt(decoder->tail);
+    if(decoder->zsink.flush) checksum = decoder->zsink.adler;
+    else checksum = adler32(decoder->out.data, decoder->out.size);
+    if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+
+  return 0; /*no error*/
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+
+/*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+static void zlib_add_header(ucvector* out)
+{
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG >> 8));
+  ucvector_push_back(out, (unsigned char)(CMFFLG & 255));
+}
+
+/*bytes of the data per task of deflateParallel, a multiple of the biggest dynamic block size*/
+#define DEFLATE_PIECE_SIZE 524288
+
+/*a piece of the data for deflateParallel*/
+typedef struct DeflatePiece
+{
+  const unsigned char* in;
+  size_t start, end; /*the piece is in[start..end)*/
+  unsigned final; /*the piece at the end of the data*/
+  const LodePNGCompressSettings* settings;
+  ucvector out; /*the deflate blocks of the piece, starting and ending at a byte boundary*/
+  unsigned adler; /*adler32 of the piece*/
+  unsigned error;
+} DeflatePiece;
+
+/*the task of deflateParallel for piece index*/
+static void deflatePieceTask(void* data, size_t index)
+{
+  DeflatePiece* piece = &((DeflatePiece*)data)[index];
+  size_t bp = 0;
+  LodePNGCompressSettings settings = *piece->settings;
+  settings.context = 0; /*the pieces run at the same time, each gets its own hash*/
+  piece->error = deflateBlocks(&piece->out, &bp, piece->in, piece->start, piece->end, &settings, piece->final);
+  if(!piece->error && !piece->final) piece->error = deflateSyncFlush(&piece->out, bp);
+  piece->adler = adler32(&piece->in[piece->start], piece->end - piece->start);
+}
+
+/*
+deflates in pieces of DEFLATE_PIECE_SIZE with settings->parallel_for, and appends them to out. Every piece starts
+with the window before it like deflateBlocks does, so it compresses almost as well as one piece. adler gets the
+adler32 of the data, from the ones of the pieces.
+*/
+static unsigned deflateParallel(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, numpieces = (insize + DEFLATE_PIECE_SIZE - 1) / DEFLATE_PIECE_SIZE;
+  DeflatePiece* pieces = (DeflatePiece*)lodepng_malloc(numpieces * sizeof(DeflatePiece));
+  if(!pieces) return 83; /*alloc fail*/
+
+  for(i = 0; i != numpieces; ++i)
+  {
+    pieces[i].in = in;
+    pieces[i].start = i * DEFLATE_PIECE_SIZE;
+    pieces[i].end = i + 1 == numpieces ? insize : pieces[i].start + DEFLATE_PIECE_SIZE;
+    pieces[i].final = i + 1 == numpieces;
+    pieces[i].settings = settings;
+    ucvector_init(&pieces[i].out);
+    pieces[i].error = 0;
+  }
+  settings->parallel_for(deflatePieceTask, pieces, numpieces, settings->parallel_context);
+
+  *adler = 1;
+  for(i = 0; i != numpieces; ++i)
+  {
+    if(!error) error = pieces[i].error;
+    if(!error && !ucvector_resize(out, out->size + pieces[i].out.size)) error = 83; /*alloc fail*/
+    if(!error)
+    {
+      memcpy(&out->data[out->size - pieces[i].out.size], pieces[i].out.data, pieces[i].out.size);
+      *adler = adler32_combine(*adler, pieces[i].adler, pieces[i].end - pieces[i].start);
+    }
+    ucvector_cleanup(&pieces[i].out);
+  }
+  lodepng_free(pieces);
+  return error;
+}
+
+/*appends the zlib data of in to outv*/
+static unsigned zlib_compressv(ucvector* outv, const unsigned char* in, size_t insize,
+                               const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+
+  zlib_add_header(outv);
+
+  if(settings->parallel_for && !settings->custom_deflate && insize > DEFLATE_PIECE_SIZE)
+  {
+    /*the pieces go in the output directly, and get their adler32 computed on the threads too*/
+    unsigned ADLER32;
+    error = deflateParallel(outv, &ADLER32, in, insize, settings);
+    if(!error) lodepng_add32bitInt(outv, ADLER32);
+  }
+  else if(!settings->custom_deflate)
+  {
+    /*deflated straight after the header, without a buffer in between*/
+    size_t bp = outv->size * 8;
+    error = deflateBlocks(outv, &bp, in, 0, insize, settings, 1);
+    if(!error) lodepng_add32bitInt(outv, adler32(in, insize));
+  }
+  else
+  {
+    unsigned char* deflatedata = 0;
+    size_t deflatesize = 0;
+    error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+    if(!error)
+    {
+      if(!ucvector_resize(outv, outv->size + deflatesize)) error = 83; /*alloc fail*/
+      else if(deflatesize) memcpy(&outv->data[outv->size - deflatesize], deflatedata, deflatesize);
+    }
+    if(!error) lodepng_add32bitInt(outv, adler32(in, insize));
+    lodepng_free(deflatedata);
+  }
+
+  return error;
+}
+
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings)
+{
+  /*initially, *out must be NULL and outsize 0, if you just give some random *out
+  that's pointing to a non allocated buffer, this'll crash*/
+  ucvector outv;
+  unsigned error;
+
+  /*ucvector-controlled version of the output buffer, for dynamic array*/
+  ucvector_init_buffer(&outv, *out, *outsize);
+  error = zlib_compressv(&outv, in, insize, settings);
+
+  *out = outv.data;
+  *outsize = outv.size;
+
+  return error;
+}
+
+/* compress using the default or custom zlib function */
+static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                              size_t insize, const LodePNGCompressSettings* settings)
+{
+  if(settings->custom_zlib)
+  {
+    return settings->custom_zlib(out, outsize, in, insize, settings);
+  }
+  else
+  {
+    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+  }
+}
+
+#ifdef LODEPNG_COMPILE_PNG
+/*
+zlib compression of data that is given piece by piece, producing the same deflate blocks as
+lodepng_zlib_compress would for the whole data. The input buffer only holds the data of the block
+being gathered, preceded by up to 64K of already compressed history for the LZ77 window; the output
+buffer holds the compressed bytes until they are taken out with zlib_stream_take.
+*/
+typedef struct ZlibStream
+{
+  ucvector data; /*history followed by the data not compressed yet*/
+  size_t datapos; /*start of the data not compressed yet*/
+  size_t blocksize;
+  Hash hash;
+  ucvector out; /*compressed data, the last byte may still be incomplete*/
+  size_t bp; /*bit pointer in out*/
+  unsigned adler;
+  const LodePNGCompressSettings* settings;
+} ZlibStream;
+
+/*totalsize is the size of all data that will be given, to choose the same block size as for the whole data*/
+static unsigned zlib_stream_init(ZlibStream* stream, size_t totalsize, const LodePNGCompressSettings* settings)
+{
+  ucvector_init(&stream->data);
+  ucvector_init(&stream->out);
+  stream->datapos = 0;
+  stream->blocksize = getDynamicBlockSize(totalsize);
+  stream->adler = 1;
+  stream->settings = settings;
+  CERROR_TRY_RETURN(hash_init(&stream->hash, settings->windowsize, settings->minmatch));
+  zlib_add_header(&stream->out);
+  stream->bp = stream->out.size * 8;
+  return 0;
+}
+
+static void zlib_stream_cleanup(ZlibStream* stream)
+{
+  ucvector_cleanup(&stream->data);
+  ucvector_cleanup(&stream->out);
+  hash_cleanup(&stream->hash);
+}
+
+/*deflates the next dataend - datapos bytes of the data buffer as one block*/
+static unsigned zlib_stream_block(ZlibStream* stream, size_t dataend, unsigned final)
+{
+  unsigned error = 0;
+  const unsigned char* data = stream->data.data;
+  if(stream->settings->btype == 0)
+  {
+    error = deflateNoCompression(&stream->out, &data[stream->datapos], dataend - stream->datapos, final);
+    stream->bp = stream->out.size * 8; /*non compressed blocks always end at a byte boundary*/
+  }
+  else
+  {
+    BitWriter writer;
+    BitWriter_begin(&writer, &stream->out, stream->bp);
+    if(stream->settings->btype == 1)
+    {
+      error = deflateFixed(&writer, &stream->hash, data, stream->datapos, dataend, stream->settings, final);
+    }
+    else
+    {
+      error = deflateDynamic(&writer, &stream->hash, data, stream->datapos, dataend, stream->settings, final);
+    }
+    stream->bp = BitWriter_end(&writer);
+    if(!error) error = writer.error;
+  }
+  stream->datapos = dataend;
+  return error;
+}
+
+static unsigned zlib_stream_write(ZlibStream* stream, const unsigned char* in, size_t insize)
+{
+  size_t oldsize = stream->data.size;
+  if(!ucvector_resize(&stream->data, oldsize + insize)) return 83; /*alloc fail*/
+  memcpy(&stream->data.data[oldsize], in, insize);
+  stream->adler = update_adler32(stream->adler, in, insize);
+
+  /*only compress a block once there is more data than that, so that the last block can be the final one*/
+  while(stream->data.size - stream->datapos > stream->blocksize)
+  {
+    CERROR_TRY_RETURN(zlib_stream_block(stream, stream->datapos + stream->blocksize, 0));
+  }
+
+  /*drop history that is out of reach, keeping a multiple of 32768 so the hash positions stay valid*/
+  if(stream->datapos > 65536)
+  {
+    size_t shift = ((stream->datapos - 32768) / 32768) * 32768;
+    memmove(stream->data.data, &stream->data.data[shift], stream->data.size - shift);
+    stream->data.size -= shift;
+    stream->datapos -= shift;
+  }
+  return 0;
+}
+
+/*compresses the remaining data as final block and adds the checksum*/
+static unsigned zlib_stream_finish(ZlibStream* stream)
+{
+  CERROR_TRY_RETURN(zlib_stream_block(stream, stream->data.size, 1));
+  lodepng_add32bitInt(&stream->out, stream->adler);
+  stream->bp = stream->out.size * 8;
+  return 0;
+}
+
+/*amount of complete bytes in the output that can be taken out*/
+static size_t zlib_stream_available(const ZlibStream* stream)
+{
+  return stream->bp / 8;
+}
+
+/*removes the first amount bytes from the output, they must be complete bytes*/
+static void zlib_stream_take(ZlibStream* stream, size_t amount)
+{
+  memmove(stream->out.data, &stream->out.data[amount], stream->out.size - amount);
+  stream->out.size -= amount;
+  stream->bp -= amount * 8;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#else /*no LODEPNG_COMPILE_ZLIB*/
+
+#ifdef LODEPNG_COMPILE_DECODER
+static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
+                                const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings)
 {
+  (void)expected_size;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
+
+/*without the built in zlib, the input is collected and given to the custom zlib at the end*/
+typedef struct ZlibDecoder
+{
+  const LodePNGDecompressSettings* settings;
+  ucvector out;
+  ucvector pending;
+  unsigned (*flush)(void*, const unsigned char*, size_t);
+  void* context;
+} ZlibDecoder;
+
+static unsigned zlibDecoderInit(ZlibDecoder* decoder, const LodePNGDecompressSettings* settings,
+                                size_t expected_size,
+                                unsigned (*flush)(void*, const unsigned char*, size_t), void* context)
+{
+  (void)expected_size;
+  decoder->settings = settings;
+  ucvector_init(&decoder->out);
+  ucvector_init(&decoder->pending);
+  decoder->flush = flush;
+  decoder->context = context;
+  return 0;
+}
+
+static void zlibDecoderCleanup(ZlibDecoder* decoder)
+{
+  ucvector_cleanup(&decoder->out);
+  ucvector_cleanup(&decoder->pending);
+}
+
+static unsigned zlibDecoderWrite(ZlibDecoder* decoder, const unsigned char* data, size_t size)
+{
+  size_t oldsize = decoder->pending.size;
+  if(!ucvector_resize(&decoder->pending, oldsize + size)) return 83; /*alloc fail*/
+  if(size) memcpy(&decoder->pending.data[oldsize], data, size);
+  return 0;
+}
+
+static unsigned zlibDecoderFinish(ZlibDecoder* decoder)
+{
+  unsigned error = zlib_decompress(&decoder->out.data, &decoder->out.size, 0,
+                                   decoder->pending.data, decoder->pending.size, decoder->settings);
+  decoder->out.allocsize = decoder->out.size;
+  if(!error && decoder->flush) error = decoder->flush(decoder->context, decoder->out.data, decoder->out.size);
+  return error;
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -2279,13 +3723,96 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->strategy = LDS_DEFAULT;
+
+  settings->parallel_for = 0;
+  settings->parallel_context = 0;
+
+  settings->context = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, LDS_DEFAULT,
+                                                                   0, 0, 0, 0, 0, 0};
+
+unsigned lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  /*windowsize, minmatch, nicematch, lazymatching and maxchainlength for every level*/
+  static const unsigned LEVELS[10][5] = {
+    {8192, 4, 16, 0, 1},
+    {32768, 4, 32, 0, 4},
+    {32768, 4, 32, 0, 8},
+    {32768, 4, 64, 0, 16},
+    {32768, 4, 128, 0, 32},
+    {32768, 4, 128, 1, 32},
+    {32768, 4, 128, 1, 64},
+    {32768, 4, 258, 1, 256},
+    {32768, 4, 258, 1, 1024},
+    {32768, 3, 258, 1, 4096}
+  };
+  if(level > 9) return 99; /*invalid compression level*/
+  settings->windowsize = LEVELS[level][0];
+  settings->minmatch = LEVELS[level][1];
+  settings->nicematch = LEVELS[level][2];
+  settings->lazymatching = LEVELS[level][3];
+  settings->maxchainlength = LEVELS[level][4];
+  return 0;
+}
+
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context)
+{
+  unsigned type;
+  if(!context) return;
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(context->hash)
+  {
+    hash_cleanup(context->hash);
+    lodepng_free(context->hash);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(context->attemptsize) for(type = 0; type != 5; ++type) lodepng_free(context->attempt[type]);
+  ucvector_cleanup(&context->filtered);
+  ucvector_cleanup(&context->compressed);
+  lodepng_free(context);
+}
+
+unsigned lodepng_encoder_context_new(LodePNGEncoderContext** context)
+{
+  unsigned i, error = 0;
+  LodePNGEncoderContext* result = (LodePNGEncoderContext*)lodepng_malloc(sizeof(LodePNGEncoderContext));
+  *context = 0;
+  if(!result) return 83; /*alloc fail*/
+  result->hash = 0;
+  result->attemptsize = 0;
+  for(i = 0; i != NUM_ENCODER_EFFORTS; ++i)
+  {
+    result->effort_rate[i] = result->effort_ratio[i] = 0;
+    result->effort_encodes[i] = result->effort_last[i] = 0;
+  }
+  result->effort_scale = 0;
+  result->encodes = 0;
+  ucvector_init(&result->filtered);
+  ucvector_init(&result->compressed);
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*allocated for the biggest window, so that every windowsize can use it*/
+  result->hash = (Hash*)lodepng_malloc(sizeof(Hash));
+  if(!result->hash) error = 83; /*alloc fail*/
+  else if(hash_init(result->hash, 32768, 3))
+  {
+    hash_cleanup(result->hash);
+    lodepng_free(result->hash);
+    result->hash = 0;
+    error = 83; /*alloc fail*/
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(error) lodepng_encoder_context_delete(result);
+  else *context = result;
+  return error;
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2319,57 +3846,404 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifndef LODEPNG_NO_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*CRC polynomial: 0xedb88320. Table k holds the CRC of byte n followed by k zero bytes, so 8 bytes can be looked
+up at once (slicing-by-8). Table 0 is the usual byte at a time table.*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length)
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+/*moves x forward by the distance that k is made for and adds next: each 64-bit half of x is multiplied by the
+matching half of k, powers of x modulo the polynomial*/
+static LODEPNG_TARGET("pclmul") __m128i crc32FoldPCLMUL(__m128i x, __m128i k, __m128i next)
 {
-  unsigned r = 0xffffffffu;
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+/*
+The CRC by folding, as in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction":
+the data is folded 64 bytes at a time into four 128-bit values, those into one, then 16 bytes at a time. What's
+left is 16 bytes with the same remainder as all the data, their CRC is the CRC of the data. r is the CRC
+register (not inverted) before the data, returns it after. Uses a multiple of 16 bytes, length must be at least
+64: moves data and length past the bytes it used.
+*/
+static LODEPNG_TARGET("pclmul") unsigned crc32PCLMUL(unsigned r, const unsigned char** data, size_t* length)
+{
+  /*the constants to fold over 512 and over 128 bits, bit reflected like the CRC*/
+  const __m128i k4x = _mm_set_epi32(0x00000001, (int)0xc6e41596u, 0x00000001, 0x54442bd4);
+  const __m128i k1x = _mm_set_epi32(0x00000000, (int)0xccaa009eu, 0x00000001, 0x751997d0);
+  const unsigned char* in = *data;
+  size_t size = *length;
+  unsigned char rest[16];
+  __m128i x0, x1, x2, x3;
   size_t i;
-  for(i = 0; i < length; ++i)
-  {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+
+  x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_cvtsi32_si128((int)r));
+  x1 = _mm_loadu_si128((const __m128i*)(in + 16));
+  x2 = _mm_loadu_si128((const __m128i*)(in + 32));
+  x3 = _mm_loadu_si128((const __m128i*)(in + 48));
+  in += 64;
+  size -= 64;
+  while(size >= 64)
+  {
+    x0 = crc32FoldPCLMUL(x0, k4x, _mm_loadu_si128((const __m128i*)in));
+    x1 = crc32FoldPCLMUL(x1, k4x, _mm_loadu_si128((const __m128i*)(in + 16)));
+    x2 = crc32FoldPCLMUL(x2, k4x, _mm_loadu_si128((const __m128i*)(in + 32)));
+    x3 = crc32FoldPCLMUL(x3, k4x, _mm_loadu_si128((const __m128i*)(in + 48)));
+    in += 64;
+    size -= 64;
+  }
+  x0 = crc32FoldPCLMUL(x0, k1x, x1);
+  x0 = crc32FoldPCLMUL(x0, k1x, x2);
+  x0 = crc32FoldPCLMUL(x0, k1x, x3);
+  while(size >= 16)
+  {
+    x0 = crc32FoldPCLMUL(x0, k1x, _mm_loadu_si128((const __m128i*)in));
+    in += 16;
+    size -= 16;
+  }
+
+  _mm_storeu_si128((__m128i*)rest, x0);
+  r = 0;
+  for(i = 0; i != 16; ++i) r = lodepng_crc32_table[0][(r ^ rest[i]) & 0xff] ^ (r >> 8);
+  *data = in;
+  *length = size;
+  return r;
+}
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+
+/*Continues crc, the CRC of the bytes before, with the bytes buf[0..len-1]. Start with crc 0.*/
+static unsigned crc32_continue(unsigned crc, const unsigned char* data, size_t length)
+{
+  unsigned r = crc ^ 0xffffffffu;
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+  if(length >= 64 && (lodepng_cpu_features() & LODEPNG_CPU_PCLMUL)) r = crc32PCLMUL(r, &data, &length);
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+  while(length >= 8)
+  {
+    unsigned a = r ^ (data[0] | ((unsigned)data[1] << 8) | ((unsigned)data[2] << 16) | ((unsigned)data[3] << 24));
+    r = lodepng_crc32_table[7][a & 0xff] ^ lodepng_crc32_table[6][(a >> 8) & 0xff]
+      ^ lodepng_crc32_table[5][(a >> 16) & 0xff] ^ lodepng_crc32_table[4][a >> 24]
+      ^ lodepng_crc32_table[3][data[4]] ^ lodepng_crc32_table[2][data[5]]
+      ^ lodepng_crc32_table[1][data[6]] ^ lodepng_crc32_table[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+  for(; length > 0; --length, ++data)
+  {
+    r = lodepng_crc32_table[0][(r ^ *data) & 0xff] ^ (r >> 8);
   }
   return r ^ 0xffffffffu;
 }
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length)
+{
+  return crc32_continue(0, data, length);
+}
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
 #endif /* !LODEPNG_NO_COMPILE_CRC */
 
+/*multiplies two polynomials modulo the CRC polynomial, bit reflected like the CRC itself (bit 31 is x^0)*/
+static unsigned crc32MultModP(unsigned a, unsigned b)
+{
+  unsigned p = 0;
+  unsigned m;
+  for(m = 1u << 31; m != 0; m >>= 1)
+  {
+    if(a & m) p ^= b;
+    b = (b & 1) ? (b >> 1) ^ 0xedb88320u : b >> 1;
+  }
+  return p;
+}
+
+unsigned lodepng_crc32_combine(unsigned crc1, unsigned crc2, size_t len2)
+{
+  /*crc1 moves past len2 bytes: it's multiplied by x^(8 * len2), built from the squares of x^8*/
+  unsigned power = 1u << 23; /*x^8*/
+  unsigned shift = 1u << 31; /*x^0*/
+  for(; len2 != 0; len2 >>= 1)
+  {
+    if(len2 & 1) shift = crc32MultModP(shift, power);
+    power = crc32MultModP(power, power);
+  }
+  return crc32MultModP(shift, crc1) ^ crc2;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Reading and writing single bits and bytes from/to stream for LodePNG   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -3837,6 +5711,34 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_COMPILE_SSE2
+static __m128i abs16SSE2(__m128i x)
+{
+#ifdef __SSSE3__
+  return _mm_abs_epi16(x);
+#else /*__SSSE3__*/
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+#endif /*__SSSE3__*/
+}
+
+/*paethPredictor of 8 channels at once, a, b and c widened to 16 bits per channel*/
+static __m128i paethPredictorSSE2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = _mm_sub_epi16(b, c); /*p - a with p = a + b - c*/
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = abs16SSE2(_mm_add_epi16(pa, pb));
+  __m128i smallest, select, nearest;
+  pa = abs16SSE2(pa);
+  pb = abs16SSE2(pb);
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  /*ties go to a, then to b, the same as paethPredictor*/
+  select = _mm_cmpeq_epi16(smallest, pb);
+  nearest = _mm_or_si128(_mm_and_si128(select, b), _mm_andnot_si128(select, c));
+  select = _mm_cmpeq_epi16(smallest, pa);
+  return _mm_or_si128(_mm_and_si128(select, a), _mm_andnot_si128(select, nearest));
+}
+#endif /*LODEPNG_COMPILE_SSE2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3960,32 +5862,176 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
+#ifdef LODEPNG_COMPILE_SSE2
+/*
+SSE2 versions of the filters, for 3, 4, 6 and 8 bytes per pixel (RGB and RGBA, 8 and 16 bit). Sub, Average and
+Paeth depend on the pixel to the left so they still go pixel per pixel, but do all channels of a pixel at once
+instead of byte per byte. Up has no such dependency and goes 16 bytes at a time for any bytewidth.
+A pixel is loaded as 4 bytes (3 and 4 bytes per pixel) or 8 bytes (6 and 8), the predictor is masked to the
+real channels. Only the bytes of the pixel itself are stored: Adam7 unfilters in place with recon one byte before
+scanline, so storing more would overwrite bytes of the next pixel before they're loaded. The loops stop before
+the loads would go past the end, the rest is done per byte. They need length >= 8, so that the loop runs at
+least once.
+*/
+
+static __m128i loadPixelSSE2(const unsigned char* p, size_t bytewidth)
 {
-  /*
-  For PNG filter method 0
-  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
-  the filter works byte per byte (bytewidth = 1)
-  precon is the previous unfiltered scanline, recon the result, scanline the current one
-  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
-  recon and scanline MAY be the same memory address! precon must be disjoint.
-  */
+  int value;
+  if(bytewidth > 4) return _mm_loadl_epi64((const __m128i*)p);
+  memcpy(&value, p, 4);
+  return _mm_cvtsi32_si128(value);
+}
 
-  size_t i;
-  switch(filterType)
+/*stores exactly bytewidth bytes of the pixel*/
+static void storePixelSSE2(unsigned char* p, __m128i pixel, size_t bytewidth)
+{
+  int value;
+  if(bytewidth == 8)
   {
-    case 0:
-      for(i = 0; i != length; ++i) recon[i] = scanline[i];
-      break;
-    case 1:
-      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
-      break;
+    _mm_storel_epi64((__m128i*)p, pixel);
+    return;
+  }
+  value = _mm_cvtsi128_si32(pixel);
+  if(bytewidth == 3)
+  {
+    memcpy(p, &value, 3);
+    return;
+  }
+  memcpy(p, &value, 4);
+  if(bytewidth == 6)
+  {
+    value = _mm_cvtsi128_si32(_mm_srli_epi64(pixel, 32));
+    memcpy(p + 4, &value, 2);
+  }
+}
+
+/*all ones in the first bytewidth bytes*/
+static __m128i pixelMaskSSE2(size_t bytewidth)
+{
+  return _mm_srl_epi64(_mm_set1_epi32(-1), _mm_cvtsi32_si128((int)(64 - 8 * bytewidth)));
+}
+
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  const __m128i mask = pixelMaskSSE2(bytewidth);
+  const size_t span = bytewidth > 4 ? 8 : 4;
+  __m128i a = _mm_setzero_si128();
+  size_t i;
+  for(i = 0; i + span <= length; i += bytewidth)
+  {
+    a = _mm_add_epi8(_mm_and_si128(a, mask), loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+  for(; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+}
+
+static void unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                           size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  const __m128i mask = pixelMaskSSE2(bytewidth);
+  const __m128i one = _mm_set1_epi8(1);
+  const size_t span = bytewidth > 4 ? 8 : 4;
+  __m128i a = _mm_setzero_si128(), b, average;
+  size_t i;
+  for(i = 0; i + span <= length; i += bytewidth)
+  {
+    b = loadPixelSSE2(&precon[i], bytewidth);
+    /*_mm_avg_epu8 rounds up, the filter rounds down*/
+    average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(_mm_and_si128(average, mask), loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+  for(; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) >> 1);
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length)
+{
+  /*a, b and c as in paethPredictor, widened to 16 bits per channel*/
+  const __m128i mask = pixelMaskSSE2(bytewidth);
+  const __m128i zero = _mm_setzero_si128();
+  const size_t span = bytewidth > 4 ? 8 : 4;
+  __m128i a = zero, b, c = zero, nearest, pixel;
+  size_t i;
+  for(i = 0; i + span <= length; i += bytewidth)
+  {
+    b = _mm_unpacklo_epi8(loadPixelSSE2(&precon[i], bytewidth), zero);
+    nearest = paethPredictorSSE2(a, b, c);
+    nearest = _mm_and_si128(_mm_packus_epi16(nearest, nearest), mask);
+    pixel = _mm_add_epi8(nearest, loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], pixel, bytewidth);
+    a = _mm_unpacklo_epi8(pixel, zero);
+    c = b;
+  }
+  for(; i < length; ++i)
+  {
+    recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
+  }
+}
+#endif /*LODEPNG_COMPILE_SSE2*/
+
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  /*
+  For PNG filter method 0
+  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
+  the filter works byte per byte (bytewidth = 1)
+  precon is the previous unfiltered scanline, recon the result, scanline the current one
+  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
+  recon and scanline MAY be the same memory address! precon must be disjoint.
+  */
+
+  size_t i;
+#ifdef LODEPNG_COMPILE_SSE2
+  if((bytewidth == 3 || bytewidth == 4 || bytewidth == 6 || bytewidth == 8) && length >= 8)
+  {
+    switch(filterType)
+    {
+      case 1: unfilterSubSSE2(recon, scanline, bytewidth, length); return 0;
+      case 3:
+        if(!precon) break;
+        unfilterAverageSSE2(recon, scanline, precon, bytewidth, length);
+        return 0;
+      case 4:
+        /*without precon Paeth always picks the left pixel, which is Sub*/
+        if(precon) unfilterPaethSSE2(recon, scanline, precon, bytewidth, length);
+        else unfilterSubSSE2(recon, scanline, bytewidth, length);
+        return 0;
+      default: break; /*the other types don't depend on bytewidth*/
+    }
+  }
+#endif /*LODEPNG_COMPILE_SSE2*/
+  switch(filterType)
+  {
+    case 0:
+      for(i = 0; i != length; ++i) recon[i] = scanline[i];
+      break;
+    case 1:
+      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
+      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+      break;
     case 2:
       if(precon)
       {
+#ifdef LODEPNG_COMPILE_SSE2
+        unfilterUpSSE2(recon, scanline, precon, length);
+#else /*LODEPNG_COMPILE_SSE2*/
         for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
+#endif /*LODEPNG_COMPILE_SSE2*/
       }
       else
       {
@@ -4373,7 +6419,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecompressSetting
 
     length = chunkLength - string2_begin;
     /*will fail if zlib error, e.g. if length is too small*/
-    error = zlib_decompress(&decoded.data, &decoded.size,
+    error = zlib_decompress(&decoded.data, &decoded.size, 0,
                             (unsigned char*)(&data[string2_begin]),
                             length, zlibsettings);
     if(error) break;
@@ -4456,7 +6502,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecompressSetting
     if(compressed)
     {
       /*will fail if zlib error, e.g. if length is too small*/
-      error = zlib_decompress(&decoded.data, &decoded.size,
+      error = zlib_decompress(&decoded.data, &decoded.size, 0,
                               (unsigned char*)(&data[begin]),
                               length, zlibsettings);
       if(error) break;
@@ -4512,49 +6558,163 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*error 92 if the image is too big: the size computations on it could overflow*/
+static unsigned checkNumPixels(unsigned w, unsigned h)
 {
-  unsigned char IEND = 0;
-  const unsigned char* chunk;
-  size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
-  size_t numpixels;
-  size_t outsize = 0;
+  size_t numpixels = (size_t)w * h;
+  /*multiplication overflow*/
+  if(h != 0 && numpixels / h != w) return 92;
+  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
+  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
+  if(numpixels > 268435455) return 92;
+  return 0;
+}
 
-  /*for unknown chunk order*/
-  unsigned unknown = 0;
+/*what has to be remembered between the chunks of a PNG while reading them*/
+typedef struct ChunkState
+{
+  unsigned IEND; /*the IEND chunk was read, it's the last chunk*/
+  unsigned unknown; /*for unknown chunk order*/
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  unsigned critical_pos; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+} ChunkState;
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
+static void ChunkState_init(ChunkState* chunks)
+{
+  chunks->IEND = 0;
+  chunks->unknown = 0;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  chunks->critical_pos = 1;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+}
+
+/*reads a complete chunk into the state, the data of an IDAT chunk is given to idat. Returns error code.*/
+static unsigned decodeChunk(ChunkState* chunks, ZlibDecoder* idat, LodePNGState* state,
+                            const unsigned char* chunk, unsigned chunkLength)
+{
+  unsigned error = 0;
+  const unsigned char* data = lodepng_chunk_data_const(chunk); /*the data in the chunk*/
+
+  /*IDAT chunk, containing compressed image data*/
+  if(lodepng_chunk_type_equals(chunk, "IDAT"))
+  {
+    /*the CRC is checked first here, the data goes to the inflater right away*/
+    if(!state->decoder.ignore_crc && !chunks->unknown && lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    chunks->critical_pos = 3;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+    return zlibDecoderWrite(idat, data, chunkLength);
+  }
+  /*IEND chunk*/
+  else if(lodepng_chunk_type_equals(chunk, "IEND"))
+  {
+    chunks->IEND = 1;
+  }
+  /*restart index, only decodeImageParallel uses it. It isn't kept with the unknown chunks: it would be wrong for
+  IDAT chunks written again*/
+  else if(lodepng_chunk_type_equals(chunk, "prIX"))
+  {
+  }
+  /*palette chunk (PLTE)*/
+  else if(lodepng_chunk_type_equals(chunk, "PLTE"))
+  {
+    CERROR_TRY_RETURN(readChunk_PLTE(&state->info_png.color, data, chunkLength));
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    chunks->critical_pos = 2;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+  /*palette transparency chunk (tRNS)*/
+  else if(lodepng_chunk_type_equals(chunk, "tRNS"))
+  {
+    CERROR_TRY_RETURN(readChunk_tRNS(&state->info_png.color, data, chunkLength));
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*background color chunk (bKGD)*/
+  else if(lodepng_chunk_type_equals(chunk, "bKGD"))
+  {
+    CERROR_TRY_RETURN(readChunk_bKGD(&state->info_png, data, chunkLength));
+  }
+  /*text chunk (tEXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "tEXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      CERROR_TRY_RETURN(readChunk_tEXt(&state->info_png, data, chunkLength));
+    }
+  }
+  /*compressed text chunk (zTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "zTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      CERROR_TRY_RETURN(readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength));
+    }
+  }
+  /*international text chunk (iTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "iTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      CERROR_TRY_RETURN(readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength));
+    }
+  }
+  else if(lodepng_chunk_type_equals(chunk, "tIME"))
+  {
+    CERROR_TRY_RETURN(readChunk_tIME(&state->info_png, data, chunkLength));
+  }
+  else if(lodepng_chunk_type_equals(chunk, "pHYs"))
+  {
+    CERROR_TRY_RETURN(readChunk_pHYs(&state->info_png, data, chunkLength));
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  else /*it's not an implemented chunk type, so ignore it: skip over the data*/
+  {
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!lodepng_chunk_ancillary(chunk)) return 69;
+
+    chunks->unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks)
+    {
+      CERROR_TRY_RETURN(lodepng_chunk_append(&state->info_png.unknown_chunks_data[chunks->critical_pos - 1],
+                                             &state->info_png.unknown_chunks_size[chunks->critical_pos - 1], chunk));
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+
+  if(!state->decoder.ignore_crc && !chunks->unknown) /*check CRC if wanted, only on known chunk types*/
+  {
+    if(lodepng_chunk_check_crc(chunk)) error = 57; /*invalid CRC*/
+  }
+
+  return error;
+}
+
+/*
+reads the header and all chunks of the PNG into the state. The data of the IDAT chunks is given to idat while
+the chunks are read, the first IDAT chunk is inflated before the next one is looked at.
+*/
+static void decodeChunks(ZlibDecoder* idat, unsigned* w, unsigned* h,
+                         LodePNGState* state,
+                         const unsigned char* in, size_t insize)
+{
+  const unsigned char* chunk;
+  ChunkState chunks;
 
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  numpixels = *w * *h;
-
-  /*multiplication overflow*/
-  if(*h != 0 && numpixels / *h != *w) CERROR_RETURN(state->error, 92);
-  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
-  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
-  if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
+  state->error = checkNumPixels(*w, *h);
+  if(state->error) return;
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
+  ChunkState_init(&chunks);
 
-  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
-  while(!IEND && !state->error)
+  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk*/
+  while(!chunks.IEND && !state->error)
   {
     unsigned chunkLength;
-    const unsigned char* data; /*the data in the chunk*/
 
     /*error: size of the in buffer too small to contain next chunk*/
     if((size_t)((chunk - in) + 12) > insize || chunk < in) CERROR_BREAK(state->error, 30);
@@ -4569,136 +6729,61 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       CERROR_BREAK(state->error, 64); /*error: size of the in buffer too small to contain next chunk*/
     }
 
-    data = lodepng_chunk_data_const(chunk);
-
-    /*IDAT chunk, containing compressed image data*/
-    if(lodepng_chunk_type_equals(chunk, "IDAT"))
-    {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-    /*IEND chunk*/
-    else if(lodepng_chunk_type_equals(chunk, "IEND"))
-    {
-      IEND = 1;
-    }
-    /*palette chunk (PLTE)*/
-    else if(lodepng_chunk_type_equals(chunk, "PLTE"))
-    {
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-    /*palette transparency chunk (tRNS)*/
-    else if(lodepng_chunk_type_equals(chunk, "tRNS"))
-    {
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*background color chunk (bKGD)*/
-    else if(lodepng_chunk_type_equals(chunk, "bKGD"))
-    {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-    /*text chunk (tEXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "tEXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    /*compressed text chunk (zTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "zTXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    /*international text chunk (iTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "iTXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    else if(lodepng_chunk_type_equals(chunk, "tIME"))
-    {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-    else if(lodepng_chunk_type_equals(chunk, "pHYs"))
-    {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    else /*it's not an implemented chunk type, so ignore it: skip over the data*/
-    {
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!lodepng_chunk_ancillary(chunk)) CERROR_BREAK(state->error, 69);
-
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks)
-      {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
-      }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-
-    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/
-    {
-      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
-    }
+    state->error = decodeChunk(&chunks, idat, state, chunk, chunkLength);
 
-    if(!IEND) chunk = lodepng_chunk_next_const(chunk);
+    if(!chunks.IEND) chunk = lodepng_chunk_next_const(chunk);
   }
+}
 
-  ucvector_init(&scanlines);
-  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
-  If the decompressed size does not match the prediction, the image must be corrupt.*/
-  if(state->info_png.interlace_method == 0)
+/*the size of the inflated IDAT data: the filtered scanlines, of all Adam7 passes if interlaced*/
+static size_t getIdatSize(unsigned w, unsigned h, const LodePNGInfo* info)
+{
+  const LodePNGColorMode* color = &info->color;
+  size_t size = 0;
+  if(info->interlace_method == 0)
   {
-    /*The extra *h is added because this are the filter bytes every scanline starts with*/
-    predict = lodepng_get_raw_size_idat(*w, *h, &state->info_png.color) + *h;
+    /*The extra h is added because this are the filter bytes every scanline starts with*/
+    size = lodepng_get_raw_size_idat(w, h, color) + h;
   }
   else
   {
-    /*Adam-7 interlaced: predicted size is the sum of the 7 sub-images sizes*/
-    const LodePNGColorMode* color = &state->info_png.color;
-    predict = 0;
-    predict += lodepng_get_raw_size_idat((*w + 7) >> 3, (*h + 7) >> 3, color) + ((*h + 7) >> 3);
-    if(*w > 4) predict += lodepng_get_raw_size_idat((*w + 3) >> 3, (*h + 7) >> 3, color) + ((*h + 7) >> 3);
-    predict += lodepng_get_raw_size_idat((*w + 3) >> 2, (*h + 3) >> 3, color) + ((*h + 3) >> 3);
-    if(*w > 2) predict += lodepng_get_raw_size_idat((*w + 1) >> 2, (*h + 3) >> 2, color) + ((*h + 3) >> 2);
-    predict += lodepng_get_raw_size_idat((*w + 1) >> 1, (*h + 1) >> 2, color) + ((*h + 1) >> 2);
-    if(*w > 1) predict += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, color) + ((*h + 1) >> 1);
-    predict += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, color) + ((*h + 0) >> 1);
-  }
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
-  if(!state->error)
+    /*Adam-7 interlaced: the size is the sum of the 7 sub-images sizes*/
+    size += lodepng_get_raw_size_idat((w + 7) >> 3, (h + 7) >> 3, color) + ((h + 7) >> 3);
+    if(w > 4) size += lodepng_get_raw_size_idat((w + 3) >> 3, (h + 7) >> 3, color) + ((h + 7) >> 3);
+    size += lodepng_get_raw_size_idat((w + 3) >> 2, (h + 3) >> 3, color) + ((h + 3) >> 3);
+    if(w > 2) size += lodepng_get_raw_size_idat((w + 1) >> 2, (h + 3) >> 2, color) + ((h + 3) >> 2);
+    size += lodepng_get_raw_size_idat((w + 1) >> 1, (h + 1) >> 2, color) + ((h + 1) >> 2);
+    if(w > 1) size += lodepng_get_raw_size_idat((w + 0) >> 1, (h + 1) >> 1, color) + ((h + 1) >> 1);
+    size += lodepng_get_raw_size_idat((w + 0), (h + 0) >> 1, color) + ((h + 0) >> 1);
+  }
+  return size;
+}
+
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  size_t i;
+  ZlibDecoder idat; /*inflates the data from idat chunks*/
+  size_t predict = 0;
+  size_t outsize = 0;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
+  If the decompressed size does not match the prediction, the image must be corrupt.
+  The header is read here already for that, decodeChunks gives the errors about it.*/
+  if(!lodepng_inspect(w, h, state, in, insize) && !checkNumPixels(*w, *h))
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
-    if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
+    predict = getIdatSize(*w, *h, &state->info_png);
   }
-  ucvector_cleanup(&idat);
+  state->error = zlibDecoderInit(&idat, &state->decoder.zlibsettings, predict, 0, 0);
+  if(!state->error) decodeChunks(&idat, w, h, state, in, insize);
+  if(!state->error) state->error = zlibDecoderFinish(&idat);
+  /*decompressed size doesn't match prediction*/
+  if(!state->error && idat.out.size != predict) state->error = 91;
 
   if(!state->error)
   {
@@ -4709,16 +6794,37 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   if(!state->error)
   {
     for(i = 0; i < outsize; i++) (*out)[i] = 0;
-    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
+    state->error = postProcessScanlines(*out, idat.out.data, *w, *h, &state->info_png);
   }
-  ucvector_cleanup(&scanlines);
+  zlibDecoderCleanup(&idat);
 }
 
+static unsigned decodeImageRows(unsigned char** out, unsigned* w, unsigned* h,
+                                LodePNGState* state,
+                                const unsigned char* in, size_t insize);
+#ifdef LODEPNG_COMPILE_ZLIB
+static unsigned decodeImageParallel(unsigned char** out, unsigned* w, unsigned* h,
+                                    LodePNGState* state,
+                                    const unsigned char* in, size_t insize);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize)
 {
   *out = 0;
+  /*without interlacing, the scanlines can be unfiltered and converted one by one while inflating*/
+  state->error = lodepng_inspect(w, h, state, in, insize);
+  if(state->error) return state->error;
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(state->info_png.interlace_method == 0 && state->decoder.parallel_for
+     && !decodeImageParallel(out, w, h, state, in, insize))
+  {
+    return state->error;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(state->info_png.interlace_method == 0) return decodeImageRows(out, w, h, state, in, insize);
+
   decodeGeneric(out, w, h, state, in, insize);
   if(state->error) return state->error;
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
@@ -4759,43 +6865,900 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
-unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
-                               size_t insize, LodePNGColorType colortype, unsigned bitdepth)
+/*
+converts a scanline of w pixels of an 8-bit PNG to 8-bit RGB or RGBA, for the common conversions without color key,
+faster than lodepng_convert which looks at the color mode for every pixel. palette is the PLTE as RGBA for all 256
+indices, with black for the ones beyond its end.
+*/
+typedef void (*RowExpander)(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette);
+
+static void expandRGBToRGBA(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
 {
-  unsigned error;
-  LodePNGState state;
-  lodepng_state_init(&state);
-  state.info_raw.colortype = colortype;
-  state.info_raw.bitdepth = bitdepth;
-  error = lodepng_decode(out, w, h, &state, in, insize);
-  lodepng_state_cleanup(&state);
-  return error;
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 4, in += 3)
+  {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = 255;
+  }
 }
 
-unsigned lodepng_decode32(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+/*4 pixels at a time with pshufb, as long as there are 16 bytes to load*/
+static LODEPNG_TARGET("ssse3") void expandRGBToRGBASSSE3(unsigned char* out, const unsigned char* in, size_t w,
+                                                         const unsigned char* palette)
 {
-  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGBA, 8);
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+  size_t i = 0;
+  for(; i + 6 <= w; i += 4, out += 16, in += 12)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)in);
+    _mm_storeu_si128((__m128i*)out, _mm_or_si128(_mm_shuffle_epi8(x, shuffle), alpha));
+  }
+  expandRGBToRGBA(out, in, w - i, palette);
 }
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
 
-unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+static void expandRGBAToRGB(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
 {
-  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 3, in += 4)
+  {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+  }
 }
 
-#ifdef LODEPNG_COMPILE_DISK
-unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
-                             LodePNGColorType colortype, unsigned bitdepth)
+static void expandGreyToRGBA(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
 {
-  unsigned char* buffer = 0;
-  size_t buffersize;
-  unsigned error;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
-  if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
-  return error;
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 4)
+  {
+    out[0] = out[1] = out[2] = in[i];
+    out[3] = 255;
+  }
 }
 
-unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
+static void expandGreyToRGB(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
+{
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 3) out[0] = out[1] = out[2] = in[i];
+}
+
+static void expandGreyAlphaToRGBA(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
+{
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 4, in += 2)
+  {
+    out[0] = out[1] = out[2] = in[0];
+    out[3] = in[1];
+  }
+}
+
+static void expandGreyAlphaToRGB(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
+{
+  size_t i;
+  (void)palette;
+  for(i = 0; i != w; ++i, out += 3, in += 2) out[0] = out[1] = out[2] = in[0];
+}
+
+static void expandPaletteToRGBA(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
+{
+  size_t i;
+  for(i = 0; i != w; ++i, out += 4) memcpy(out, &palette[in[i] * 4], 4);
+}
+
+static void expandPaletteToRGB(unsigned char* out, const unsigned char* in, size_t w, const unsigned char* palette)
+{
+  size_t i;
+  for(i = 0; i != w; ++i, out += 3)
+  {
+    const unsigned char* color = &palette[in[i] * 4];
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+  }
+}
+
+/*the RowExpander for the conversion from mode_in to mode_out, or NULL if lodepng_convert must do it*/
+static RowExpander chooseRowExpander(const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in)
+{
+  unsigned alpha = mode_out->colortype == LCT_RGBA;
+  if(mode_out->bitdepth != 8 || mode_in->bitdepth != 8) return 0;
+  if(!alpha && mode_out->colortype != LCT_RGB) return 0;
+  /*with a color key the alpha of every pixel depends on its color*/
+  if(alpha && mode_in->key_defined) return 0;
+  switch(mode_in->colortype)
+  {
+    case LCT_RGB:
+      if(!alpha) return 0;
+#ifdef LODEPNG_COMPILE_CPU_DISPATCH
+      if(lodepng_cpu_features() & LODEPNG_CPU_SSSE3) return expandRGBToRGBASSSE3;
+#endif /*LODEPNG_COMPILE_CPU_DISPATCH*/
+      return expandRGBToRGBA;
+    case LCT_RGBA: return alpha ? 0 : expandRGBAToRGB;
+    case LCT_GREY: return alpha ? expandGreyToRGBA : expandGreyToRGB;
+    case LCT_GREY_ALPHA: return alpha ? expandGreyAlphaToRGBA : expandGreyAlphaToRGB;
+    case LCT_PALETTE: return alpha ? expandPaletteToRGBA : expandPaletteToRGB;
+    default: return 0;
+  }
+}
+
+/*receives the inflated IDAT data of a non-interlaced image and reconstructs it scanline by scanline*/
+typedef struct RowDecoder
+{
+  const LodePNGState* state;
+  unsigned w, h;
+  unsigned y; /*the next scanline to reconstruct*/
+  unsigned top; /*the first scanline this decoder gets, the ones above it aren't there*/
+  size_t linebits; /*bits per scanline, without filter type byte and padding*/
+  size_t linebytes; /*bytes per scanline, without filter type byte*/
+  size_t bytewidth;
+  size_t fill; /*amount of bytes of the current filtered scanline received so far*/
+  unsigned char* scanline; /*the current filtered scanline, including filter type byte*/
+  unsigned char* lines[2]; /*the current and the previous unfiltered scanline, alternating*/
+  unsigned convert; /*info_raw isn't the color type of the PNG*/
+  RowExpander expand; /*does the conversion instead of lodepng_convert, or NULL*/
+  unsigned char palette[1024]; /*the palette for expand*/
+  unsigned char* converted; /*scanline converted to info_raw for the callback, or NULL if it isn't needed*/
+  size_t convertedbytes; /*bytes per scanline converted to info_raw*/
+  unsigned char* image; /*if not NULL, the rows are put in here as in the output of lodepng_decode*/
+  LodePNGRowCallback callback; /*used if there's no image*/
+  void* context;
+} RowDecoder;
+
+/*
+unfilters the filtered scanline in, and gives it (color converted if needed) to the callback or puts it in the
+image. A byte aligned scanline without conversion is unfiltered in the image directly, with the line above it
+there as previous line, and a converted one is converted straight into its row of the image.
+*/
+static unsigned rowDecoderEmit(RowDecoder* decoder, const unsigned char* in)
+{
+  unsigned char* recon = decoder->lines[decoder->y & 1];
+  const unsigned char* prevline = decoder->y == decoder->top ? 0 : decoder->lines[(decoder->y + 1) & 1];
+  unsigned char* image = decoder->image;
+  unsigned inplace = image && !decoder->convert && decoder->linebits == decoder->linebytes * 8;
+  if(decoder->y >= decoder->h) return 91; /*decompressed size doesn't match prediction*/
+  /*a restart segment must start with a scanline that doesn't use the one above it*/
+  if(decoder->y == decoder->top && decoder->top != 0 && in[0] > 1) return 98;
+
+  if(inplace)
+  {
+    recon = &image[decoder->y * decoder->linebytes];
+    prevline = decoder->y == decoder->top ? 0 : recon - decoder->linebytes;
+  }
+  CERROR_TRY_RETURN(unfilterScanline(recon, &in[1], prevline, decoder->bytewidth, in[0], decoder->linebytes));
+  if(decoder->convert)
+  {
+    unsigned char* target = image ? &image[decoder->y * decoder->convertedbytes] : decoder->converted;
+    if(decoder->expand) decoder->expand(target, recon, decoder->w, decoder->palette);
+    else CERROR_TRY_RETURN(lodepng_convert(target, recon, &decoder->state->info_raw,
+                                           &decoder->state->info_png.color, decoder->w, 1));
+    recon = target;
+  }
+  else if(image && !inplace)
+  {
+    /*remove the padding bits at the end of the scanline, the rows in the image aren't byte aligned*/
+    size_t ibp = 0, obp = decoder->y * decoder->linebits, x;
+    for(x = 0; x != decoder->linebits; ++x) setBitOfReversedStream(&obp, image, readBitFromReversedStream(&ibp, recon));
+  }
+  if(!image) CERROR_TRY_RETURN(decoder->callback(decoder->context, recon, decoder->y));
+  ++decoder->y;
+  return 0;
+}
+
+/*flush function for the ZlibDecoder: the data can end anywhere in a scanline*/
+static unsigned rowDecoderFlush(void* context, const unsigned char* data, size_t size)
+{
+  RowDecoder* decoder = (RowDecoder*)context;
+  size_t rowsize = decoder->linebytes + 1;
+  while(size > 0)
+  {
+    if(decoder->fill == 0 && size >= rowsize)
+    {
+      /*complete scanline available, no need to copy it first*/
+      CERROR_TRY_RETURN(rowDecoderEmit(decoder, data));
+      data += rowsize;
+      size -= rowsize;
+    }
+    else
+    {
+      size_t amount = rowsize - decoder->fill;
+      if(amount > size) amount = size;
+      memcpy(&decoder->scanline[decoder->fill], data, amount);
+      decoder->fill += amount;
+      data += amount;
+      size -= amount;
+      if(decoder->fill == rowsize)
+      {
+        CERROR_TRY_RETURN(rowDecoderEmit(decoder, decoder->scanline));
+        decoder->fill = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/*Adam7 can't be reconstructed row by row: decode the full image and give it to the callback afterwards*/
+static unsigned decodeRowsInterlaced(unsigned* w, unsigned* h, LodePNGState* state,
+                                     const unsigned char* in, size_t insize,
+                                     LodePNGRowCallback callback, void* context)
+{
+  unsigned char* image = 0;
+  unsigned char* row = 0;
+  unsigned error, y;
+  size_t bpp, linebits, linebytes;
+
+  error = lodepng_decode(&image, w, h, state, in, insize);
+  bpp = lodepng_get_bpp(&state->info_raw);
+  linebits = *w * bpp;
+  linebytes = (linebits + 7) / 8;
+  if(!error && linebits != linebytes * 8)
+  {
+    /*rows don't end at a byte boundary in the image, but they do for the callback*/
+    row = (unsigned char*)lodepng_malloc(linebytes);
+    if(!row) error = 83; /*alloc fail*/
+  }
+  for(y = 0; !error && y < *h; ++y)
+  {
+    if(row)
+    {
+      size_t ibp = y * linebits, obp = 0, x;
+      for(x = 0; x != linebits; ++x) setBitOfReversedStream(&obp, row, readBitFromReversedStream(&ibp, image));
+      for(; x != linebytes * 8; ++x) setBitOfReversedStream(&obp, row, 0);
+      error = callback(context, row, y);
+    }
+    else error = callback(context, &image[y * linebytes], y);
+  }
+  lodepng_free(row);
+  lodepng_free(image);
+  return error;
+}
+
+/*what a LodePNGRowDecoder is receiving*/
+#define ROWS_HEADER 0 /*the signature and IHDR chunk*/
+#define ROWS_CHUNK 1 /*a chunk, which is collected in full before reading it*/
+#define ROWS_IDAT 2 /*the data of an IDAT chunk, which goes to the inflater as it arrives*/
+#define ROWS_IDAT_CRC 3 /*the CRC of an IDAT chunk*/
+#define ROWS_INTERLACED 4 /*the rest of an interlaced PNG, which is decoded when all of it is there*/
+#define ROWS_END 5 /*what comes after the IEND chunk, which is ignored*/
+
+struct LodePNGRowDecoder
+{
+  LodePNGState* state;
+  unsigned w, h;
+  unsigned mode; /*one of the ROWS_ values above*/
+  ucvector buffer; /*the header or chunk being received, or the whole PNG if it's interlaced*/
+  ChunkState chunks;
+  unsigned started; /*the image data has started, rows is set up*/
+  RowDecoder rows;
+  ZlibDecoder idat;
+  size_t idat_left; /*bytes of the data of the current IDAT chunk that didn't arrive yet*/
+  unsigned idat_crc; /*CRC of the current IDAT chunk so far*/
+};
+
+static void RowDecoder_init(RowDecoder* rows, const LodePNGState* state,
+                            LodePNGRowCallback callback, void* context)
+{
+  rows->state = state;
+  rows->w = rows->h = 0;
+  rows->y = rows->top = 0;
+  rows->fill = 0;
+  rows->scanline = 0;
+  rows->lines[0] = rows->lines[1] = 0;
+  rows->convert = 0;
+  rows->expand = 0;
+  rows->converted = 0;
+  rows->convertedbytes = 0;
+  rows->image = 0;
+  rows->callback = callback;
+  rows->context = context;
+}
+
+static void RowDecoder_cleanup(RowDecoder* rows)
+{
+  lodepng_free(rows->scanline);
+  lodepng_free(rows->lines[0]);
+  lodepng_free(rows->lines[1]);
+  lodepng_free(rows->converted);
+}
+
+/*
+allocates the buffers of the row reconstruction for rows->w, and sets up the color conversion if info_raw isn't the
+color type of the PNG. rows->image must be set before. It only reads the state, so decodeImageParallel can do this
+on several threads.
+*/
+static unsigned rowDecoderSetup(RowDecoder* rows)
+{
+  const LodePNGState* state = rows->state;
+  const LodePNGColorMode* color = &state->info_png.color;
+  unsigned bpp = lodepng_get_bpp(color);
+
+  rows->linebits = rows->w * (size_t)bpp;
+  rows->linebytes = (rows->w * (size_t)bpp + 7) / 8;
+  rows->bytewidth = (bpp + 7) / 8;
+
+  if(!lodepng_color_mode_equal(&state->info_raw, color))
+  {
+    size_t size = (rows->w * (size_t)lodepng_get_bpp(&state->info_raw) + 7) / 8;
+    /*same restriction as lodepng_decode*/
+    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8))
+    {
+      return 56; /*unsupported color mode conversion*/
+    }
+    rows->convert = 1;
+    rows->convertedbytes = size;
+    rows->expand = chooseRowExpander(&state->info_raw, color);
+    if(rows->expand == expandPaletteToRGBA || rows->expand == expandPaletteToRGB)
+    {
+      size_t i;
+      for(i = 0; i != 256; ++i)
+      {
+        if(i < color->palettesize) memcpy(&rows->palette[i * 4], &color->palette[i * 4], 4);
+        else
+        {
+          rows->palette[i * 4 + 0] = rows->palette[i * 4 + 1] = rows->palette[i * 4 + 2] = 0;
+          rows->palette[i * 4 + 3] = 255;
+        }
+      }
+    }
+    /*with an image the rows are converted into it, only the callback needs a buffer*/
+    if(!rows->image)
+    {
+      rows->converted = (unsigned char*)lodepng_malloc(size);
+      if(!rows->converted) return 83; /*alloc fail*/
+      /*lodepng_convert leaves the padding bits at the end alone*/
+      memset(rows->converted, 0, size);
+    }
+  }
+
+  rows->scanline = (unsigned char*)lodepng_malloc(rows->linebytes + 1);
+  rows->lines[0] = (unsigned char*)lodepng_malloc(rows->linebytes + 1);
+  rows->lines[1] = (unsigned char*)lodepng_malloc(rows->linebytes + 1);
+  if(!rows->scanline || !rows->lines[0] || !rows->lines[1]) return 83; /*alloc fail*/
+  return 0;
+}
+
+/*
+sets up the inflater and the row reconstruction. Called at the first IDAT chunk: the PNG must have had
+its PLTE and tRNS chunks before it, so the color conversion is known then.
+*/
+static unsigned rowDecoderStart(LodePNGRowDecoder* decoder)
+{
+  LodePNGState* state = decoder->state;
+  decoder->started = 1;
+  if(!state->decoder.color_convert)
+  {
+    CERROR_TRY_RETURN(lodepng_color_mode_copy(&state->info_raw, &state->info_png.color));
+  }
+  return rowDecoderSetup(&decoder->rows);
+}
+
+unsigned lodepng_row_decoder_begin(LodePNGRowDecoder** decoder, LodePNGState* state,
+                                   LodePNGRowCallback callback, void* context)
+{
+  LodePNGRowDecoder* d = (LodePNGRowDecoder*)lodepng_malloc(sizeof(LodePNGRowDecoder));
+  *decoder = d;
+  if(!d) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+
+  d->state = state;
+  d->w = d->h = 0;
+  d->mode = ROWS_HEADER;
+  ucvector_init(&d->buffer);
+  ChunkState_init(&d->chunks);
+  d->started = 0;
+  RowDecoder_init(&d->rows, state, callback, context);
+  d->idat_left = 0;
+  d->idat_crc = 0;
+
+  state->error = zlibDecoderInit(&d->idat, &state->decoder.zlibsettings, 0, rowDecoderFlush, &d->rows);
+  return state->error;
+}
+
+/*moves up to size bytes of data into the buffer until it has total bytes, returns how many*/
+static size_t rowDecoderCollect(LodePNGRowDecoder* decoder, const unsigned char* data, size_t size,
+                                size_t total, unsigned* error)
+{
+  size_t oldsize = decoder->buffer.size;
+  size_t amount = total - oldsize < size ? total - oldsize : size;
+  if(!ucvector_resize(&decoder->buffer, oldsize + amount))
+  {
+    *error = 83; /*alloc fail*/
+    return 0;
+  }
+  if(amount) memcpy(&decoder->buffer.data[oldsize], data, amount);
+  return amount;
+}
+
+/*receives the next size bytes of the PNG, the state machine of the chunk reading. Returns error code.*/
+static unsigned rowDecoderReceive(LodePNGRowDecoder* decoder, const unsigned char* data, size_t size)
+{
+  LodePNGState* state = decoder->state;
+  unsigned error = 0;
+  while(!error && size > 0)
+  {
+    size_t amount = size;
+    if(decoder->mode == ROWS_HEADER)
+    {
+      amount = rowDecoderCollect(decoder, data, size, 33, &error);
+      if(!error && decoder->buffer.size == 33)
+      {
+        error = lodepng_inspect(&decoder->w, &decoder->h, state, decoder->buffer.data, 33);
+        if(!error) error = checkNumPixels(decoder->w, decoder->h);
+        decoder->rows.w = decoder->w;
+        decoder->rows.h = decoder->h;
+        /*Adam7 can't be reconstructed row by row: keep the whole PNG*/
+        if(!error && state->info_png.interlace_method != 0) decoder->mode = ROWS_INTERLACED;
+        else
+        {
+          decoder->buffer.size = 0;
+          decoder->mode = ROWS_CHUNK;
+        }
+      }
+    }
+    else if(decoder->mode == ROWS_INTERLACED)
+    {
+      amount = rowDecoderCollect(decoder, data, size, decoder->buffer.size + size, &error);
+    }
+    else if(decoder->mode == ROWS_CHUNK)
+    {
+      /*first the length and type, then the rest of the chunk*/
+      size_t total = 8;
+      if(decoder->buffer.size >= 8)
+      {
+        total = (size_t)lodepng_chunk_length(decoder->buffer.data) + 12;
+      }
+      amount = rowDecoderCollect(decoder, data, size, total, &error);
+      if(error) break;
+      if(decoder->buffer.size == 8 && total == 8)
+      {
+        const unsigned char* chunk = decoder->buffer.data;
+        /*error: chunk length larger than the max PNG chunk size*/
+        if(lodepng_chunk_length(chunk) > 2147483647) error = 63;
+        else if(lodepng_chunk_type_equals(chunk, "IDAT"))
+        {
+          if(!decoder->started) error = rowDecoderStart(decoder);
+#ifndef LODEPNG_NO_COMPILE_CRC
+          /*pass the data on as it arrives, instead of collecting the chunk, and check the CRC afterwards*/
+          decoder->idat_left = lodepng_chunk_length(chunk);
+          decoder->idat_crc = crc32_continue(0, &chunk[4], 4);
+          decoder->mode = ROWS_IDAT;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+          decoder->chunks.critical_pos = 3;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+#endif /*LODEPNG_NO_COMPILE_CRC*/
+        }
+      }
+      else if(decoder->buffer.size == total)
+      {
+        error = decodeChunk(&decoder->chunks, &decoder->idat, state,
+                            decoder->buffer.data, lodepng_chunk_length(decoder->buffer.data));
+        decoder->buffer.size = 0;
+        if(decoder->chunks.IEND) decoder->mode = ROWS_END;
+      }
+    }
+    else if(decoder->mode == ROWS_IDAT)
+    {
+      if(amount > decoder->idat_left) amount = decoder->idat_left;
+#ifndef LODEPNG_NO_COMPILE_CRC
+      if(!state->decoder.ignore_crc) decoder->idat_crc = crc32_continue(decoder->idat_crc, data, amount);
+#endif /*LODEPNG_NO_COMPILE_CRC*/
+      error = zlibDecoderWrite(&decoder->idat, data, amount);
+      decoder->idat_left -= amount;
+      if(decoder->idat_left == 0)
+      {
+        decoder->buffer.size = 0;
+        decoder->mode = ROWS_IDAT_CRC;
+      }
+    }
+    else if(decoder->mode == ROWS_IDAT_CRC)
+    {
+      amount = rowDecoderCollect(decoder, data, size, 4, &error);
+      if(!error && decoder->buffer.size == 4)
+      {
+        /*check CRC if wanted, only on known chunk types*/
+        if(!state->decoder.ignore_crc && !decoder->chunks.unknown
+           && lodepng_read32bitInt(decoder->buffer.data) != decoder->idat_crc) error = 57; /*invalid CRC*/
+        decoder->buffer.size = 0;
+        decoder->mode = ROWS_CHUNK;
+      }
+    }
+    /*else ROWS_END: ignore the rest*/
+
+    data += amount;
+    size -= amount;
+  }
+  return error;
+}
+
+unsigned lodepng_row_decoder_write(LodePNGRowDecoder* decoder, const unsigned char* data, size_t size)
+{
+  LodePNGState* state = decoder->state;
+  if(!state->error) state->error = rowDecoderReceive(decoder, data, size);
+  return state->error;
+}
+
+unsigned lodepng_row_decoder_finish(LodePNGRowDecoder* decoder, unsigned* w, unsigned* h)
+{
+  LodePNGState* state = decoder->state;
+
+  if(state->error) {} /*keep the first error*/
+  else if(decoder->mode == ROWS_HEADER)
+  {
+    /*gives the error about the too short or empty data*/
+    state->error = lodepng_inspect(&decoder->w, &decoder->h, state, decoder->buffer.data, decoder->buffer.size);
+  }
+  else if(decoder->mode == ROWS_INTERLACED)
+  {
+    state->error = decodeRowsInterlaced(&decoder->w, &decoder->h, state, decoder->buffer.data,
+                                        decoder->buffer.size, decoder->rows.callback, decoder->rows.context);
+  }
+  else if(decoder->mode != ROWS_END)
+  {
+    /*error: the data ends in a chunk (64), or before the IEND chunk (30)*/
+    state->error = decoder->mode == ROWS_CHUNK && decoder->buffer.size < 8 ? 30 : 64;
+  }
+  else
+  {
+    /*without IDAT chunks, the inflater gives the error about it*/
+    if(!decoder->started) state->error = rowDecoderStart(decoder);
+    if(!state->error) state->error = zlibDecoderFinish(&decoder->idat);
+    /*decompressed size doesn't match prediction*/
+    if(!state->error && (decoder->rows.y != decoder->rows.h || decoder->rows.fill != 0)) state->error = 91;
+  }
+
+  *w = decoder->w;
+  *h = decoder->h;
+  zlibDecoderCleanup(&decoder->idat);
+  ucvector_cleanup(&decoder->buffer);
+  RowDecoder_cleanup(&decoder->rows);
+  lodepng_free(decoder);
+  return state->error;
+}
+
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             LodePNGRowCallback callback, void* context)
+{
+  LodePNGRowDecoder* decoder;
+
+  /*the interlaced image can be decoded from in directly, without collecting it first*/
+  state->error = lodepng_inspect(w, h, state, in, insize);
+  if(state->error) return state->error;
+  if(state->info_png.interlace_method != 0)
+  {
+    state->error = decodeRowsInterlaced(w, h, state, in, insize, callback, context);
+    return state->error;
+  }
+
+  lodepng_row_decoder_begin(&decoder, state, callback, context);
+  if(!decoder) return state->error;
+  lodepng_row_decoder_write(decoder, in, insize);
+  return lodepng_row_decoder_finish(decoder, w, h);
+}
+
+/*
+lodepng_decode for non-interlaced images, lodepng_inspect must have been done already. Instead of inflating
+the whole image, then unfiltering all of it, then converting all of it, every scanline is unfiltered and
+converted to the output as soon as it's inflated, while it and the line above it are still in the cache.
+*/
+static unsigned decodeImageRows(unsigned char** out, unsigned* w, unsigned* h,
+                                LodePNGState* state,
+                                const unsigned char* in, size_t insize)
+{
+  LodePNGRowDecoder* decoder;
+  unsigned char* image;
+  /*the same choice of output color type as rowDecoderStart makes*/
+  const LodePNGColorMode* color = state->decoder.color_convert ? &state->info_raw : &state->info_png.color;
+  size_t size;
+
+  CERROR_TRY_RETURN(checkNumPixels(*w, *h));
+  size = lodepng_get_raw_size(*w, *h, color);
+  image = (unsigned char*)lodepng_malloc(size);
+  if(!image) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  /*rows that don't end at a byte boundary are put in bit by bit, the padding bits at the end must be 0*/
+  if(lodepng_get_bpp(color) < 8) memset(image, 0, size);
+
+  lodepng_row_decoder_begin(&decoder, state, 0, 0);
+  if(decoder)
+  {
+    decoder->rows.image = image;
+    lodepng_row_decoder_write(decoder, in, insize);
+    lodepng_row_decoder_finish(decoder, w, h);
+  }
+  if(state->error) lodepng_free(image);
+  else *out = image;
+  return state->error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+The restart index chunk prIX, written with restart_rows: the amount of scanlines per segment, then for every
+segment but the first the position of its first byte in the zlib data (the data of all IDAT chunks together), all
+as 4-byte big endian values. Every segment starts a new deflate block with an empty window, with a scanline with
+filter type None or Sub, and all but the last end with an empty stored block, so every segment can be inflated
+and unfiltered on its own.
+*/
+
+/*finds the prIX chunk, returns NULL if there is none*/
+static const unsigned char* findRestartIndex(const unsigned char* in, size_t insize)
+{
+  const unsigned char* chunk = &in[33]; /*first byte of the first chunk after the header*/
+  while((size_t)(chunk - in) + 12 <= insize)
+  {
+    unsigned chunkLength = lodepng_chunk_length(chunk);
+    if(chunkLength > insize - (size_t)(chunk - in) - 12) break;
+    if(lodepng_chunk_type_equals(chunk, "prIX")) return chunk;
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+  return 0;
+}
+
+/*bytes of a chunk per task of checkChunkCrcs*/
+#define CRC_PIECE_SIZE 262144
+
+/*a piece of a chunk for checkChunkCrcs*/
+typedef struct CrcPiece
+{
+  const unsigned char* data;
+  size_t size;
+  unsigned crc;
+} CrcPiece;
+
+static void crcPieceTask(void* data, size_t index)
+{
+  CrcPiece* piece = &((CrcPiece*)data)[index];
+  piece->crc = lodepng_crc32(piece->data, piece->size);
+}
+
+/*
+checks the CRC of all chunks with parallel_for, large chunks in pieces of CRC_PIECE_SIZE whose CRCs are put
+together with lodepng_crc32_combine. The chunks must have been read by decodeChunks already, so they're all
+there up to IEND. Returns error code.
+*/
+static unsigned checkChunkCrcs(const LodePNGState* state, const unsigned char* in)
+{
+  const unsigned char* chunk;
+  CrcPiece* pieces;
+  size_t i = 0, count = 0;
+  unsigned error = 0;
+
+  /*the CRC is over the type and the data*/
+  for(chunk = &in[8]; ; chunk = lodepng_chunk_next_const(chunk))
+  {
+    count += (lodepng_chunk_length(chunk) + 4 + CRC_PIECE_SIZE - 1) / CRC_PIECE_SIZE;
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+  }
+  pieces = (CrcPiece*)lodepng_malloc(count * sizeof(CrcPiece));
+  if(!pieces) return 83; /*alloc fail*/
+  for(chunk = &in[8]; ; chunk = lodepng_chunk_next_const(chunk))
+  {
+    size_t size = lodepng_chunk_length(chunk) + 4, start;
+    for(start = 0; start < size; start += CRC_PIECE_SIZE, ++i)
+    {
+      pieces[i].data = &chunk[4 + start];
+      pieces[i].size = size - start < CRC_PIECE_SIZE ? size - start : CRC_PIECE_SIZE;
+    }
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+  }
+
+  state->decoder.parallel_for(crcPieceTask, pieces, count, state->decoder.parallel_context);
+
+  i = 0;
+  for(chunk = &in[8]; !error; chunk = lodepng_chunk_next_const(chunk))
+  {
+    size_t size = lodepng_chunk_length(chunk) + 4, start;
+    unsigned crc = pieces[i++].crc;
+    for(start = CRC_PIECE_SIZE; start < size; start += CRC_PIECE_SIZE, ++i)
+    {
+      crc = lodepng_crc32_combine(crc, pieces[i].crc, pieces[i].size);
+    }
+    if(crc != lodepng_read32bitInt(&chunk[4 + size])) error = 57; /*invalid CRC*/
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+  }
+  lodepng_free(pieces);
+  return error;
+}
+
+/*one task of decodeImageParallel*/
+typedef struct RestartSegment
+{
+  const LodePNGState* state;
+  unsigned char* image;
+  unsigned w;
+  unsigned top, bottom; /*the scanlines top up to bottom are in this segment*/
+  const unsigned char* data; /*the deflate data of the segment*/
+  size_t size;
+  unsigned final; /*whether it's the last segment, which ends with the final block*/
+  unsigned adler; /*adler32 of the inflated data*/
+  unsigned error;
+} RestartSegment;
+
+/*inflates and unfilters one segment of the image, the task given to parallel_for*/
+static void decodeRestartSegment(void* data, size_t index)
+{
+  RestartSegment* segment = &((RestartSegment*)data)[index];
+  RowDecoder rows;
+  ZlibSink zsink;
+  ucvector window;
+  Inflater inflater;
+  BitReader reader;
+  unsigned error;
+
+  RowDecoder_init(&rows, segment->state, 0, 0);
+  rows.w = segment->w;
+  rows.h = segment->bottom;
+  rows.y = rows.top = segment->top;
+  rows.image = segment->image;
+  error = rowDecoderSetup(&rows);
+
+  zsink.sink.flush = zlibSinkFlush;
+  zsink.sink.context = &zsink;
+  zsink.sink.start = 0;
+  zsink.flush = rowDecoderFlush;
+  zsink.context = &rows;
+  zsink.adler = 1;
+  ucvector_init(&window);
+  Inflater_init(&inflater, &window, &zsink.sink);
+  BitReader_init(&reader, segment->data, segment->size);
+
+  if(!error) error = inflaterRun(&inflater, &reader, 1);
+  /*the segments before the last one end right before the block header of the next one*/
+  if(!error && inflater.mode != (segment->final ? INFLATE_DONE : INFLATE_BLOCK_HEADER)) error = 52;
+  if(!error) error = inflaterFinish(&inflater);
+  /*decompressed size doesn't match prediction*/
+  if(!error && (rows.y != rows.h || rows.fill != 0)) error = 91;
+
+  segment->adler = zsink.adler;
+  segment->error = error;
+  Inflater_cleanup(&inflater);
+  ucvector_cleanup(&window);
+  RowDecoder_cleanup(&rows);
+}
+
+/*
+lodepng_decode for a non-interlaced image with a prIX chunk, with parallel_for: every segment is decoded into
+the image by its own task. Returns 0 if the image was decoded, state->error tells the result then. Returns 1 if
+the image can't be decoded like that (no or bad index, rows that aren't byte aligned, or anything wrong with the
+PNG); the caller then decodes it normally, which also gives the right error for a broken PNG.
+*/
+static unsigned decodeImageParallel(unsigned char** out, unsigned* w, unsigned* h,
+                                    LodePNGState* state,
+                                    const unsigned char* in, size_t insize)
+{
+  const LodePNGDecompressSettings* zlibsettings = &state->decoder.zlibsettings;
+  const unsigned char* chunk = findRestartIndex(in, insize);
+  const unsigned char* index;
+  const unsigned char* data;
+  unsigned char* image = 0;
+  RestartSegment* segments = 0;
+  ZlibDecoder idat;
+  size_t i, count, datasize, rowsize;
+  unsigned rows, adler, error;
+  unsigned ignore_crc = state->decoder.ignore_crc;
+
+  if(!chunk || zlibsettings->custom_zlib || zlibsettings->custom_inflate) return 1;
+  index = lodepng_chunk_data_const(chunk);
+  rows = lodepng_chunk_length(chunk) >= 4 ? lodepng_read32bitInt(index) : 0;
+  if(rows == 0) return 1;
+  count = *h / rows + (*h % rows != 0);
+  if(count < 2 || lodepng_chunk_length(chunk) != count * 4) return 1;
+
+  /*read all other chunks, and get the zlib data in one piece. The CRCs are checked after that, at the same time.*/
+  error = zlibDecoderInit(&idat, zlibsettings, 0, 0, 0);
+  idat.collect = 1;
+  if(!error)
+  {
+    state->decoder.ignore_crc = 1;
+    decodeChunks(&idat, w, h, state, in, insize);
+    state->decoder.ignore_crc = ignore_crc;
+    error = state->error;
+  }
+  if(!error && !ignore_crc) error = checkChunkCrcs(state, in);
+  data = idat.pending.data;
+  datasize = idat.pending.size;
+  if(!error && (datasize < 6 || zlib_check_header(data, datasize))) error = 1;
+  if(!error && !state->decoder.color_convert)
+  {
+    error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  }
+  /*segments can't share bytes of the image*/
+  if(!error && (*w * (size_t)lodepng_get_bpp(&state->info_raw)) % 8 != 0) error = 1;
+
+  if(!error)
+  {
+    image = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(*w, *h, &state->info_raw));
+    segments = (RestartSegment*)lodepng_malloc(count * sizeof(RestartSegment));
+    if(!image || !segments) error = 83; /*alloc fail*/
+  }
+  for(i = 0; !error && i != count; ++i)
+  {
+    RestartSegment* segment = &segments[i];
+    size_t start = i == 0 ? 2 : lodepng_read32bitInt(&index[4 * i]);
+    size_t end = i + 1 == count ? datasize - 4 : lodepng_read32bitInt(&index[4 * i + 4]);
+    if(start < 2 || start >= end || end > datasize - 4) error = 1;
+    segment->state = state;
+    segment->image = image;
+    segment->w = *w;
+    segment->top = (unsigned)i * rows;
+    segment->bottom = i + 1 == count ? *h : segment->top + rows;
+    segment->data = &data[start];
+    segment->size = end - start;
+    segment->final = i + 1 == count;
+    segment->error = 0;
+  }
+
+  if(!error) state->decoder.parallel_for(decodeRestartSegment, segments, count, state->decoder.parallel_context);
+
+  rowsize = lodepng_get_raw_size_idat(*w, 1, &state->info_png.color) + 1;
+  adler = 1; /*the adler32 of no data*/
+  for(i = 0; !error && i != count; ++i)
+  {
+    error = segments[i].error;
+    adler = adler32_combine(adler, segments[i].adler, (segments[i].bottom - segments[i].top) * rowsize);
+  }
+  if(!error && !zlibsettings->ignore_adler32 && adler != lodepng_read32bitInt(&data[datasize - 4])) error = 58;
+
+  zlibDecoderCleanup(&idat);
+  lodepng_free(segments);
+  if(error)
+  {
+    lodepng_free(image);
+    return 1;
+  }
+  *out = image;
+  state->error = 0;
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
+                               size_t insize, LodePNGColorType colortype, unsigned bitdepth)
+{
+  unsigned error;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  error = lodepng_decode(out, w, h, &state, in, insize);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+unsigned lodepng_decode32(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+{
+  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGBA, 8);
+}
+
+unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+{
+  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
+                             LodePNGColorType colortype, unsigned bitdepth)
+{
+  unsigned char* buffer = 0;
+  size_t buffersize;
+  unsigned error;
+  error = lodepng_load_file(&buffer, &buffersize, filename);
+  if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
+  lodepng_free(buffer);
+  return error;
+}
+
+unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
 {
   return lodepng_decode_file(out, w, h, filename, LCT_RGBA, 8);
 }
@@ -4814,6 +7777,8 @@ void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
   settings->remember_unknown_chunks = 0;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   settings->ignore_crc = 0;
+  settings->parallel_for = 0;
+  settings->parallel_context = 0;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
@@ -4963,11 +7928,23 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   ucvector zlibdata;
   unsigned error = 0;
 
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(zlibsettings->context && !zlibsettings->custom_zlib)
+  {
+    /*compressed into the buffer of the context, that keeps its memory for the next image*/
+    ucvector* compressed = &zlibsettings->context->compressed;
+    compressed->size = 0;
+    error = zlib_compressv(compressed, data, datasize, zlibsettings);
+    if(!error) error = addChunk(out, "IDAT", compressed->data, compressed->size);
+    return error;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
   /*compress with the Zlib compressor*/
   ucvector_init(&zlibdata);
   error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
@@ -4977,6 +7954,46 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+the prIX chunk and an IDAT chunk with restart points every restart_rows scanlines, see decodeImageParallel for
+the format. Every segment of rowsize * restart_rows bytes is deflated on its own, and all but the last end with
+an empty stored block (a zlib full flush), so the next one starts at a byte boundary.
+*/
+static unsigned addChunks_prIX_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
+                                    unsigned restart_rows, size_t rowsize,
+                                    const LodePNGCompressSettings* zlibsettings)
+{
+  ucvector zlibdata, index;
+  size_t start, bp, segmentsize = rowsize * restart_rows;
+  unsigned error = 0;
+
+  ucvector_init(&zlibdata);
+  ucvector_init(&index);
+  zlib_add_header(&zlibdata);
+  lodepng_add32bitInt(&index, restart_rows);
+  for(start = 0; start < datasize && !error; start += segmentsize)
+  {
+    size_t end = datasize - start > segmentsize ? start + segmentsize : datasize;
+    unsigned final = end == datasize;
+    if(start != 0) lodepng_add32bitInt(&index, (unsigned)zlibdata.size);
+    bp = zlibdata.size * 8;
+    error = deflateBlocks(&zlibdata, &bp, &data[start], 0, end - start, zlibsettings, final);
+    if(!error && !final) error = deflateSyncFlush(&zlibdata, bp);
+  }
+  if(!error)
+  {
+    lodepng_add32bitInt(&zlibdata, adler32(data, datasize));
+    error = addChunk(out, "prIX", index.data, index.size);
+  }
+  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
+  ucvector_cleanup(&index);
+
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 static unsigned addChunk_IEND(ucvector* out)
 {
   unsigned error = 0;
@@ -5003,7 +8020,7 @@ static unsigned addChunk_tEXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* textstring,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data, compressed;
@@ -5030,7 +8047,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_iTXt(ucvector* out, unsigned compressed, const char* keyword, const char* langtag,
-                              const char* transkey, const char* textstring, LodePNGCompressSettings* zlibsettings)
+                              const char* transkey, const char* textstring, const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data;
@@ -5135,10 +8152,93 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_COMPILE_SSE2
+/*
+SSE2 version of filterScanline for Sub, and for Up, Average and Paeth with prevline. Unlike unfiltering, filtering
+only reads the unfiltered scanline, so no byte depends on another filtered one and they go 16 at a time for any
+bytewidth. Only the first pixel and the rest that doesn't fill 16 bytes are done per byte.
+*/
+static void filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, size_t bytewidth, unsigned char filterType)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i x, a, b, c, predictor;
+  size_t i;
+  switch(filterType)
+  {
+    case 1: /*Sub*/
+      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+      for(; i + 16 <= length; i += 16)
+      {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, a));
+      }
+      for(; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      break;
+    case 2: /*Up*/
+      for(i = 0; i + 16 <= length; i += 16)
+      {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, b));
+      }
+      for(; i != length; ++i) out[i] = scanline[i] - prevline[i];
+      break;
+    case 3: /*Average*/
+      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
+      for(; i + 16 <= length; i += 16)
+      {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        /*_mm_avg_epu8 rounds up, the filter rounds down*/
+        predictor = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, predictor));
+      }
+      for(; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+      break;
+    case 4: /*Paeth*/
+      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+      for(; i + 16 <= length; i += 16)
+      {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+        predictor = _mm_packus_epi16(
+            paethPredictorSSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+            paethPredictorSSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, predictor));
+      }
+      for(; i < length; ++i)
+      {
+        out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
+      }
+      break;
+    default: return;
+  }
+}
+#endif /*LODEPNG_COMPILE_SSE2*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
+#ifdef LODEPNG_COMPILE_SSE2
+  if(filterType == 1 || (filterType == 4 && !prevline))
+  {
+    /*without prevline Paeth is the same as Sub*/
+    filterScanlineSSE2(out, scanline, prevline, length, bytewidth, 1);
+    return;
+  }
+  if(prevline && (filterType == 2 || filterType == 3 || filterType == 4))
+  {
+    filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType);
+    return;
+  }
+#endif /*LODEPNG_COMPILE_SSE2*/
   switch(filterType)
   {
     case 0: /*None*/
@@ -5200,170 +8300,175 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+The sum LFS_MINSUM picks the smallest of: the bytes as unsigned for filter type None, for the others as signed
+differences, with 255 - s for the negative ones. With SSE2 the negative ones are flipped to ~s, which is 255 - s,
+and psadbw adds up 8 bytes at a time.
+*/
+static size_t filterSum(const unsigned char* data, size_t length, unsigned char filterType)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  size_t x = 0, sum = 0;
+#ifdef LODEPNG_COMPILE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero, v;
+  unsigned lanes[4];
+  for(; x + 16 <= length; x += 16)
+  {
+    v = _mm_loadu_si128((const __m128i*)&data[x]);
+    if(filterType != 0) v = _mm_xor_si128(v, _mm_cmplt_epi8(v, zero));
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, zero));
+  }
+  /*adds the two 64-bit sums, and reads the result as two 32-bit halves*/
+  _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(total, _mm_unpackhi_epi64(total, total)));
+  sum = lanes[0];
+  if(sizeof(size_t) > 4u) sum |= ((size_t)lanes[1] << 16u) << 16u;
+#endif /*LODEPNG_COMPILE_SSE2*/
+  if(filterType == 0)
+  {
+    for(; x != length; ++x) sum += data[x];
+  }
+  else
+  {
+    for(; x != length; ++x) sum += data[x] < 128 ? data[x] : (255U - data[x]);
+  }
+  return sum;
+}
 
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
-  unsigned x, y;
-  unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
+/*the statistics of the filtered bytes so far that LFS_ADAPTIVE chooses the filters with*/
+typedef struct FilterModel
+{
+  unsigned count[256]; /*how often every byte value was in the filtered scanlines*/
+  size_t total; /*the sum of count*/
+  size_t fresh; /*bytes counted since cost was last computed*/
+  unsigned cost[256]; /*the bits every byte value would take, in 1/16 bits*/
+} FilterModel;
 
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+/*the statistics start over every this many bytes of filtered data, the size of the bands of filterParallel*/
+#define FILTER_BAND_SIZE 262144
+
+/*scanlines per band: every band starts on a multiple of it*/
+static unsigned filterBandRows(size_t linebytes)
+{
+  return (unsigned)(FILTER_BAND_SIZE / (linebytes + 1) + 1);
+}
+
+static void filterModelInit(FilterModel* model)
+{
+  unsigned i;
+  for(i = 0; i != 256; ++i) model->count[i] = 0;
+  model->total = 0;
+  model->fresh = 0;
+}
 
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+/*the costs are -log2 of the probability of every value, seen at least once, so values not seen yet cost the most*/
+static void filterModelUpdate(FilterModel* model)
+{
+  unsigned i;
+  float total = (float)(model->total + 256);
+  for(i = 0; i != 256; ++i) model->cost[i] = (unsigned)(flog2(total / (float)(model->count[i] + 1)) * 16 + 0.5f);
+  model->fresh = 0;
+}
 
-  if(bpp == 0) return 31; /*error: invalid color type*/
+/*
+the estimated bits of a filtered scanline, in 1/16 bits: every byte costs what the statistics say for its value,
+except when it repeats the byte before it, LZ77 makes most of those part of a run that costs next to nothing.
+Stops counting once the cost is over limit.
+*/
+static size_t filterCost(const unsigned char* data, size_t length, const unsigned cost[256], size_t limit)
+{
+  size_t x, i, end, sum = 0;
+  for(x = 0; x < length && sum <= limit; x = end)
+  {
+    end = length - x > 256 ? x + 256 : length;
+    for(i = x; i != end; ++i) sum += i != 0 && data[i] == data[i - 1] ? 0 : cost[data[i]];
+  }
+  return sum;
+}
+
+/*
+Filters one scanline with the filter chosen by strategy.
+out receives the filter type byte followed by the linebytes filtered bytes. prevline is the previous
+unfiltered scanline, or NULL for the first one, and y the index of the scanline (for LFS_PREDEFINED).
+attempt must contain five buffers of linebytes bytes, used as scratch space by the adaptive strategies.
+model has the statistics of the scanlines before it for LFS_ADAPTIVE, and gets those of this one.
+*/
+static void filterRow(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                      size_t linebytes, size_t bytewidth, unsigned y, LodePNGFilterStrategy strategy,
+                      const LodePNGEncoderSettings* settings, unsigned char* attempt[5], FilterModel* model)
+{
+  size_t x;
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
-    {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      out[outindex] = 0; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
-      prevline = &in[inindex];
-    }
+    out[0] = 0; /*filter type byte*/
+    filterScanline(&out[1], scanline, prevline, linebytes, bytewidth, 0);
   }
   else if(strategy == LFS_MINSUM)
   {
     /*adaptive filtering*/
     size_t sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
     unsigned char type, bestType = 0;
 
+    /*try the 5 filter types*/
     for(type = 0; type != 5; ++type)
     {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-
-    if(!error)
-    {
-      for(y = 0; y != h; ++y)
-      {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type)
-        {
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
-        }
+      filterScanline(attempt[type], scanline, prevline, linebytes, bytewidth, type);
 
-        prevline = &in[y * linebytes];
+      /*calculate the sum of the result. For differences, each byte should be treated as signed, values above
+      127 are negative (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+      This means filtertype 0 is almost never chosen, but that is justified.*/
+      sum[type] = filterSum(attempt[type], linebytes, type);
 
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+      /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || sum[type] < smallest)
+      {
+        bestType = type;
+        smallest = sum[type];
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    /*now fill the out values*/
+    out[0] = bestType; /*the first byte of a scanline will be the filter type*/
+    for(x = 0; x != linebytes; ++x) out[1 + x] = attempt[bestType][x];
   }
   else if(strategy == LFS_ENTROPY)
   {
     float sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     float smallest = 0;
     unsigned type, bestType = 0;
     unsigned count[256];
 
+    /*try the 5 filter types*/
     for(type = 0; type != 5; ++type)
     {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-
-    for(y = 0; y != h; ++y)
-    {
-      /*try the 5 filter types*/
-      for(type = 0; type != 5; ++type)
+      filterScanline(attempt[type], scanline, prevline, linebytes, bytewidth, type);
+      for(x = 0; x != 256; ++x) count[x] = 0;
+      for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+      ++count[type]; /*the filter type itself is part of the scanline*/
+      sum[type] = 0;
+      for(x = 0; x != 256; ++x)
       {
-        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
-        ++count[type]; /*the filter type itself is part of the scanline*/
-        sum[type] = 0;
-        for(x = 0; x != 256; ++x)
-        {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
-        }
-        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || sum[type] < smallest)
-        {
-          bestType = type;
-          smallest = sum[type];
-        }
+        float p = count[x] / (float)(linebytes + 1);
+        sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
+      }
+      /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || sum[type] < smallest)
+      {
+        bestType = type;
+        smallest = sum[type];
       }
-
-      prevline = &in[y * linebytes];
-
-      /*now fill the out values*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    /*now fill the out values*/
+    out[0] = bestType; /*the first byte of a scanline will be the filter type*/
+    for(x = 0; x != linebytes; ++x) out[1 + x] = attempt[bestType][x];
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
-    {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
-      out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
-      prevline = &in[inindex];
-    }
+    unsigned char type = settings->predefined_filters[y];
+    out[0] = type; /*filter type byte*/
+    filterScanline(&out[1], scanline, prevline, linebytes, bytewidth, type);
   }
   else if(strategy == LFS_BRUTE_FORCE)
   {
@@ -5371,7 +8476,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     deflate the scanline after every filter attempt to see which one deflates best.
     This is very slow and gives only slightly smaller, sometimes even larger, result*/
     size_t size[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
     unsigned type = 0, bestType = 0;
     unsigned char* dummy;
@@ -5385,41 +8489,270 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    for(type = 0; type != 5; ++type) /*try the 5 filter types*/
+    {
+      size_t testsize = linebytes;
+      /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
+
+      filterScanline(attempt[type], scanline, prevline, linebytes, bytewidth, type);
+      size[type] = 0;
+      dummy = 0;
+      zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
+      lodepng_free(dummy);
+      /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || size[type] < smallest)
+      {
+        bestType = type;
+        smallest = size[type];
+      }
+    }
+    out[0] = bestType; /*the first byte of a scanline will be the filter type*/
+    for(x = 0; x != linebytes; ++x) out[1 + x] = attempt[bestType][x];
+  }
+  else if(strategy == LFS_ADAPTIVE)
+  {
+    size_t cost, smallest = 0;
+    unsigned char type, bestType = 0;
+
+    /*the costs are computed again every 1K bytes or so, more often doesn't change much*/
+    if(model->total != 0 && (model->fresh >= 1024 || model->fresh == model->total)) filterModelUpdate(model);
     for(type = 0; type != 5; ++type)
     {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
+      filterScanline(attempt[type], scanline, prevline, linebytes, bytewidth, type);
+      /*without statistics yet, the first scanline goes by the minimum sum*/
+      cost = model->total ? filterCost(attempt[type], linebytes, model->cost, type == 0 ? (size_t)(-1) : smallest)
+                          : filterSum(attempt[type], linebytes, type);
+      if(type == 0 || cost < smallest)
+      {
+        bestType = type;
+        smallest = cost;
+      }
     }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+
+    out[0] = bestType; /*the first byte of a scanline will be the filter type*/
+    for(x = 0; x != linebytes; ++x)
     {
-      for(type = 0; type != 5; ++type)
+      out[1 + x] = attempt[bestType][x];
+      if(x == 0 || out[1 + x] != out[x])
       {
-        unsigned testsize = linebytes;
-        /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
-
-        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        size[type] = 0;
-        dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
-        lodepng_free(dummy);
-        /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || size[type] < smallest)
-        {
-          bestType = type;
-          smallest = size[type];
-        }
+        ++model->count[out[1 + x]];
+        ++model->total;
+        ++model->fresh;
       }
-      prevline = &in[y * linebytes];
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
-  else return 88; /* unknown filter strategy */
+}
+
+/*
+The filter strategy to use for the given color mode: follows the official PNG heuristic of not filtering
+palette and < 8 bit images if filter_palette_zero is set, see below. Returns (LodePNGFilterStrategy)(-1)
+for an unknown strategy.
+*/
+static LodePNGFilterStrategy getFilterStrategy(const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+
+  switch(strategy)
+  {
+    case LFS_ZERO: case LFS_MINSUM: case LFS_ENTROPY: case LFS_BRUTE_FORCE: case LFS_PREDEFINED:
+    case LFS_ADAPTIVE:
+      return strategy;
+    default:
+      return (LodePNGFilterStrategy)(-1);
+  }
+}
+
+/*allocates the five scratch buffers used by filterRow, returns error code. On error they're all NULL.*/
+static unsigned filterAttemptsInit(unsigned char* attempt[5], size_t linebytes)
+{
+  unsigned type;
+  for(type = 0; type != 5; ++type)
+  {
+    attempt[type] = (unsigned char*)lodepng_malloc(linebytes + 1);
+    if(!attempt[type])
+    {
+      while(type > 0) lodepng_free(attempt[--type]);
+      for(type = 0; type != 5; ++type) attempt[type] = 0;
+      return 83; /*alloc fail*/
+    }
+  }
+  return 0;
+}
+
+static void filterAttemptsCleanup(unsigned char* attempt[5])
+{
+  unsigned type;
+  for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+}
+
+/*the scratch buffers of the encoder context, made bigger if they're smaller than linebytes*/
+static unsigned filterAttemptsReuse(unsigned char* attempt[5], LodePNGEncoderContext* context, size_t linebytes)
+{
+  unsigned type;
+  if(context->attemptsize < linebytes + 1)
+  {
+    if(context->attemptsize) filterAttemptsCleanup(context->attempt);
+    context->attemptsize = 0;
+    CERROR_TRY_RETURN(filterAttemptsInit(context->attempt, linebytes));
+    context->attemptsize = linebytes + 1;
+  }
+  for(type = 0; type != 5; ++type) attempt[type] = context->attempt[type];
+  return 0;
+}
+
+/*
+makes a scanline that was filtered without previous line use filter type None or Sub, which a decoder that
+does have the previous line undoes the same way. Without previous line Up is the same as None and Paeth the
+same as Sub, Average has to be done again as Sub.
+*/
+static void filterRestartRow(unsigned char* out, const unsigned char* scanline, size_t linebytes, size_t bytewidth)
+{
+  if(out[0] == 2) out[0] = 0;
+  else if(out[0] == 4) out[0] = 1;
+  else if(out[0] == 3)
+  {
+    out[0] = 1;
+    filterScanline(&out[1], scanline, 0, linebytes, bytewidth, 1);
+  }
+}
+
+/*filters the scanlines y0 to y1 of the image given to filter, with restart_rows as there*/
+static void filterRows(unsigned char* out, const unsigned char* in, unsigned y0, unsigned y1, size_t linebytes,
+                       size_t bytewidth, LodePNGFilterStrategy strategy, const LodePNGEncoderSettings* settings,
+                       unsigned restart_rows, unsigned char* attempt[5])
+{
+  unsigned y, bandrows = filterBandRows(linebytes);
+  FilterModel model;
+  for(y = y0; y != y1; ++y)
+  {
+    size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
+    size_t inindex = linebytes * y;
+    unsigned restart = y == 0 || (restart_rows && y % restart_rows == 0);
+    const unsigned char* prevline = restart ? 0 : &in[inindex - linebytes];
+    if(y == y0 || y % bandrows == 0) filterModelInit(&model);
+    filterRow(&out[outindex], &in[inindex], prevline, linebytes, bytewidth, y, strategy, settings, attempt,
+              &model);
+    if(restart_rows && y % restart_rows == 0) filterRestartRow(&out[outindex], &in[inindex], linebytes, bytewidth);
+  }
+}
+
+/*the scanlines for one task of filterParallel, the rest is the same for all of them*/
+typedef struct FilterBand
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned y0, y1;
+  size_t linebytes, bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned restart_rows;
+  unsigned error;
+} FilterBand;
 
+static void filterBandTask(void* data, size_t index)
+{
+  FilterBand* band = &((FilterBand*)data)[index];
+  unsigned char* attempt[5];
+  band->error = filterAttemptsInit(attempt, band->linebytes);
+  if(band->error) return;
+  filterRows(band->out, band->in, band->y0, band->y1, band->linebytes, band->bytewidth, band->strategy,
+             band->settings, band->restart_rows, attempt);
+  filterAttemptsCleanup(attempt);
+}
+
+/*
+filters bands of bandrows scanlines at the same time with the parallel_for of the zlib settings. Every scanline
+only depends on the unfiltered image and, for LFS_ADAPTIVE, the scanlines before it in its band, so it's the same
+as filtering them one after the other.
+*/
+static unsigned filterParallel(unsigned char* out, const unsigned char* in, unsigned h, unsigned bandrows,
+                               size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy,
+                               const LodePNGEncoderSettings* settings, unsigned restart_rows)
+{
+  unsigned error = 0;
+  size_t i, numbands = (h + bandrows - 1) / bandrows;
+  FilterBand* bands = (FilterBand*)lodepng_malloc(numbands * sizeof(FilterBand));
+  /*the brute force strategy deflates with these settings, the bands can't share the memory of the context*/
+  LodePNGEncoderSettings bandsettings = *settings;
+  bandsettings.zlibsettings.context = 0;
+  bandsettings.zlibsettings.parallel_for = 0;
+  if(!bands) return 83; /*alloc fail*/
+
+  for(i = 0; i != numbands; ++i)
+  {
+    bands[i].out = out;
+    bands[i].in = in;
+    bands[i].y0 = (unsigned)(i * bandrows);
+    bands[i].y1 = i + 1 == numbands ? h : (unsigned)((i + 1) * bandrows);
+    bands[i].linebytes = linebytes;
+    bands[i].bytewidth = bytewidth;
+    bands[i].strategy = strategy;
+    bands[i].settings = &bandsettings;
+    bands[i].restart_rows = restart_rows;
+    bands[i].error = 0;
+  }
+  settings->zlibsettings.parallel_for(filterBandTask, bands, numbands, settings->zlibsettings.parallel_context);
+
+  for(i = 0; i != numbands && !error; ++i) error = bands[i].error;
+  lodepng_free(bands);
   return error;
 }
 
+/*restart_rows: if not 0, every scanline at a multiple of it uses filter type None or Sub, see restart_rows*/
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings,
+                       unsigned restart_rows)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+  LodePNGFilterStrategy strategy = getFilterStrategy(info, settings);
+  LodePNGEncoderContext* context = settings->zlibsettings.context;
+  unsigned bandrows = filterBandRows(linebytes);
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+  if(strategy == (LodePNGFilterStrategy)(-1)) return 88; /* unknown filter strategy */
+
+  if(settings->zlibsettings.parallel_for && h > bandrows)
+  {
+    return filterParallel(out, in, h, bandrows, linebytes, bytewidth, strategy, settings, restart_rows);
+  }
+
+  CERROR_TRY_RETURN(context ? filterAttemptsReuse(attempt, context, linebytes)
+                            : filterAttemptsInit(attempt, linebytes));
+
+  filterRows(out, in, 0, h, linebytes, bytewidth, strategy, settings, restart_rows, attempt);
+
+  if(!context) filterAttemptsCleanup(attempt);
+
+  return 0;
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5502,6 +8835,38 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   }
 }
 
+/*the restart_rows the encoder really uses, 0 where restart points can't be made or have no use*/
+static unsigned getRestartRows(const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings, unsigned h)
+{
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(info_png->interlace_method != 0) return 0;
+  if(settings->zlibsettings.custom_zlib || settings->zlibsettings.custom_deflate) return 0;
+  return settings->restart_rows < h ? settings->restart_rows : 0;
+#else /*LODEPNG_COMPILE_ZLIB*/
+  (void)info_png;
+  (void)settings;
+  (void)h;
+  return 0; /*a custom zlib can't make them*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
+/*sets *out to a buffer of size bytes for the filtered scanlines, the one of the encoder context if there is one*/
+static unsigned getFilteredBuffer(unsigned char** out, size_t size, const LodePNGEncoderSettings* settings)
+{
+  LodePNGEncoderContext* context = settings->zlibsettings.context;
+  if(context)
+  {
+    if(!ucvector_resize(&context->filtered, size)) return 83; /*alloc fail*/
+    *out = context->filtered.data;
+  }
+  else
+  {
+    *out = (unsigned char*)lodepng_malloc(size);
+    if(!(*out) && size) return 83; /*alloc fail*/
+  }
+  return 0;
+}
+
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -5519,8 +8884,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   if(info_png->interlace_method == 0)
   {
     *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
+    error = getFilteredBuffer(out, *outsize, settings);
 
     if(!error)
     {
@@ -5532,14 +8896,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!error)
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, w, h, &info_png->color, settings, getRestartRows(info_png, settings, h));
         }
         lodepng_free(padded);
       }
       else
       {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, w, h, &info_png->color, settings, getRestartRows(info_png, settings, h));
       }
     }
   }
@@ -5552,8 +8916,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
     *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!(*out)) error = 83; /*alloc fail*/
+    error = getFilteredBuffer(out, *outsize, settings);
 
     adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
     if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
@@ -5572,68 +8935,201 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
           error = filter(&(*out)[filter_passstart[i]], padded,
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, 0);
           lodepng_free(padded);
         }
         else
         {
           error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, 0);
         }
 
         if(error) break;
       }
     }
-
-    lodepng_free(adam7);
+
+    lodepng_free(adam7);
+  }
+
+  return error;
+}
+
+/*
+palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
+returns 0 if the palette is opaque,
+returns 1 if the palette has a single color with alpha 0 ==> color key
+returns 2 if the palette is semi-translucent.
+*/
+static unsigned getPaletteTranslucency(const unsigned char* palette, size_t palettesize)
+{
+  size_t i;
+  unsigned key = 0;
+  unsigned r = 0, g = 0, b = 0; /*the value of the color with alpha 0, so long as color keying is possible*/
+  for(i = 0; i != palettesize; ++i)
+  {
+    if(!key && palette[4 * i + 3] == 0)
+    {
+      r = palette[4 * i + 0]; g = palette[4 * i + 1]; b = palette[4 * i + 2];
+      key = 1;
+      i = (size_t)(-1); /*restart from beginning, to detect earlier opaque colors with key's value*/
+    }
+    else if(palette[4 * i + 3] != 255) return 2;
+    /*when key, no opaque RGB may have key's RGB*/
+    else if(key && r == palette[i * 4 + 0] && g == palette[i * 4 + 1] && b == palette[i * 4 + 2]) return 2;
+  }
+  return key;
+}
+
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize)
+{
+  unsigned char* inchunk = data;
+  while((size_t)(inchunk - data) < datasize)
+  {
+    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
+    out->allocsize = out->size; /*fix the allocsize again*/
+    inchunk = lodepng_chunk_next(inchunk);
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+/*writes the signature and all chunks that come before the IDAT chunks, returns error code*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h,
+                                    const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
+  /*write signature and chunks*/
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) addChunk_bKGD(out, info);
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return error;
+}
+
+/*writes all chunks that come after the IDAT chunks, up to and including IEND, returns error code*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i != info->text_num; ++i)
+  {
+    if(strlen(info->text_keys[i]) > 79)
+    {
+      error = 66; /*text chunk too large*/
+      break;
+    }
+    if(strlen(info->text_keys[i]) < 1)
+    {
+      error = 67; /*text chunk too small*/
+      break;
+    }
+    if(settings->text_compression)
+    {
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+    }
+    else
+    {
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned alread_added_id_text = 0;
+    for(i = 0; i != info->text_num; ++i)
+    {
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        alread_added_id_text = 1;
+        break;
+      }
+    }
+    if(alread_added_id_text == 0)
+    {
+      addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+    }
   }
-
-  return error;
-}
-
-/*
-palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
-returns 0 if the palette is opaque,
-returns 1 if the palette has a single color with alpha 0 ==> color key
-returns 2 if the palette is semi-translucent.
-*/
-static unsigned getPaletteTranslucency(const unsigned char* palette, size_t palettesize)
-{
-  size_t i;
-  unsigned key = 0;
-  unsigned r = 0, g = 0, b = 0; /*the value of the color with alpha 0, so long as color keying is possible*/
-  for(i = 0; i != palettesize; ++i)
+  /*iTXt*/
+  for(i = 0; i != info->itext_num; ++i)
   {
-    if(!key && palette[4 * i + 3] == 0)
+    if(strlen(info->itext_keys[i]) > 79)
     {
-      r = palette[4 * i + 0]; g = palette[4 * i + 1]; b = palette[4 * i + 2];
-      key = 1;
-      i = (size_t)(-1); /*restart from beginning, to detect earlier opaque colors with key's value*/
+      error = 66; /*text chunk too large*/
+      break;
     }
-    else if(palette[4 * i + 3] != 255) return 2;
-    /*when key, no opaque RGB may have key's RGB*/
-    else if(key && r == palette[i * 4 + 0] && g == palette[i * 4 + 1] && b == palette[i * 4 + 2]) return 2;
+    if(strlen(info->itext_keys[i]) < 1)
+    {
+      error = 67; /*text chunk too small*/
+      break;
+    }
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
   }
-  return key;
-}
 
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize)
-{
-  unsigned char* inchunk = data;
-  while((size_t)(inchunk - data) < datasize)
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
   {
-    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
-    out->allocsize = out->size; /*fix the allocsize again*/
-    inchunk = lodepng_chunk_next(inchunk);
+    error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
   }
-  return 0;
-}
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  addChunk_IEND(out);
+  return error;
+}
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*lodepng_encode with the settings as they are*/
+static unsigned encodePNG(unsigned char** out, size_t* outsize,
+                          const unsigned char* image, unsigned w, unsigned h,
+                          LodePNGState* state)
 {
   LodePNGInfo info;
   ucvector outv;
@@ -5694,129 +9190,29 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
   {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunksBeforeIDAT(&outv, w, h, &info, &state->encoder);
     if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i)
-    {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
-    {
-      unsigned alread_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          alread_added_id_text = 1;
-          break;
-        }
-      }
-      if(alread_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i)
+    /*IDAT (multiple IDAT chunks must be consecutive)*/
+    if(!getRestartRows(&info, &state->encoder, h))
     {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
+      state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
     }
-
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
+#ifdef LODEPNG_COMPILE_ZLIB
+    else
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) break;
+      state->error = addChunks_prIX_IDAT(&outv, data, datasize, getRestartRows(&info, &state->encoder, h),
+                                         (w * (size_t)lodepng_get_bpp(&info.color) + 7) / 8 + 1,
+                                         &state->encoder.zlibsettings);
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    if(state->error) break;
+    state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
 
   lodepng_info_cleanup(&info);
-  lodepng_free(data);
+  if(!state->encoder.zlibsettings.context) lodepng_free(data); /*otherwise it's the buffer of the context*/
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -5824,6 +9220,150 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+/*
+The settings a time_budget chooses from, from fast to small: the deflate strategy, the level for LDS_DEFAULT, the
+filter strategy, and the estimated seconds per raw image byte, from photos and drawings on a desktop CPU. The real
+times depend a lot on the machine and the image, the context measures them.
+*/
+typedef struct EncoderEffort
+{
+  LodePNGDeflateStrategy strategy;
+  unsigned level;
+  LodePNGFilterStrategy filter_strategy;
+  double estimate;
+} EncoderEffort;
+
+static const EncoderEffort ENCODER_EFFORTS[NUM_ENCODER_EFFORTS] = {
+  {LDS_HUFFMAN_ONLY, 6, LFS_MINSUM, 10e-9},
+  {LDS_RLE, 6, LFS_MINSUM, 17e-9},
+  {LDS_DEFAULT, 1, LFS_MINSUM, 23e-9},
+  {LDS_DEFAULT, 4, LFS_MINSUM, 28e-9},
+  {LDS_DEFAULT, 6, LFS_MINSUM, 48e-9},
+  {LDS_DEFAULT, 6, LFS_ADAPTIVE, 53e-9},
+  {LDS_DEFAULT, 8, LFS_ADAPTIVE, 100e-9},
+  {LDS_DEFAULT, 9, LFS_ADAPTIVE, 230e-9}
+};
+
+/*
+seconds since some fixed time, from a clock that only moves forward: neither the wall clock, which NTP and the user
+can set back and forth, nor clock(), which sums the processor time of all threads, parallel_for ones too
+*/
+#if defined(_WIN32)
+#define LODEPNG_MONOTONIC_CLOCK
+static double monotonicClock(void)
+{
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (double)count.QuadPart / (double)frequency.QuadPart;
+}
+#elif defined(CLOCK_MONOTONIC)
+#define LODEPNG_MONOTONIC_CLOCK
+static double monotonicClock(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+#endif /*LODEPNG_MONOTONIC_CLOCK*/
+
+/*the clock of time_budget: the one in the settings, or else the monotonic clock of the system*/
+static double encoderClock(const LodePNGEncoderSettings* settings)
+{
+  if(settings->budget_clock) return settings->budget_clock(settings->budget_clock_context);
+#ifdef LODEPNG_MONOTONIC_CLOCK
+  return monotonicClock();
+#else /*LODEPNG_MONOTONIC_CLOCK*/
+  return 0; /*not reached, lodepng_encode gives error 105 first*/
+#endif /*LODEPNG_MONOTONIC_CLOCK*/
+}
+
+/*the expected seconds per raw image byte of the effort: as measured, or estimated and scaled like the measured ones*/
+static double effortRate(const LodePNGEncoderContext* context, unsigned effort)
+{
+  if(context->effort_encodes[effort]) return context->effort_rate[effort];
+  return ENCODER_EFFORTS[effort].estimate * (context->encodes ? context->effort_scale : 1);
+}
+
+/*whether the effort was used on one of the last ENCODER_RATIO_AGE images, so its ratio fits the current input*/
+static int recentEffort(const LodePNGEncoderContext* context, unsigned effort)
+{
+  return context->effort_encodes[effort] && context->encodes - context->effort_last[effort] < ENCODER_RATIO_AGE;
+}
+
+/*
+the effort that compresses most of those expected to encode bytes in budget microseconds, or else the fastest.
+That's the slowest one that fits, unless a faster one was measured to give smaller PNGs of the recent images, as
+the hash chains do on some photos compared to only Huffman coding. Ratios of images of another kind, such as a flat
+one that only RLE compresses well, age out, and once the ratio of the slowest one ages out it's encoded again to
+compare the faster one against the current input.
+*/
+static unsigned chooseEffort(const LodePNGEncoderContext* context, size_t bytes, unsigned budget)
+{
+  unsigned i, effort = NUM_ENCODER_EFFORTS - 1, best;
+  while(effort > 0 && effortRate(context, effort) * (double)bytes * 1e6 > (double)budget) --effort;
+  best = effort;
+  if(recentEffort(context, effort)) for(i = 0; i != effort; ++i)
+  {
+    if(recentEffort(context, i) && context->effort_ratio[i] < context->effort_ratio[best]) best = i;
+  }
+  return best;
+}
+
+/*moves the value a quarter of the way to a new measurement, so that one odd encode doesn't throw it off, or sets
+it to the first one*/
+static void updateEstimate(double* value, unsigned encodes, double measured)
+{
+  *value = encodes ? (*value * 3 + measured) / 4 : measured;
+}
+
+static void recordEffort(LodePNGEncoderContext* context, unsigned effort, size_t bytes, size_t pngsize,
+                         double seconds)
+{
+  double rate = (seconds > 0 ? seconds : 0) / (double)bytes;
+  unsigned encodes = context->effort_encodes[effort];
+  updateEstimate(&context->effort_rate[effort], encodes, rate);
+  updateEstimate(&context->effort_ratio[effort], encodes, (double)pngsize / (double)bytes);
+  updateEstimate(&context->effort_scale, context->encodes, rate / ENCODER_EFFORTS[effort].estimate);
+  /*stops counting instead of wrapping around to unmeasured*/
+  if(context->effort_encodes[effort] != UINT_MAX) ++context->effort_encodes[effort];
+  if(context->encodes != UINT_MAX) ++context->encodes;
+  context->effort_last[effort] = context->encodes;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  LodePNGEncoderContext* context = state->encoder.zlibsettings.context;
+  size_t bytes = lodepng_get_raw_size(w, h, &state->info_raw);
+  unsigned effort;
+  double start;
+
+  if(!state->encoder.time_budget) return encodePNG(out, outsize, image, w, h, state);
+
+  *out = 0;
+  *outsize = 0;
+  /*error: the timings of the earlier encodes are kept in the context*/
+  if(!context) CERROR_RETURN_ERROR(state->error, 103);
+#ifndef LODEPNG_MONOTONIC_CLOCK
+  if(!state->encoder.budget_clock) CERROR_RETURN_ERROR(state->error, 105); /*no clock to measure encodes with*/
+#endif /*LODEPNG_MONOTONIC_CLOCK*/
+
+  /*the chosen settings stay in the encoder settings, to show what was chosen*/
+  effort = chooseEffort(context, bytes, state->encoder.time_budget);
+  state->encoder.zlibsettings.strategy = ENCODER_EFFORTS[effort].strategy;
+  lodepng_compress_settings_set_level(&state->encoder.zlibsettings, ENCODER_EFFORTS[effort].level);
+  state->encoder.filter_strategy = ENCODER_EFFORTS[effort].filter_strategy;
+
+  start = encoderClock(&state->encoder);
+  if(!encodePNG(out, outsize, image, w, h, state) && bytes)
+  {
+    recordEffort(context, effort, bytes, *outsize, encoderClock(&state->encoder) - start);
+  }
+  return state->error;
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5873,6 +9413,184 @@ unsigned lodepng_encode24_file(const char* filename, const unsigned char* image,
 }
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_ZLIB
+struct LodePNGRowEncoder
+{
+  LodePNGInfo info; /*copy of the info_png of the state*/
+  LodePNGColorMode info_raw; /*copy of the info_raw of the state*/
+  LodePNGEncoderSettings settings;
+  LodePNGFilterStrategy strategy;
+  unsigned convert; /*whether the rows must be converted from info_raw to the PNG color type*/
+  unsigned w, h;
+  unsigned y; /*the next row to encode*/
+  size_t linebytes; /*bytes per row in the PNG color type*/
+  size_t rawlinebytes; /*bytes per row in the raw color type*/
+  size_t bytewidth;
+  unsigned char* lines[2]; /*the current and previous unfiltered row in the PNG color type, alternating*/
+  unsigned char* filtered; /*the current filtered row, including filter type byte*/
+  unsigned char* attempt[5]; /*scratch buffers for filterRow*/
+  FilterModel model; /*the statistics of filterRow*/
+  ZlibStream zlib;
+  ucvector chunk; /*the chunk being written*/
+  LodePNGWriteCallback write;
+  void* context;
+  unsigned error; /*errors are sticky, the encoder can only be finished after one*/
+};
+
+/*writes the first amount bytes of out as IDAT chunk*/
+static unsigned rowEncoderWriteIDAT(LodePNGRowEncoder* encoder, size_t amount)
+{
+  encoder->chunk.size = 0;
+  CERROR_TRY_RETURN(addChunk(&encoder->chunk, "IDAT", encoder->zlib.out.data, amount));
+  CERROR_TRY_RETURN(encoder->write(encoder->context, encoder->chunk.data, encoder->chunk.size));
+  zlib_stream_take(&encoder->zlib, amount);
+  return 0;
+}
+
+unsigned lodepng_row_encoder_begin(LodePNGRowEncoder** out, unsigned w, unsigned h, const LodePNGState* state,
+                                   LodePNGWriteCallback write, void* context)
+{
+  LodePNGRowEncoder* encoder;
+  const LodePNGColorMode* color = &state->info_png.color;
+  unsigned error = 0, bpp;
+  size_t totalsize;
+
+  *out = 0;
+  if(color->colortype == LCT_PALETTE && (color->palettesize == 0 || color->palettesize > 256))
+  {
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) return 61; /*error: unexisting btype*/
+  if(state->info_png.interlace_method > 1) return 71; /*error: unexisting interlace mode*/
+  if(state->info_png.interlace_method == 1) return 95; /*Adam7 can't be written row by row*/
+  CERROR_TRY_RETURN(checkColorValidity(color->colortype, color->bitdepth));
+  CERROR_TRY_RETURN(checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth));
+  if(getFilterStrategy(color, &state->encoder) == (LodePNGFilterStrategy)(-1)) return 88; /*unknown filter strategy*/
+  /*the length of a chunk must fit in 31 bits*/
+  if(state->encoder.idat_size == 0 || state->encoder.idat_size > 2147483647u) return 101;
+
+  encoder = (LodePNGRowEncoder*)lodepng_malloc(sizeof(LodePNGRowEncoder));
+  if(!encoder) return 83; /*alloc fail*/
+  *out = encoder;
+
+  lodepng_info_init(&encoder->info);
+  lodepng_color_mode_init(&encoder->info_raw);
+  encoder->settings = state->encoder;
+  encoder->settings.zlibsettings.context = 0; /*the zlib stream keeps its hash for the whole image*/
+  encoder->w = w;
+  encoder->h = h;
+  encoder->y = 0;
+  bpp = lodepng_get_bpp(color);
+  encoder->linebytes = (w * (size_t)bpp + 7) / 8;
+  encoder->rawlinebytes = (w * (size_t)lodepng_get_bpp(&state->info_raw) + 7) / 8;
+  encoder->bytewidth = (bpp + 7) / 8;
+  encoder->strategy = getFilterStrategy(color, &state->encoder);
+  encoder->lines[0] = (unsigned char*)lodepng_malloc(encoder->linebytes + 1);
+  encoder->lines[1] = (unsigned char*)lodepng_malloc(encoder->linebytes + 1);
+  encoder->filtered = (unsigned char*)lodepng_malloc(encoder->linebytes + 1);
+  ucvector_init(&encoder->chunk);
+  encoder->write = write;
+  encoder->context = context;
+
+  encoder->convert = !lodepng_color_mode_equal(&state->info_raw, color);
+
+  totalsize = (encoder->linebytes + 1) * h;
+  error = filterAttemptsInit(encoder->attempt, encoder->linebytes);
+  /*initialized even on error, so that finish can clean it up*/
+  if(zlib_stream_init(&encoder->zlib, totalsize, &encoder->settings.zlibsettings) && !error) error = 83;
+
+  if(!error && (!encoder->lines[0] || !encoder->lines[1] || !encoder->filtered)) error = 83; /*alloc fail*/
+  if(!error) error = lodepng_info_copy(&encoder->info, &state->info_png);
+  if(!error) error = lodepng_color_mode_copy(&encoder->info_raw, &state->info_raw);
+  if(!error)
+  {
+    /*padding bits at the end of the rows stay zero*/
+    memset(encoder->lines[0], 0, encoder->linebytes + 1);
+    memset(encoder->lines[1], 0, encoder->linebytes + 1);
+    error = addChunksBeforeIDAT(&encoder->chunk, w, h, &encoder->info, &encoder->settings);
+  }
+  if(!error) error = write(context, encoder->chunk.data, encoder->chunk.size);
+
+  encoder->error = error;
+  return error;
+}
+
+unsigned lodepng_row_encoder_write(LodePNGRowEncoder* encoder, const unsigned char* rows, unsigned numrows)
+{
+  unsigned i;
+  if(encoder->error) return encoder->error;
+  if(numrows > encoder->h - encoder->y) CERROR_RETURN_ERROR(encoder->error, 96);
+
+  for(i = 0; i != numrows; ++i)
+  {
+    const unsigned char* row = &rows[i * encoder->rawlinebytes];
+    unsigned char* line = encoder->lines[encoder->y & 1];
+    const unsigned char* prevline = encoder->y == 0 ? 0 : encoder->lines[(encoder->y + 1) & 1];
+
+    if(encoder->convert)
+    {
+      encoder->error = lodepng_convert(line, row, &encoder->info.color, &encoder->info_raw, encoder->w, 1);
+      if(encoder->error) return encoder->error;
+    }
+    else memcpy(line, row, encoder->linebytes);
+
+    if(encoder->y % filterBandRows(encoder->linebytes) == 0) filterModelInit(&encoder->model);
+    filterRow(encoder->filtered, line, prevline, encoder->linebytes, encoder->bytewidth, encoder->y,
+              encoder->strategy, &encoder->settings, encoder->attempt, &encoder->model);
+    encoder->error = zlib_stream_write(&encoder->zlib, encoder->filtered, encoder->linebytes + 1);
+    if(encoder->error) return encoder->error;
+    ++encoder->y;
+
+    while(zlib_stream_available(&encoder->zlib) >= encoder->settings.idat_size)
+    {
+      encoder->error = rowEncoderWriteIDAT(encoder, encoder->settings.idat_size);
+      if(encoder->error) return encoder->error;
+    }
+  }
+  return 0;
+}
+
+unsigned lodepng_row_encoder_finish(LodePNGRowEncoder* encoder)
+{
+  unsigned error;
+  if(!encoder) return 0;
+
+  error = encoder->error;
+  if(!error && encoder->y != encoder->h) error = 97; /*not all rows given*/
+  if(!error) error = zlib_stream_finish(&encoder->zlib);
+  while(!error && zlib_stream_available(&encoder->zlib) > 0)
+  {
+    size_t amount = zlib_stream_available(&encoder->zlib);
+    if(amount > encoder->settings.idat_size) amount = encoder->settings.idat_size;
+    error = rowEncoderWriteIDAT(encoder, amount);
+  }
+  if(!error)
+  {
+    encoder->chunk.size = 0;
+    error = addChunksAfterIDAT(&encoder->chunk, &encoder->info, &encoder->settings);
+  }
+  if(!error) error = encoder->write(encoder->context, encoder->chunk.data, encoder->chunk.size);
+
+  lodepng_info_cleanup(&encoder->info);
+  lodepng_color_mode_cleanup(&encoder->info_raw);
+  lodepng_free(encoder->lines[0]);
+  lodepng_free(encoder->lines[1]);
+  lodepng_free(encoder->filtered);
+  filterAttemptsCleanup(encoder->attempt);
+  zlib_stream_cleanup(&encoder->zlib);
+  ucvector_cleanup(&encoder->chunk);
+  lodepng_free(encoder);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+unsigned lodepng_write_file(void* file, const unsigned char* data, size_t size)
+{
+  return fwrite(data, 1, size, (FILE*)file) == size ? 0 : 79;
+}
+#endif /*LODEPNG_COMPILE_DISK*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 {
   lodepng_compress_settings_init(&settings->zlibsettings);
@@ -5881,6 +9599,11 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->restart_rows = 0;
+  settings->idat_size = 65536;
+  settings->time_budget = 0;
+  settings->budget_clock = 0;
+  settings->budget_clock_context = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -5992,6 +9715,17 @@ const char* lodepng_error_text(unsigned code)
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
+    case 95: return "Adam7 interlaced images can't be encoded row by row";
+    case 96: return "more rows given to the row encoder than the image height";
+    case 97: return "row encoder finished before all rows of the image were given";
+    case 98: return "a restart segment starts with a scanline that needs the one above it";
+    case 99: return "invalid compression level, must be 0 to 9";
+    case 100: return "invalid deflate strategy given for LodePNGCompressSettings.strategy";
+    case 101: return "invalid idat_size, must be 1 to 2^31 - 1";
+    case 102: return "rows written to a row encoder that wasn't begun";
+    case 103: return "time_budget is set without an encoder context to keep the timings in";
+    case 104: return "the Adler-32 code path isn't compiled in or the CPU doesn't have it";
+    case 105: return "time_budget is set without a budget_clock on a system lodepng has no monotonic clock for";
   }
   return "unknown error code";
 }
@@ -6030,7 +9764,7 @@ unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, si
 {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
-  unsigned error = zlib_decompress(&buffer, &buffersize, in, insize, &settings);
+  unsigned error = zlib_decompress(&buffer, &buffersize, 0, in, insize, &settings);
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
@@ -6176,6 +9910,21 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, colortype, bitdepth);
 }
 
+EncoderContext::EncoderContext()
+{
+  lodepng_encoder_context_new(&context);
+}
+
+EncoderContext::~EncoderContext()
+{
+  lodepng_encoder_context_delete(context);
+}
+
+LodePNGEncoderContext* EncoderContext::get() const
+{
+  return context;
+}
+
 unsigned encode(std::vector<unsigned char>& out,
                 const unsigned char* in, unsigned w, unsigned h,
                 State& state)
@@ -6199,6 +9948,57 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, state);
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+RowEncoder::RowEncoder() : encoder(0), rowsize(0), file(0)
+{
+}
+
+RowEncoder::~RowEncoder()
+{
+  finish();
+}
+
+unsigned RowEncoder::begin(unsigned w, unsigned h, const State& state, LodePNGWriteCallback write, void* context)
+{
+  finish(); /*of the image begun before, if any*/
+  rowsize = (w * (size_t)lodepng_get_bpp(&state.info_raw) + 7) / 8;
+  return lodepng_row_encoder_begin(&encoder, w, h, &state, write, context);
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+unsigned RowEncoder::begin(unsigned w, unsigned h, const State& state, const std::string& filename)
+{
+  finish();
+  file = fopen(filename.c_str(), "wb");
+  if(!file) return 79;
+  rowsize = (w * (size_t)lodepng_get_bpp(&state.info_raw) + 7) / 8;
+  return lodepng_row_encoder_begin(&encoder, w, h, &state, lodepng_write_file, file);
+}
+#endif /* LODEPNG_COMPILE_DISK */
+
+unsigned RowEncoder::write(const unsigned char* rows, unsigned numrows)
+{
+  if(!encoder) return 102;
+  return lodepng_row_encoder_write(encoder, rows, numrows);
+}
+
+unsigned RowEncoder::write(const std::vector<unsigned char>& rows)
+{
+  return write(rows.empty() ? 0 : &rows[0], rowsize ? (unsigned)(rows.size() / rowsize) : 0);
+}
+
+unsigned RowEncoder::finish()
+{
+  unsigned error = lodepng_row_encoder_finish(encoder);
+  encoder = 0;
+#ifdef LODEPNG_COMPILE_DISK
+  if(file && fclose((FILE*)file) != 0 && !error) error = 79;
+#endif /* LODEPNG_COMPILE_DISK */
+  file = 0;
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
@@ -37,7 +37,8 @@ The "NO_COMPILE" defines are designed to be used to pass as defines to the
 compiler command to disable them without modifying this header, e.g.
 -DLODEPNG_NO_COMPILE_ZLIB for gcc.
 In addition to those below, you can also define LODEPNG_NO_COMPILE_CRC to
-allow implementing a custom lodepng_crc32.
+allow implementing a custom lodepng_crc32, and LODEPNG_NO_COMPILE_SSE2 to use
+the plain C PNG filters on x86 too.
 */
 /*deflate & zlib. If disabled, you must specify alternative zlib functions in
 the custom_zlib field of the compress and decompress settings*/
@@ -276,6 +277,33 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Memory of the encoder that is kept from one encode to the next: the LZ77 hash tables and output, the filter
+scratch lines, the filtered image and its zlib data. For many small images, allocating and clearing these every
+time takes about as long as compressing. Give it as context in the LodePNGCompressSettings (for the PNG encoder,
+those in state->encoder.zlibsettings). Between encodes the hash tables are emptied without going over them, the
+buffers keep their size. It also keeps the timings that time_budget (in LodePNGEncoderSettings) chooses the
+settings by. A context must only be used by one encode at a time. It isn't used by custom_zlib or
+custom_deflate, by the pieces of parallel_for or by the row encoder.
+*/
+typedef struct LodePNGEncoderContext LodePNGEncoderContext;
+/*makes a new context in *context, returns error 83 if out of memory*/
+unsigned lodepng_encoder_context_new(LodePNGEncoderContext** context);
+/*frees the context and all its memory, NULL is allowed*/
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context);
+
+/*how the encoder looks for LZ77 matches, like the strategies of zlib*/
+typedef enum LodePNGDeflateStrategy
+{
+  /*search the hash chains for the longest match, as the other LZ77 settings say*/
+  LDS_DEFAULT,
+  /*only look for runs: matches at distance 1, 2, 3, 4, 6 or 8, the pixel sizes in bytes of PNG images, which
+  is where the filtered data of gray images and masks repeats. No hash table, much faster than the hash chains*/
+  LDS_RLE,
+  /*no matches at all, only Huffman coding of the bytes, like use_lz77 0. The fastest that still compresses*/
+  LDS_HUFFMAN_ONLY
+} LodePNGDeflateStrategy;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -290,6 +318,25 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*most earlier positions with the same hash to try per position, 0 for windowsize if windowsize is at least 8192,
+  otherwise windowsize / 8. 1 with lazymatching 0 is greedy single probe matching, the fastest. Default: 0*/
+  unsigned maxchainlength;
+  /*how to look for matches if use_lz77 is 1, see LodePNGDeflateStrategy. windowsize, minmatch, nicematch,
+  lazymatching and maxchainlength are only used by LDS_DEFAULT. Default: LDS_DEFAULT*/
+  LodePNGDeflateStrategy strategy;
+
+  /*If not NULL, lodepng_zlib_compress (and so the PNG encoder) deflates data of more than 512K in pieces of 512K
+  at the same time: parallel_for must call task(data, i) once for every i from 0 to count - 1, possibly on several
+  threads at the same time, and return when all of them are done, like the one of the decoder. Every piece can
+  refer back to the window before it and all but the last end with an empty stored block, so the result is a few
+  bytes bigger per piece, and the same for any amount of threads. Not used with custom_zlib or custom_deflate, by
+  lodepng_deflate or by the row encoder. The PNG encoder also chooses the filters of bands of 256K of scanlines at
+  the same time with it, which gives the same result as one after the other. Default: NULL*/
+  void (*parallel_for)(void (*task)(void* data, size_t index), void* data, size_t count, void* context);
+  void* parallel_context;
+
+  /*if not NULL, the memory to encode with, kept for the next encode, see LodePNGEncoderContext. Default: NULL*/
+  LodePNGEncoderContext* context;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -307,6 +354,15 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*
+Sets the LZ77 settings (windowsize, minmatch, nicematch, lazymatching and maxchainlength) to a preset, like the
+levels of zlib: 1 is fast with bigger output, 9 is slow and small, 6 is about as fast as the default settings
+and compresses better. 0 is the fastest there is: greedy matching with a single probe. Unlike in zlib, 0 still
+compresses; use btype 0 for no compression. All but level 9 use minmatch 4, which also makes the hash use 4 bytes
+instead of 3: in filtered image data 3-byte matches hardly ever pay for their distance. Returns error 99 if level
+is bigger than 9.
+*/
+unsigned lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -524,6 +580,13 @@ typedef struct LodePNGDecoderSettings
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*If not NULL, lodepng_decode decodes images that have a restart index (see restart_rows in the encoder
+  settings) in parallel: parallel_for must call task(data, i) once for every i from 0 to count - 1, possibly on
+  several threads at the same time, and return when all of them are done. It gets parallel_context as
+  context. Images without restart index, or with custom zlib or inflate functions, don't use it. Default: NULL*/
+  void (*parallel_for)(void (*task)(void* data, size_t index), void* data, size_t count, void* context);
+  void* parallel_context;
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
   /*store all bytes from unknown chunks in the LodePNGInfo (off by default, useful for a png editor)*/
@@ -551,7 +614,15 @@ typedef enum LodePNGFilterStrategy
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
-  LFS_PREDEFINED
+  LFS_PREDEFINED,
+  /*
+  Use the filter type whose bytes cost the fewest bits by the statistics of the filtered bytes of the scanlines
+  before it, which is about what the Huffman codes of deflate will make of them, with bytes that repeat the one
+  before them as good as free like LZ77 makes them. Smaller than MINSUM and ENTROPY on most images, and much
+  faster than BRUTE_FORCE. The statistics start over every 256K of scanlines, so that bands filtered at the
+  same time with parallel_for give the same result.
+  */
+  LFS_ADAPTIVE
 } LodePNGFilterStrategy;
 
 /*Gives characteristics about the colors of the image, which helps decide which color model to use for encoding.
@@ -605,6 +676,29 @@ typedef struct LodePNGEncoderSettings
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
+
+  /*If not 0, the image data starts over every restart_rows scanlines: the deflate window is reset there and
+  the scanline uses filter type None or Sub, which don't need the one above it. The positions go in a private
+  prIX chunk before the IDAT chunks, so that a decoder with parallel_for can decode the parts at the same
+  time. The PNG stays valid for every decoder, and gets a bit bigger. Not used for interlaced images, with
+  custom zlib or deflate functions, or by the row encoder. Default: 0*/
+  unsigned restart_rows;
+  /*The most compressed bytes the row encoder puts in one IDAT chunk, it writes one as soon as it has that many:
+  smaller gets the file out sooner, bigger has less chunk overhead. Must be 1 to 2^31 - 1, error 101 otherwise.
+  lodepng_encode writes all image data in one IDAT chunk and doesn't use it. Default: 65536*/
+  unsigned idat_size;
+  /*If not 0, the microseconds lodepng_encode may take. It then chooses the deflate strategy, the level (see
+  lodepng_compress_settings_set_level) and the filter strategy itself, the most compressing ones it expects to
+  finish in time, and leaves them in these settings to show what was chosen. The expected time comes from the
+  earlier encodes with the encoder context in zlibsettings on this machine, so it needs one (error 103 otherwise),
+  and the first encodes may miss the budget. parallel_for is used as it is set, and counted in the times. For a
+  throughput in bytes per second, give the raw image size divided by it. Not used by the row encoder. Default: 0*/
+  unsigned time_budget;
+  /*The clock time_budget measures encodes with, called with budget_clock_context: seconds since any fixed time,
+  and it must never go back. If NULL, lodepng uses CLOCK_MONOTONIC, or QueryPerformanceCounter on Windows. On
+  systems that have neither, time_budget needs it (error 105 otherwise). Default: NULL*/
+  double (*budget_clock)(void* context);
+  void* budget_clock_context;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -659,6 +753,49 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Receives one decoded row of the image. y is the index of the row. Returns an error code: anything
+other than 0 stops decoding, and lodepng_decode_rows then returns this value as error.
+*/
+typedef unsigned (*LodePNGRowCallback)(void* context, const unsigned char* row, unsigned y);
+
+/*
+Same as lodepng_decode, but instead of returning one buffer with the whole image, gives every row
+to callback as soon as it is decoded. The image data is inflated through a small window and each
+scanline is unfiltered as it comes out, so apart from the PNG file itself only a few rows and the
+32K zlib window are in memory, no matter how large the image is.
+The rows are in the color type of state->info_raw, like the output of lodepng_decode, except that
+every row starts at a byte boundary: each row is (w * bpp + 7) / 8 bytes, also for bpp < 8.
+Adam7 interlaced images can only be reconstructed once all passes are decoded. For those, the whole
+image is decoded first and then given row by row.
+*/
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             LodePNGRowCallback callback, void* context);
+
+/*
+Decodes a PNG that arrives in pieces, e.g. while it's still being read from a file: same as
+lodepng_decode_rows, but the PNG file is given with any number of lodepng_row_decoder_write calls, and
+rows are given to the callback as soon as the data for them has arrived. Only the chunk being received
+is collected, the data of IDAT chunks goes to the inflater right away. Exceptions: Adam7 interlaced
+PNGs are collected in full and decoded at the end, and the CRC of an IDAT chunk is only checked after its
+data was decoded.
+*/
+typedef struct LodePNGRowDecoder LodePNGRowDecoder;
+
+/*Creates the decoder in *decoder. The state is used while decoding and must stay alive until finish.*/
+unsigned lodepng_row_decoder_begin(LodePNGRowDecoder** decoder, LodePNGState* state,
+                                   LodePNGRowCallback callback, void* context);
+
+/*
+Gives the next size bytes of the PNG file to the decoder. Returns error code. After an error, further
+data is ignored, and finish returns the same error.
+*/
+unsigned lodepng_row_decoder_write(LodePNGRowDecoder* decoder, const unsigned char* data, size_t size);
+
+/*Decodes what is left after the last data, gives the size of the image and frees the decoder. Returns error code.*/
+unsigned lodepng_row_decoder_finish(LodePNGRowDecoder* decoder, unsigned* w, unsigned* h);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -667,6 +804,51 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Receives the next size bytes of the PNG file while it's being encoded. Returns an error code:
+anything other than 0 stops encoding, and the row encoder then returns this value as error.
+*/
+typedef unsigned (*LodePNGWriteCallback)(void* context, const unsigned char* data, size_t size);
+
+/*
+Encoder that takes the image row by row instead of all at once, and gives the PNG file to a write
+callback piece by piece while encoding. Rows are filtered and deflated as they come in and IDAT
+chunks are written as soon as enough compressed data is available, so only a few rows and the
+deflate window are in memory, no matter how large the image is.
+Usage: lodepng_row_encoder_begin, then lodepng_row_encoder_write until all h rows are given, then
+lodepng_row_encoder_finish. The encoder must always be finished, also after an error, to free it.
+*/
+typedef struct LodePNGRowEncoder LodePNGRowEncoder;
+
+/*
+Creates the encoder in *encoder and writes the chunks that come before the image data.
+The settings are taken from state, like lodepng_encode does, with these differences:
+-the rows are converted from state->info_raw to state->info_png.color as is: auto_convert can't be
+ done because that requires seeing the whole image first.
+-Adam7 interlacing is not supported (error 95).
+-custom_zlib and custom_deflate are not used, the built in deflate is.
+The state is copied, it doesn't have to stay alive until the encoder is finished.
+*/
+unsigned lodepng_row_encoder_begin(LodePNGRowEncoder** encoder, unsigned w, unsigned h,
+                                   const LodePNGState* state,
+                                   LodePNGWriteCallback write, void* context);
+
+/*
+Encodes the next numrows rows, given in the color type of info_raw. Each row starts at a byte
+boundary: rows is numrows times (w * bpp + 7) / 8 bytes, also for bpp < 8.
+*/
+unsigned lodepng_row_encoder_write(LodePNGRowEncoder* encoder, const unsigned char* rows, unsigned numrows);
+
+/*Writes the remaining image data and the chunks after it, and frees the encoder. Returns error code.*/
+unsigned lodepng_row_encoder_finish(LodePNGRowEncoder* encoder);
+
+#ifdef LODEPNG_COMPILE_DISK
+/*LodePNGWriteCallback that writes to the FILE* given as context, which stays open. Error 79 if that fails.*/
+unsigned lodepng_write_file(void* file, const unsigned char* data, size_t size);
+#endif /*LODEPNG_COMPILE_DISK*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -736,6 +918,10 @@ unsigned lodepng_chunk_create(unsigned char** out, size_t* outlength, unsigned l
 
 /*Calculate CRC32 of buffer*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len);
+
+/*CRC32 of two buffers after each other, from the CRC32 of both and the length of the second. With it, pieces of a
+large buffer can be checksummed separately, e.g. on several threads.*/
+unsigned lodepng_crc32_combine(unsigned crc1, unsigned crc2, size_t len2);
 #endif /*LODEPNG_COMPILE_PNG*/
 
 
@@ -746,6 +932,15 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*
+Adler-32 of data in *result, continued from adler (1 for the first piece), with one of its code paths: 0 the plain
+loop, 1 SSSE3, 2 AVX2, each followed by the plain loop for the bytes left. This function is in the public interface
+only for tests, to check every SIMD path on a CPU where the zlib code always takes the best one. Returns error
+104 if the path isn't compiled in or the CPU doesn't have it.
+*/
+unsigned lodepng_adler32_path(unsigned* result, unsigned adler, const unsigned char* data, size_t len,
+                              unsigned path);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -837,6 +1032,19 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/* Owns a LodePNGEncoderContext. get() is NULL if it couldn't be made, then encoding just doesn't reuse memory. */
+class EncoderContext
+{
+  public:
+    EncoderContext();
+    ~EncoderContext();
+    LodePNGEncoderContext* get() const;
+  private:
+    EncoderContext(const EncoderContext& other); /*not copyable*/
+    EncoderContext& operator=(const EncoderContext& other);
+    LodePNGEncoderContext* context;
+};
+
 /* Same as other lodepng::encode, but using a State for more settings and information. */
 unsigned encode(std::vector<unsigned char>& out,
                 const unsigned char* in, unsigned w, unsigned h,
@@ -844,6 +1052,34 @@ unsigned encode(std::vector<unsigned char>& out,
 unsigned encode(std::vector<unsigned char>& out,
                 const std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Owns a LodePNGRowEncoder, see there: begin, then write until all rows are given, then finish. If it isn't
+finished, the destructor does it and the error is lost. begin with a filename writes to that file, which is
+overwritten without warning and closed by finish.
+*/
+class RowEncoder
+{
+  public:
+    RowEncoder();
+    ~RowEncoder();
+    unsigned begin(unsigned w, unsigned h, const State& state, LodePNGWriteCallback write, void* context);
+#ifdef LODEPNG_COMPILE_DISK
+    unsigned begin(unsigned w, unsigned h, const State& state, const std::string& filename);
+#endif /* LODEPNG_COMPILE_DISK */
+    /*rows in the color type of info_raw, the vector one writes all whole rows in it*/
+    unsigned write(const unsigned char* rows, unsigned numrows);
+    unsigned write(const std::vector<unsigned char>& rows);
+    unsigned finish();
+  private:
+    RowEncoder(const RowEncoder& other); /*not copyable*/
+    RowEncoder& operator=(const RowEncoder& other);
+    LodePNGRowEncoder* encoder;
+    size_t rowsize; /*bytes per row given to write*/
+    void* file; /*the FILE* of begin with a filename, or NULL*/
+};
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -1584,6 +1820,7 @@ state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
 state.encoder.zlibsettings.custom_...: use custom deflate function
+state.encoder.zlibsettings.context: reuse the encoder memory for many images
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
 state.encoder.filter_strategy: PNG filter strategy to encode with